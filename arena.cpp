@@ -0,0 +1,35 @@
+#include "arena.h"
+
+// function which hands out size bytes aligned to align, starting a new chunk if the current one is full
+// returns NULL if malloc fails
+void* Arena::allocate(size_t size, size_t align) {
+    std::lock_guard<std::mutex> guard(lock);
+    char* start = (char*) (((uintptr_t) next + align - 1) & ~(uintptr_t) (align - 1));
+    if (!next || start + size > end) {
+        size_t chunk_size = size + align > ARENA_CHUNK ? size + align : ARENA_CHUNK;   // an oversized object gets a chunk to itself
+        char* chunk = (char*) malloc(chunk_size);
+        if (!chunk) return NULL;
+        chunks->push_back(chunk);
+        reserved += chunk_size;
+        next = chunk;
+        end = chunk + chunk_size;
+        start = (char*) (((uintptr_t) next + align - 1) & ~(uintptr_t) (align - 1));
+    }
+    used += start + size - next;
+    next = start + size;
+    return start;
+}
+
+// function which copies a string into the arena with a terminating NUL, the copy lives as long as the arena
+const char* Arena::intern(const char* str, size_t len) {
+    char* copy = (char*) allocate(len + 1, 1);
+    if (!copy) return NULL;
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+Arena::~Arena() {
+    for (auto it : *chunks) free(it);
+    delete chunks;
+}
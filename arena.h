@@ -0,0 +1,34 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <mutex>
+#include <vector>
+
+#define ARENA_CHUNK (1024 * 1024)     // bytes the arena takes from malloc at a time
+
+// Arena class, a bump allocator for objects that live as long as the arena does
+// memory is carved out of large chunks with no per-object header, and is only given back all at once when the arena is deleted,
+// so it suits the topic tree, whose nodes and names are never freed while the server runs
+class Arena {
+    private:
+        std::mutex lock;                // topics are created from every shard
+        std::vector<char*>* chunks = new std::vector<char*>();
+        char* next = NULL;              // the free part of the current chunk
+        char* end = NULL;
+        size_t used = 0;                // bytes handed out, including alignment padding
+        size_t reserved = 0;            // bytes taken from malloc
+
+    public:
+        Arena() {}
+        ~Arena();
+        void* allocate(size_t size, size_t align);
+        const char* intern(const char* str, size_t len);
+        size_t get_used() { return used; }
+        size_t get_reserved() { return reserved; }
+};
+
+#endif
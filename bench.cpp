@@ -0,0 +1,458 @@
+#include "bench.h"
+
+// function which connects a connection to the server and queues its CONN, the rest of the handshake happens in the worker loop
+// the connect itself blocks, so a worker opens its connections one after another before it starts polling
+int BenchWorker::open_conn(bench_conn_t* conn, struct addrinfo* addr) {
+    int fd = socket(addr->ai_family, SOCK_STREAM, 0);
+    if (fd == -1) return 1;
+    if (connect(fd, addr->ai_addr, addr->ai_addrlen)) {
+        close(fd);
+        return 1;
+    }
+    int yes = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(int));       // latency is what we measure, small publishes must not wait on Nagle
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    struct epoll_event event = {};
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET;                       // edge triggered, every read and write goes on until EAGAIN
+    event.data.ptr = conn;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event)) {
+        close(fd);
+        return 1;
+    }
+    conn->fd = fd;
+
+    frame_t frame = {OP_CONN, "", std::string(1, (char) PROTOCOL_FRAMED)};
+    encode_frame(&frame, conn->out);
+    return write_conn(conn);
+}
+
+// function which closes a connection, anything it had buffered is dropped
+int BenchWorker::close_conn(bench_conn_t* conn) {
+    if (conn->fd == -1) return 0;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    conn->fd = -1;
+    return 0;
+}
+
+// function which handles a frame from the server, returns 1 if the connection is no use any more
+int BenchWorker::handle_frame(bench_conn_t* conn, frame_t* frame) {
+    switch (frame->op) {
+        case OP_CONN_ACK:                                               // a publisher can start right away, a subscriber has to subscribe first
+            if (frame->msg.size() < 1 || (uint8_t) frame->msg[0] != PROTOCOL_FRAMED) return 1;
+            if (conn->publisher) {
+                conn->ready = 1;
+                stats->ready.add(1);
+                return 0;
+            }
+            else {
+                char topic[64];
+                snprintf(topic, sizeof(topic), BENCH_TOPIC, conn->topic);
+                frame_t sub = {OP_SUB, conn->topic == -1 ? BENCH_FILTER : topic, ""};
+                frame_t list = {OP_LIST, "", ""};                       // answered once the SUB before it has been applied
+                encode_frame(&sub, conn->out);
+                encode_frame(&list, conn->out);
+                return write_conn(conn);
+            }
+        case OP_LIST:
+            if (!conn->ready) {
+                conn->ready = 1;
+                stats->ready.add(1);
+            }
+            return 0;
+        case OP_PUB: {
+            if (frame->msg.size() < BENCH_STAMP) return 1;
+            uint64_t now = metrics_now();
+            uint64_t stamp;
+            memcpy(&stamp, frame->msg.data(), BENCH_STAMP);
+            if (stamp < window[0].load() || stamp >= window[1].load()) return 0; // part of the warmup, or published after the window closed
+            stats->delivered.add(1);
+            stats->bytes.add(frame->msg.size());
+            stats->latency.record(now > stamp ? now - stamp : 0);
+            return 0;
+        }
+        case OP_PING: {                                                 // the server's keepalive, an idle subscriber must answer it to stay connected
+            frame_t pong = {OP_PONG, "", ""};
+            encode_frame(&pong, conn->out);
+            return write_conn(conn);
+        }
+        case OP_DISC:                                                   // the server is shutting down
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// function which reads everything the server has sent and handles each whole frame, returns 1 if the connection should be closed
+int BenchWorker::read_conn(bench_conn_t* conn) {
+    frame_t frame;
+    while (1) {
+        ssize_t nread = conn->decoder->get_buffer()->read_from_fd(conn->fd, RING_SIZE);
+        if (nread == 0) return 1;                                       // the server hung up
+        if (nread == -1) {
+            if (errno == EINTR) continue;
+            return errno != EAGAIN;
+        }
+        int ret;
+        while ((ret = conn->decoder->next(&frame)) == 1) {
+            if (handle_frame(conn, &frame)) return 1;
+        }
+        if (ret == -1) return 1;
+    }
+}
+
+// function which writes as much of a connection's output as the socket takes, returns 1 if the connection failed
+int BenchWorker::write_conn(bench_conn_t* conn) {
+    while (conn->out->size() > 0) {
+        ssize_t nwritten = conn->out->write_to_fd(conn->fd);
+        if (nwritten == -1) {
+            if (errno == EINTR) continue;
+            return errno != EAGAIN;                                     // the rest goes out when the socket is writable again
+        }
+    }
+    return 0;
+}
+
+// function which returns when a rate limited publisher is next due to send, once the last message of its batch is
+static uint64_t batch_due(bench_conn_t* conn, bench_options_t* options) {
+    return conn->next_send + (uint64_t) (1000000000 / options->rate) * (options->batch - 1);
+}
+
+// function which queues every publish a publisher is due to make and writes them out
+// a rate limited publisher stamps each publish with when it was due rather than when it went out, so a server that holds the
+// publisher back shows up as latency instead of quietly lowering the rate
+// a batching publisher sends its messages once the last one of the batch is due, each stamped with when it was due itself
+// a publisher that filled its output is left waiting until EPOLLOUT, otherwise a rate limited one goes back on the due heap
+int BenchWorker::publish(bench_conn_t* conn, uint64_t now) {
+    uint64_t interval = options->rate > 0 ? (uint64_t) (1000000000 / options->rate) : 0;
+    size_t stride = conn->frame.msg.size() / options->batch;           // every entry is the same size, the stamp ends its header
+    while (conn->out->size() < BENCH_OUT_HIGH) {
+        uint64_t stamp;
+        if (interval) {
+            if (batch_due(conn, options) > now) break;
+            stamp = conn->next_send;
+            conn->next_send += interval * options->batch;
+        }
+        else stamp = metrics_now();
+        for (int i = 0; i < options->batch; i++, stamp += interval) {
+            memcpy(&conn->frame.msg[(i + 1) * stride - options->payload], &stamp, BENCH_STAMP);
+            if (stamp >= window[0].load() && stamp < window[1].load()) {
+                stats->published.add(1);
+                stats->expected.add(fanout[conn->topic]);
+            }
+        }
+        encode_frame(&conn->frame, conn->out);
+    }
+    if (write_conn(conn)) return 1;
+    conn->waiting = conn->out->size() >= BENCH_OUT_HIGH;
+    if (interval && !conn->waiting) due->push({batch_due(conn, options), conn});
+    return 0;
+}
+
+// function which starts every ready publisher off, rate limited ones are spread over their first interval so they do not
+// all publish at once
+int BenchWorker::start_publishing(uint64_t now) {
+    uint64_t interval = options->rate > 0 ? (uint64_t) (1000000000 / options->rate) : 0;
+    for (auto it : *conns) {
+        if (!it->publisher || !it->ready || it->fd == -1) continue;
+        it->next_send = now + interval * it->id / options->publishers;
+        if (interval) due->push({batch_due(it, options), it});
+    }
+    return 0;
+}
+
+// function which makes every publish that is due, returns how many nanoseconds the worker may sleep before the next one
+// rate limited publishers are kept on a heap by when they are next due, so a worker with thousands of them only touches the ones
+// that have something to send, unlimited ones are all topped up every time round
+int64_t BenchWorker::publish_due(uint64_t now) {
+    int64_t timeout = (int64_t) BENCH_POLL_MS * 1000000;
+    if (options->rate > 0) {
+        while (due->size() > 0 && due->top().first <= now) {
+            bench_conn_t* conn = due->top().second;
+            due->pop();
+            if (conn->fd != -1 && publish(conn, now)) fail_conn(conn);
+        }
+        if (due->size() > 0 && (int64_t) (due->top().first - now) < timeout) timeout = due->top().first - now;
+        return timeout;
+    }
+    for (auto it : *conns) {
+        if (!it->publisher || !it->ready || it->fd == -1 || it->waiting) continue;
+        if (publish(it, now)) fail_conn(it);
+        else if (!it->waiting) timeout = 0;
+    }
+    return timeout;
+}
+
+// function which closes a connection that failed and counts it
+int BenchWorker::fail_conn(bench_conn_t* conn) {
+    close_conn(conn);
+    stats->failed.add(1);
+    return 0;
+}
+
+// the body of each worker thread, which opens its connections then drives them until the run is done
+void BenchWorker::worker_loop(BenchWorker* worker, struct addrinfo* pub_addr, struct addrinfo* sub_addr) {
+    for (auto it : *worker->conns) {
+        if (worker->open_conn(it, it->publisher ? pub_addr : sub_addr)) worker->fail_conn(it);
+    }
+
+    struct epoll_event events[BENCH_EVENTS];
+    int phase;
+    int publishing = 0;
+    while ((phase = worker->phase->load()) != PHASE_DONE) {
+        int64_t timeout = (int64_t) BENCH_POLL_MS * 1000000;
+        if (phase == PHASE_RUN) {
+            uint64_t now = metrics_now();
+            if (!publishing) publishing = !worker->start_publishing(now);
+            timeout = worker->publish_due(now);
+        }
+
+        // sleeping in whole milliseconds would add up to one to every latency, so the wait is as precise as the kernel allows
+        struct timespec wait = {(time_t) (timeout / 1000000000), (long) (timeout % 1000000000)};
+        int nevents = epoll_pwait2(worker->epoll_fd, events, BENCH_EVENTS, &wait, NULL);
+        if (nevents == -1 && errno == ENOSYS) nevents = epoll_wait(worker->epoll_fd, events, BENCH_EVENTS, (timeout + 999999) / 1000000); // kernels before 5.11
+        for (int i = 0; i < nevents; i++) {
+            bench_conn_t* conn = (bench_conn_t*) events[i].data.ptr;
+            if (conn->fd == -1) continue;                               // closed earlier in this batch
+            int failed = 0;
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) failed = worker->read_conn(conn);
+            if (!failed && (events[i].events & EPOLLOUT)) failed = worker->write_conn(conn);
+            if (failed) worker->fail_conn(conn);
+            else if (conn->waiting && conn->out->size() < BENCH_OUT_HIGH) { // drained, a rate limited publisher goes back on the heap
+                conn->waiting = 0;
+                if (worker->options->rate > 0) worker->due->push({batch_due(conn, worker->options), conn});
+            }
+        }
+    }
+
+    for (auto it : *worker->conns) worker->close_conn(it);
+}
+
+// function which adds a connection for the worker to open once it starts
+int BenchWorker::add_conn(int publisher, int id, int topic) {
+    bench_conn_t* conn = new bench_conn_t;
+    conn->publisher = publisher;
+    conn->id = id;
+    conn->topic = topic;
+    conn->decoder = new FrameDecoder(PROTOCOL_FRAMED, MAX_PAYLOAD);
+    conn->out = new RingBuffer(RING_SIZE);
+    if (publisher) {
+        char name[64];
+        snprintf(name, sizeof(name), BENCH_TOPIC, topic);
+        conn->frame = {OP_PUB, name, std::string(options->payload, 'x')};
+        if (options->batch > 1) {                                       // entries with no topic of their own publish to the prefix
+            conn->frame.msg.clear();
+            for (int i = 0; i < options->batch; i++) encode_entry(&conn->frame.msg, "", std::string(options->payload, 'x'));
+            conn->frame.batch = 1;
+        }
+    }
+    conns->push_back(conn);
+    return 0;
+}
+
+// function which starts the worker thread, the addresses have to stay valid until every connection is open
+int BenchWorker::start(struct addrinfo* pub_addr, struct addrinfo* sub_addr) {
+    thread = new std::thread(worker_loop, this, pub_addr, sub_addr);
+    return 0;
+}
+
+// function which waits for the worker thread to finish, once the phase is PHASE_DONE
+int BenchWorker::join() {
+    if (!thread) return 0;
+    thread->join();
+    delete thread;
+    thread = NULL;
+    return 0;
+}
+
+BenchWorker::BenchWorker(bench_options_t* options, const int* fanout, std::atomic<int>* phase, std::atomic<uint64_t>* window) {
+    this->options = options;
+    this->fanout = fanout;
+    this->phase = phase;
+    this->window = window;
+    this->epoll_fd = epoll_create1(0);
+}
+
+BenchWorker::~BenchWorker() {
+    join();
+    for (auto it : *conns) {
+        close_conn(it);
+        delete it->decoder;
+        delete it->out;
+        delete it;
+    }
+    delete conns;
+    delete due;
+    delete stats;
+    close(epoll_fd);
+}
+
+// function which adds up one counter across every worker
+static uint64_t total_of(std::vector<BenchWorker*>* workers, Counter bench_stats_t::*counter) {
+    uint64_t total = 0;
+    for (auto it : *workers) total += (it->get_stats()->*counter).get();
+    return total;
+}
+
+// function which sleeps until a time on the monotonic clock, or until done returns 1
+template <typename F>
+static int wait_until(uint64_t deadline, F done) {
+    while (!done()) {
+        uint64_t now = metrics_now();
+        if (now >= deadline) return 1;
+        uint64_t left = deadline - now;
+        usleep(left < 10000000 ? left / 1000 + 1 : 10000);
+    }
+    return 0;
+}
+
+// function which prints what a run measured, returns 1 if too few of the expected deliveries arrived
+static int report(bench_options_t* options, std::vector<BenchWorker*>* workers, int wildcards) {
+    uint64_t published = total_of(workers, &bench_stats_t::published);
+    uint64_t expected = total_of(workers, &bench_stats_t::expected);
+    uint64_t delivered = total_of(workers, &bench_stats_t::delivered);
+    uint64_t bytes = total_of(workers, &bench_stats_t::bytes);
+    uint64_t failed = total_of(workers, &bench_stats_t::failed);
+    std::vector<uint64_t> latency(HISTOGRAM_BUCKETS, 0);
+    int highest = -1;
+    for (auto it : *workers) it->get_stats()->latency.add_to(latency.data());
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        if (latency[i]) highest = i;
+    }
+
+    char rate[64];
+    int len = options->rate > 0 ? snprintf(rate, sizeof(rate), "%.0f msgs/s each", options->rate) : snprintf(rate, sizeof(rate), "unlimited rate");
+    if (options->batch > 1) snprintf(rate + len, sizeof(rate) - len, " in batches of %d", options->batch);
+    double fraction = expected ? (double) delivered / expected : 1;
+    printf("%s: %d publishers, %d subscribers (%d wildcard), %d topics, %lu byte payloads, %s, %d threads, %.1fs measured\n", options->name,
+        options->publishers, options->subscribers, wildcards, options->topics, options->payload, rate, options->threads, options->duration);
+    printf("  published %12lu msgs %12.1f msgs/s\n", published, published / options->duration);
+    printf("  delivered %12lu msgs %12.1f msgs/s %10.2f MB/s\n", delivered, delivered / options->duration, bytes / options->duration / (1024 * 1024));
+    printf("  expected  %12lu msgs %12.2f%% delivered\n", expected, fraction * 100);
+    printf("  latency   p50 %.1f usec, p99 %.1f usec, p999 %.1f usec, max %.1f usec\n",
+        Histogram::percentile(latency.data(), delivered, 0.5) / 1000.0, Histogram::percentile(latency.data(), delivered, 0.99) / 1000.0,
+        Histogram::percentile(latency.data(), delivered, 0.999) / 1000.0, highest == -1 ? 0 : Histogram::value_of(highest) / 1000.0);
+    if (failed) printf("  %lu connections failed during the run\n", failed);
+    if (fraction < options->min_delivered || failed) {
+        printf("%s: FAILED, wanted at least %.2f%% delivered\n", options->name, options->min_delivered * 100);
+        return 1;
+    }
+    return 0;
+}
+
+// function which lets the process have as many descriptors as the system allows it, a run can open thousands of connections
+static int raise_fd_limit() {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit)) return 1;
+    limit.rlim_cur = limit.rlim_max;
+    return setrlimit(RLIMIT_NOFILE, &limit);
+}
+
+// main function, which sets up the connections, runs the scenario and reports on it
+int main(int argc, char* argv[]) {
+    bench_options_t options;
+    options.threads = std::thread::hardware_concurrency();
+    int opt;
+    while ((opt = getopt(argc, argv, "P:S:t:s:r:w:T:W:d:e:n:p:B:")) != -1) {
+        switch (opt) {
+            case 'P': options.publishers = atoi(optarg); break;
+            case 'S': options.subscribers = atoi(optarg); break;
+            case 't': options.topics = atoi(optarg); break;             // the publishers are spread over this many topics
+            case 's': options.payload = strtoul(optarg, NULL, 10); break;
+            case 'r': options.rate = atof(optarg); break;
+            case 'w': options.wildcard = atof(optarg); break;
+            case 'T': options.threads = atoi(optarg); break;
+            case 'W': options.warmup = atof(optarg); break;             // seconds of publishing left out of the results
+            case 'd': options.duration = atof(optarg); break;           // seconds of publishing that are measured
+            case 'e': options.min_delivered = atof(optarg); break;      // exit with 1 if less than this fraction of deliveries arrive
+            case 'n': options.name = optarg; break;
+            case 'p': options.sub_port = optarg; break;                 // measures forwarding between two nodes of a cluster
+            case 'B': options.batch = atoi(optarg); break;
+            default:
+                printf("Correct usage:\n%s\n", BENCH_USAGE);
+                return 1;
+        }
+    }
+    if (argc - optind < 2 || options.publishers < 0 || options.subscribers < 0 || options.publishers + options.subscribers == 0 ||
+        options.topics < 1 || options.payload < BENCH_STAMP || options.threads < 1 || options.batch < 1 || options.duration <= 0 || options.warmup < 0) {
+        printf("Correct usage:\n%s\n", BENCH_USAGE);
+        return 1;
+    }
+    options.hostname = argv[optind];
+    options.port = argv[optind + 1];
+
+    signal(SIGPIPE, SIG_IGN);
+    if (raise_fd_limit()) printf("Could not raise the descriptor limit, large runs may fail to connect\n");
+
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* addr;
+    struct addrinfo* sub_addr = NULL;
+    if (getaddrinfo(options.hostname, options.port, &hints, &addr) ||
+        (options.sub_port && getaddrinfo(options.hostname, options.sub_port, &hints, &sub_addr))) {
+        printf("failed to get addrinfo\n");
+        return 1;
+    }
+
+    // subscribers are assigned the same way every run: wildcard ones spread evenly through them, the rest round robin over the topics
+    std::vector<int> fanout(options.topics, 0);
+    std::vector<int> sub_topics(options.subscribers);
+    int wildcards = 0;
+    for (int i = 0; i < options.subscribers; i++) {
+        if ((int) ((i + 1) * options.wildcard) > (int) (i * options.wildcard)) {
+            sub_topics[i] = -1;
+            wildcards++;
+        }
+        else {
+            sub_topics[i] = i % options.topics;
+            fanout[i % options.topics]++;
+        }
+    }
+    for (auto& it : fanout) it += wildcards;
+
+    std::atomic<int> phase(PHASE_SETUP);
+    std::atomic<uint64_t> window[2];
+    window[0].store(UINT64_MAX);                                        // nothing counts until the window is set
+    window[1].store(UINT64_MAX);
+    std::vector<BenchWorker*> workers;
+    for (int i = 0; i < options.threads; i++) workers.push_back(new BenchWorker(&options, fanout.data(), &phase, window));
+    int n = 0;
+    for (int i = 0; i < options.publishers; i++) workers[n++ % options.threads]->add_conn(1, i, i % options.topics);
+    for (int i = 0; i < options.subscribers; i++) workers[n++ % options.threads]->add_conn(0, i, sub_topics[i]);
+    for (auto it : workers) it->start(addr, sub_addr ? sub_addr : addr);
+
+    int total = options.publishers + options.subscribers;
+    int failed = wait_until(metrics_now() + (uint64_t) BENCH_READY_TIMEOUT * 1000000000, [&]() {
+        return total_of(&workers, &bench_stats_t::ready) + total_of(&workers, &bench_stats_t::failed) >= (uint64_t) total;
+    });
+    uint64_t ready = total_of(&workers, &bench_stats_t::ready);
+    if (failed || ready < (uint64_t) total) {
+        printf("%s: only %lu of %d connections were ready, is the server up and allowing that many clients?\n", options.name, ready, total);
+        phase.store(PHASE_DONE);
+        for (auto it : workers) delete it;
+        freeaddrinfo(addr);
+        if (sub_addr) freeaddrinfo(sub_addr);
+        return 1;
+    }
+
+    uint64_t start = metrics_now() + (uint64_t) (options.warmup * 1000000000);
+    uint64_t end = start + (uint64_t) (options.duration * 1000000000);
+    window[0].store(start);
+    window[1].store(end);
+    phase.store(PHASE_RUN);
+    wait_until(end, []() { return 0; });
+    phase.store(PHASE_DRAIN);
+    wait_until(end + (uint64_t) BENCH_DRAIN_TIMEOUT * 1000000000, [&]() {
+        return total_of(&workers, &bench_stats_t::delivered) >= total_of(&workers, &bench_stats_t::expected);
+    });
+    phase.store(PHASE_DONE);
+    for (auto it : workers) it->join();
+
+    failed = report(&options, &workers, wildcards);
+    for (auto it : workers) delete it;
+    freeaddrinfo(addr);
+    if (sub_addr) freeaddrinfo(sub_addr);
+    return failed;
+}
@@ -0,0 +1,130 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <atomic>
+#include <functional>
+#include <queue>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "buffer.h"
+#include "frame.h"
+#include "histogram.h"
+
+#define BENCH_TOPIC "bench/%d/data"   // the topics publishers are spread over, subscribers name one of them or BENCH_FILTER
+#define BENCH_FILTER "bench/+/data"   // what a wildcard subscriber subscribes to, it matches every publisher
+#define BENCH_STAMP 8                 // bytes at the start of every payload holding when it was meant to be sent, nanoseconds on the monotonic clock
+#define BENCH_OUT_HIGH (256 * 1024)   // bytes a publisher may have unsent before it stops producing, so a full socket holds back the fastest rate
+#define BENCH_READY_TIMEOUT 10        // seconds every connection has to be connected and subscribed before the run is abandoned
+#define BENCH_DRAIN_TIMEOUT 2         // seconds to wait after the last publish for every expected delivery to arrive
+#define BENCH_EVENTS 256              // max number of events each worker handles per epoll_wait
+#define BENCH_POLL_MS 100             // longest a thread sleeps before checking what phase the run is in
+#define BENCH_USAGE "./bench <hostname> <port> [-P publishers] [-S subscribers] [-t topics] [-s payload_bytes] [-r msgs_per_sec] [-w wildcard_ratio] [-T threads] [-W warmup_sec] [-d duration_sec] [-e min_delivered] [-n name] [-p subscriber_port] [-B batch]"
+
+// the phases of a run, the main thread moves every worker from one to the next
+enum {
+    PHASE_SETUP = 0,                  // connecting and subscribing
+    PHASE_RUN,                        // publishing, deliveries stamped before the warmup ends are not counted
+    PHASE_DRAIN,                      // publishing has stopped, waiting for the last deliveries
+    PHASE_DONE
+};
+
+// what a run looks like, every worker reads it and nobody changes it once the run starts
+typedef struct bench_options {
+    const char* hostname = NULL;
+    const char* port = NULL;
+    const char* sub_port = NULL;      // where subscribers connect if not to port, another node of the publishers' node's cluster
+    const char* name = "bench";       // printed with the results so a suite's runs can be told apart
+    int publishers = 1;
+    int subscribers = 1;
+    int topics = 1;
+    size_t payload = 64;              // bytes in each published message, at least BENCH_STAMP
+    double rate = 0;                  // messages per second from each publisher, 0 to publish as fast as the server takes them
+    int batch = 1;                    // messages a publisher sends in each PUB, more than 1 sends them as the entries of one batch
+    double wildcard = 0;              // fraction of subscribers subscribed to BENCH_FILTER instead of one topic
+    int threads = 1;
+    double warmup = 1;
+    double duration = 5;
+    double min_delivered = 0;         // fraction of expected deliveries that must arrive for the run to pass
+} bench_options_t;
+
+// one connection to the server, either publishing to one topic or subscribed to one topic or BENCH_FILTER
+typedef struct bench_conn {
+    int fd = -1;
+    int publisher = 0;
+    int id = 0;                       // which publisher or subscriber this is, counted separately
+    int topic = 0;                    // the topic a publisher publishes to or an exact subscriber is subscribed to, -1 for wildcard subscribers
+    int ready = 0;                    // connected, and for a subscriber, subscribed
+    int waiting = 0;                  // a publisher with BENCH_OUT_HIGH unsent, it publishes nothing more until the socket drains
+    uint64_t next_send = 0;           // when a rate limited publisher is next due to publish
+    frame_t frame;                    // a publisher's PUB, only the stamps change from one publish to the next
+    FrameDecoder* decoder = NULL;
+    RingBuffer* out = NULL;
+} bench_conn_t;
+
+typedef std::pair<uint64_t, bench_conn_t*> bench_due_t;   // when a publisher is next due, and the publisher
+
+// the counters of one worker, only ever written by the worker's own thread
+typedef struct alignas(64) bench_stats {
+    Counter ready;                    // connections ready to publish or receive
+    Counter failed;                   // connections the server refused, closed or sent something unexpected on
+    Counter published;                // publishes stamped inside the measured window
+    Counter expected;                 // deliveries those publishes should make, one per matching subscriber
+    Counter delivered;                // deliveries stamped inside the measured window
+    Counter bytes;                    // payload bytes they carried
+    Histogram latency;                // nanoseconds from a publish being due to it being read by a subscriber
+} bench_stats_t;
+
+// BenchWorker class, one thread driving its share of the connections from its own epoll instance
+class BenchWorker {
+    private:
+        bench_options_t* options;
+        const int* fanout;            // how many subscribers receive a publish to each topic
+        std::atomic<int>* phase;
+        std::atomic<uint64_t>* window; // the measured window, start and end on the monotonic clock
+        int epoll_fd;
+        std::vector<bench_conn_t*>* conns = new std::vector<bench_conn_t*>();
+        std::priority_queue<bench_due_t, std::vector<bench_due_t>, std::greater<bench_due_t>>* due =
+            new std::priority_queue<bench_due_t, std::vector<bench_due_t>, std::greater<bench_due_t>>(); // rate limited publishers by when they are next due
+        bench_stats_t* stats = new bench_stats_t;
+        std::thread* thread = NULL;
+        static void worker_loop(BenchWorker* worker, struct addrinfo* pub_addr, struct addrinfo* sub_addr);
+        int open_conn(bench_conn_t* conn, struct addrinfo* addr);
+        int close_conn(bench_conn_t* conn);
+        int fail_conn(bench_conn_t* conn);
+        int handle_frame(bench_conn_t* conn, frame_t* frame);
+        int read_conn(bench_conn_t* conn);
+        int write_conn(bench_conn_t* conn);
+        int publish(bench_conn_t* conn, uint64_t now);
+        int start_publishing(uint64_t now);
+        int64_t publish_due(uint64_t now);
+
+    public:
+        BenchWorker(bench_options_t* options, const int* fanout, std::atomic<int>* phase, std::atomic<uint64_t>* window);
+        ~BenchWorker();
+        int add_conn(int publisher, int id, int topic);
+        int start(struct addrinfo* pub_addr, struct addrinfo* sub_addr);
+        int join();
+        bench_stats_t* get_stats() { return stats; }
+};
+
+int main(int argc, char* argv[]);
+
+#endif
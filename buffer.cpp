@@ -0,0 +1,99 @@
+#include "buffer.h"
+
+// function which grows the buffer until it has room for needed more bytes, unwrapping the contents into the new allocation
+int RingBuffer::grow(size_t needed) {
+    size_t used = size();
+    size_t new_capacity = capacity;
+    while (new_capacity - used < needed) new_capacity *= 2;
+    if (new_capacity == capacity) return 0;
+
+    char* new_data = (char*) malloc(new_capacity);
+    if (!new_data) return 1;
+    peek(0, new_data, used);
+    free(data);
+    data = new_data;
+    capacity = new_capacity;
+    head = 0;
+    tail = used;
+    return 0;
+}
+
+// function which appends len bytes to the end of the buffer
+int RingBuffer::write(const void* src, size_t len) {
+    if (grow(len)) return 1;
+    size_t start = tail & (capacity - 1);
+    size_t first = capacity - start;                                    // bytes before the end of data, the rest wraps to the front
+    if (first > len) first = len;
+    memcpy(data + start, src, first);
+    memcpy(data, (const char*) src + first, len - first);
+    tail += len;
+    return 0;
+}
+
+// function which copies len bytes starting pos bytes after the head into dst, without consuming them
+int RingBuffer::peek(size_t pos, void* dst, size_t len) {
+    if (pos + len > size()) return 1;
+    size_t start = (head + pos) & (capacity - 1);
+    size_t first = capacity - start;
+    if (first > len) first = len;
+    memcpy(dst, data + start, first);
+    memcpy((char*) dst + first, data, len - first);
+    return 0;
+}
+
+// function which drops len bytes from the front of the buffer
+// once the buffer is empty, a buffer that grew for one large frame shrinks back so idle connections stay small
+void RingBuffer::consume(size_t len) {
+    if (len > size()) len = size();
+    head += len;
+    if (head == tail && capacity > RING_SIZE * 16) {
+        char* new_data = (char*) malloc(RING_SIZE);
+        if (new_data) {
+            free(data);
+            data = new_data;
+            capacity = RING_SIZE;
+            head = tail = 0;
+        }
+    }
+}
+
+// function which reads from fd straight into the free space at the end of the buffer, growing it first if less than min_free bytes are free
+// returns what readv() returned, so 0 means the peer closed and -1 leaves errno set
+ssize_t RingBuffer::read_from_fd(int fd, size_t min_free) {
+    if (grow(min_free)) {
+        errno = ENOMEM;
+        return -1;
+    }
+    size_t room = capacity - size();
+    size_t start = tail & (capacity - 1);
+    size_t first = capacity - start;
+    if (first > room) first = room;
+    struct iovec iov[2] = {{data + start, first}, {data, room - first}};
+    ssize_t nread = readv(fd, iov, room - first > 0 ? 2 : 1);
+    if (nread > 0) tail += nread;
+    return nread;
+}
+
+// function which writes as much of the buffer to fd as the socket will take, consuming whatever was written
+// returns what writev() returned, so -1 with EAGAIN means the socket is full and the rest stays buffered
+ssize_t RingBuffer::write_to_fd(int fd) {
+    size_t used = size();
+    if (used == 0) return 0;
+    size_t start = head & (capacity - 1);
+    size_t first = capacity - start;
+    if (first > used) first = used;
+    struct iovec iov[2] = {{data + start, first}, {data, used - first}};
+    ssize_t nwritten = writev(fd, iov, used - first > 0 ? 2 : 1);
+    if (nwritten > 0) consume(nwritten);
+    return nwritten;
+}
+
+RingBuffer::RingBuffer(size_t capacity) {
+    this->capacity = RING_SIZE;
+    while (this->capacity < capacity) this->capacity *= 2;
+    this->data = (char*) malloc(this->capacity);
+}
+
+RingBuffer::~RingBuffer() {
+    free(data);
+}
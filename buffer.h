@@ -0,0 +1,39 @@
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define RING_SIZE 4096                // starting capacity of a ring buffer, it grows in powers of two as needed
+
+// RingBuffer class, a growable circular byte buffer used for a connection's unread input and unsent output
+// head and tail only ever count up, masking them with capacity - 1 gives the position in data,
+// so bytes can be appended and consumed at either end without ever moving what is already buffered
+class RingBuffer {
+    private:
+        char* data;
+        size_t capacity;              // always a power of two
+        size_t head = 0;              // total bytes ever consumed
+        size_t tail = 0;              // total bytes ever written
+        int grow(size_t needed);
+
+    public:
+        RingBuffer(size_t capacity);
+        ~RingBuffer();
+        int write(const void* src, size_t len);
+        int peek(size_t pos, void* dst, size_t len);
+        uint8_t at(size_t pos) { return (uint8_t) data[(head + pos) & (capacity - 1)]; }
+        void consume(size_t len);
+        ssize_t read_from_fd(int fd, size_t min_free);
+        ssize_t write_to_fd(int fd);
+        size_t size() { return tail - head; }
+        size_t get_capacity() { return capacity; }
+};
+
+#endif
@@ -1,109 +1,60 @@
 #include "client.h"
-#include <errno.h>
 
-Client* client;
-int connected = 0;
-int disconnected = 0;   // set to 1 when client disconnects
-int cleanup = 0;        // set to 1 when client disconnects and all threads have exited
+volatile sig_atomic_t cleanup = 0;  // set by the signal handler, the REPL disconnects and exits once it sees it
 
 // function to handle SIGINT and SIGTERM
 void sig_handler(int s) {
-    printf("Caught signal, disconnecting\n");
-	if (client->disconnect_from_server()) cleanup = 1;  // if client is connected, disconnect
-                                                        // if the disconnect fails, force shut down anyway
+    cleanup = 1;
 }
 
-// function to handle connecting to server on a certain port
-int Client::connect_to_server(const char* hostname, const char* port) {
-    struct addrinfo* server_addr;
-    if (getaddrinfo(hostname, port, NULL, &server_addr)) {  // get address info for server
-        freeaddrinfo(server_addr);
-        printf("failed to get addrinfo\n");
-        return 1;
-    }
-
-    int server_fd = socket(server_addr->ai_family, server_addr->ai_socktype, server_addr->ai_protocol); // create socket
-
-    if (server_fd == 0) { // check if socket creation failed
-        freeaddrinfo(server_addr);
-        printf("failed to create socket\n");
-        return 1;
-    }
-
-	fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) | O_NONBLOCK); // set socket to non-blocking
-
-    connect(server_fd, server_addr->ai_addr, server_addr->ai_addrlen); // connect to server
-
-    // as the socket is non-blocking, we need to poll it to see if the connection is successful
-
-    struct pollfd pfd = {server_fd, POLLOUT, 0}; // create pollfd struct
-
-    if (poll(&pfd, 1, 1000) == -1) { // poll socket for 1 second
-        freeaddrinfo(server_addr);
-        printf("Poll failed\n");
-        return -1;
-    }
-
-    if ((pfd.revents & POLLOUT) != POLLOUT) { // check if socket is ready for writing
-        freeaddrinfo(server_addr);
-        printf("Socket did not open for writing\n");
-        return 1;
-    }
-
-    int optval = 0;
-    socklen_t socklen = 4;
-    getsockopt(server_fd, SOL_SOCKET, SO_ERROR, &optval, &socklen); // check if socket has an error
-
-    if (optval) { // if socket has an error, print error and return
-        freeaddrinfo(server_addr);
-        printf("Socket had an error\n");
-        close(server_fd);
-        return 1;
-    }
-
-    freeaddrinfo(server_addr);
+// function which runs fn with the connection on the loop's thread, the only thread that may touch it
+int Client::post(std::function<void(PubSubClient*)> fn) {
+    PubSubClient* conn = this->conn;
+    return loop->post([conn, fn]() { fn(conn); });
+}
 
+// function to handle connecting to server on a certain port, resuming the session named client_id if it is not NULL
+// returns once the server acks the CONN, or 1 if it refused, the connection failed or no ack came within PUBSUB_CONNECT_TIMEOUT,
+// the loop's thread times the connect, this one only waits for it to say how it went
+int Client::connect_to_server(const char* hostname, const char* port, const char* client_id) {
     printf("Connecting to server\n");
-    
-    this->sock_fd = server_fd;
-    this->listen_thread = new std::thread(listen_loop, this);
-    
-    payload_t payload = {0};
-    snprintf(payload.req, REQ_SIZE, "CONN");
-    
-    send_to_server(&payload); // send connection request to server
-
-    int tries = 0;
-    while (!connected) { // wait for server to return CONN_ACK, which will set connected to 1. If server does not respond, force shut down
-        if (tries < 0) {
-            printf("Did not receive CONN_ACK, failed to connect to server\n");
-            cleanup = 1;
-            return 1;
-        }
-        usleep(100000); // sleep for 100ms, this is the timeout
-        tries++;
+    std::shared_ptr<std::promise<int>> result = std::make_shared<std::promise<int>>(); // shared, the loop's thread keeps it until it answers
+    std::future<int> done = result->get_future();
+    std::string host = hostname, service = port, session = client_id ? client_id : "";
+    post([result, host, service, session](PubSubClient* conn) {
+        auto connected = [result, conn, session](int status) {
+            if (!status && session.size() > 0) printf("Session %s %s\n", session.c_str(), conn->get_session_present() ? "resumed" : "started");
+            result->set_value(status);
+        };
+        conn->set_session(session, 0);
+        if (conn->connect(host.c_str(), service.c_str(), connected)) connected(1);
+    });
+
+    if (done.get()) {
+        printf("Failed to connect to server\n");
+        return 1;
     }
+    printf("Received CONN_ACK for version %d\n", PROTOCOL_VERSION);
     return 0;
 }
 
-// function to handle disconnecting from server
-int Client::disconnect_from_server() { 
+// function to handle disconnecting from server, the loop's thread gives up on the DISC_ACK after PUBSUB_DISCONNECT_TIMEOUT
+int Client::disconnect_from_server() {
+    if (closed.load()) return 0;
     printf("Disconnecting from server\n");
-    
-    payload_t payload = {0};
-    snprintf(payload.req, REQ_SIZE, "DISC");
-
-    send_to_server(&payload); // send disconnect request to server
-
-    int tries = 0;
-    while (!disconnected) {
-        if (tries >= 10) {
-            printf("Failed to disconnect from server\n");
-            return 1;
-        }
-        usleep(100000); // sleep for 100ms, this is the timeout
-        tries++;
+    leaving.store(1);
+    std::shared_ptr<std::promise<int>> result = std::make_shared<std::promise<int>>(); // shared, the loop's thread keeps it until it answers
+    std::future<int> done = result->get_future();
+    post([result](PubSubClient* conn) {
+        auto disconnected = [result](int status) { result->set_value(status); };
+        if (conn->disconnect(disconnected)) disconnected(1);
+    });
+
+    if (done.get()) {
+        printf("Failed to disconnect from server\n");
+        return 1;
     }
+    printf("Received DISC_ACK\n");
     return 0;
 }
 
@@ -111,73 +62,77 @@ int Client::disconnect_from_server() {
 int Client::process_string(const char* str) {
     char* str2 = strdup(str);
     char* token = strtok((char*) str2, " ");
-    if (strncmp(token, "PUB", strnlen(token, REQ_SIZE)) == 0) { // if the first token is PUB, send a PUB request to the server
+    if (!token) { // an empty line
+        free(str2);
+        return 0;
+    }
+    if (strncmp(token, "PUB", strnlen(token, REQ_SIZE)) == 0 || strncmp(token, "PUBRET", strnlen(token, REQ_SIZE)) == 0) { // if the first token is PUB or PUBRET, publish the rest of the line
+        int retain = strncmp(token, "PUB", strnlen(token, REQ_SIZE)) != 0;
+        const char* request = retain ? "PUBRET" : "PUB";
         token = strtok(NULL, " ");
         if (!token) { // if there is no second token, print an error
-            printf("Invalid PUB request\n");
+            printf("Invalid %s request\n", request);
             free(str2);
             return 1;
         }
-        payload_t payload = {0};
-        snprintf(payload.req, REQ_SIZE, "PUB");
-        snprintf(payload.topic, TOPIC_SIZE, "%s", token);
-        snprintf(payload.msg, MSG_SIZE, "%s", str+5+strnlen(token, TOPIC_SIZE));
+        std::string topic = token;
         if (!(token = strtok(NULL, " "))) { // if there is no message, print an error
-            printf("Invalid PUB request\n");
+            printf("Invalid %s request\n", request);
             free(str2);
             return 1;
         }
-        send_to_server(&payload);
+        std::string msg = str + (token - str2); // the rest of the line from where the message starts, spaces and all, strtok only cut up the copy
+        int qos = this->qos;
+        post([topic, msg, retain, qos](PubSubClient* conn) { conn->publish(topic, msg, retain, qos); });
     }
-    else if (strncmp(token, "PUBRET", strnlen(token, REQ_SIZE)) == 0) { // if the first token is PUBRET, send a PUBRET request to the server
+    else if (strncmp(token, "SUB", strnlen(token, REQ_SIZE)) == 0) { // if the first token is SUB, subscribe to the topic or filter after it
         token = strtok(NULL, " ");
         if (!token) { // if there is no second token, print an error
-            printf("Invalid PUB request\n");
-            free(str2);
-            return 1;
-        }
-        payload_t payload = {0};
-        snprintf(payload.req, REQ_SIZE, "PUBRET");
-        snprintf(payload.topic, TOPIC_SIZE, "%s", token);
-        snprintf(payload.msg, MSG_SIZE, "%s", str+8+strnlen(token, TOPIC_SIZE));
-        if (!(token = strtok(NULL, " "))) { // if there is no message, print an error
-            printf("Invalid PUBRET request\n");
+            printf("Invalid SUB request\n");
             free(str2);
             return 1;
         }
-        send_to_server(&payload);
+        std::string filter = token;
+        int qos = this->qos;
+        post([filter, qos](PubSubClient* conn) { conn->subscribe(filter, qos); });
     }
-    else if (strncmp(token, "SUB", strnlen(token, REQ_SIZE)) == 0) { // if the first token is SUB, send a SUB request to the server
+    else if (strncmp(token, "UNSUB", strnlen(token, REQ_SIZE)) == 0) { // if the first token is UNSUB, unsubscribe from the topic or filter after it
         token = strtok(NULL, " ");
         if (!token) { // if there is no second token, print an error
-            printf("Invalid SUB request\n");
+            printf("Invalid UNSUB request\n");
             free(str2);
             return 1;
         }
-        payload_t payload = {0};
-        snprintf(payload.req, REQ_SIZE, "SUB");
-        snprintf(payload.topic, TOPIC_SIZE, "%s", token);
-        send_to_server(&payload);
-    }
-    else if (strncmp(token, "UNSUB", strnlen(token, REQ_SIZE)) == 0) { // if the first token is UNSUB, send a UNSUB request to the server
+        std::string filter = token;
+        post([filter](PubSubClient* conn) { conn->unsubscribe(filter); });
+    }
+    else if (strncmp(token, "LIST", strnlen(token, REQ_SIZE)) == 0) { // if the first token is LIST, print the topics we are subscribed to
+        post([](PubSubClient* conn) {
+            conn->list([](int status, const std::string& reply) {
+                if (!status) printf("Subscribed topics: %s\n", reply.c_str());
+            });
+        });
+    }
+    else if (strncmp(token, "STATS", strnlen(token, REQ_SIZE)) == 0) { // if the first token is STATS, ask the server how far behind we are
+        post([](PubSubClient* conn) {
+            conn->stats([](int status, const std::string& reply) {
+                if (!status) printf("Queue stats: %s\n", reply.c_str());
+            });
+        });
+    }
+    else if (strncmp(token, "QOS", strnlen(token, REQ_SIZE)) == 0) { // if the first token is QOS, make the requests after it QoS 0 or QoS 1
         token = strtok(NULL, " ");
-        if (!token) { // if there is no second token, print an error
-            printf("Invalid UNSUB request\n");
+        if (!token || (strcmp(token, "0") != 0 && strcmp(token, "1") != 0)) { // if the level is missing or unknown, print an error
+            printf("Invalid QOS request, expected QOS 0 or QOS 1\n");
             free(str2);
             return 1;
         }
-        payload_t payload = {0};
-        snprintf(payload.req, REQ_SIZE, "UNSUB");
-        snprintf(payload.topic, TOPIC_SIZE, "%s", token);
-        send_to_server(&payload);
-    }
-    else if (strncmp(token, "LIST", strnlen(token, REQ_SIZE)) == 0) { // if the first token is LIST, send a LIST request to the server
-        payload_t payload = {0};
-        snprintf(payload.req, REQ_SIZE, "LIST");
-        send_to_server(&payload);
+        qos = atoi(token);
+        printf("Publishing and subscribing at QoS %d\n", qos);
     }
     else if (strncmp(token, "DISCONNECT", strnlen(token, REQ_SIZE)) == 0) { // if the first token is DISCONNECT (or DISC), disconnect from the server
-        if (client->disconnect_from_server()) cleanup = 1;
+        disconnect_from_server();
+        cleanup = 1;
     }
     else {
         printf("Invalid request\n");
@@ -188,62 +143,33 @@ int Client::process_string(const char* str) {
     return 0;
 }
 
-// function to handle listening for messages from the server
-// this function is run in a separate thread
-void Client::listen_loop(Client* client) {
-    payload_t payload = {0};
-    printf("Listening\n");
-    while (!cleanup) { // while the client is not shutting down
-        int nread = read(client->get_server_fd(), &payload, PACKET_SIZE); // read a packet from the server
-
-        if (nread != PACKET_SIZE) continue; // if the packet is not the correct size, ignore it
-
-        if (strncmp(payload.req, "PUB", REQ_SIZE) == 0 || strncmp(payload.req, "PUBRET", REQ_SIZE) == 0) { // if the packet is a PUB or PUBRET packet, print the message
-            printf("%s: %s\n", payload.topic, payload.msg);
-        }
-        else if (strncmp(payload.req, "LIST", REQ_SIZE) == 0) { // if the packet is a LIST packet, print the list of topics
-            printf("Subscribed topics: %s\n", payload.msg);
-        }
-        else if (strncmp(payload.req, "DISC", REQ_SIZE) == 0) { // if the packet is a DISC packet, disconnect from the server
-            printf("Received DISC, sending DISC_ACK\n");
-
-            snprintf(payload.req, REQ_SIZE, "DISC_ACK");
-
-            usleep(100000);
-
-            client->send_to_server(&payload); // send a DISC_ACK packet to the server
-
-            disconnected = 1;   // set the disconnected flag to true
-            cleanup = 1;        // set the cleanup flag to true
-            break;
-        }
-        else if (strncmp(payload.req, "CONN_ACK", REQ_SIZE) == 0) { // if the packet is a CONN_ACK packet, print a message and set the connected flag to true
-            printf("Received CONN_ACK\n");
-            connected = 1;
-        }
-        else if (strncmp(payload.req, "DISC_ACK", REQ_SIZE) == 0) { // if the packet is a DISC_ACK packet, print a message and set the disconnected and cleanup flags to true
-            printf("Received DISC_ACK\n");
-            disconnected = 1;
-            cleanup = 1;
-            break;
-        }
-    }
+Client::Client() {
+    this->conn = new PubSubClient(loop);
+    this->closed.store(0);
+    this->leaving.store(0);
+    conn->set_on_message([](const std::string& topic, const std::string& msg, int retained) {
+        printf("%s: %s\n", topic.c_str(), msg.c_str());
+    });
+    conn->set_on_close([this](int status) {
+        if (conn->get_acked() && !leaving.load()) printf(status ? "Lost connection to server\n" : "Server disconnected us\n");
+        closed.store(1);
+    });
+    loop->start();
 }
 
-Client::Client() {}
-
 Client::~Client() {
-    close(get_server_fd());
-    if (listen_thread) listen_thread->join();
+    delete loop;    // stops the loop's thread, so the connection is ours again
+    delete conn;
 }
 
 int main(int argc, char* argv[]) {
     if(argc < 3){
-        printf("Correct usage:\n./client <hostname> <port>\n");
+        printf("Correct usage:\n./client <hostname> <port> [client_id]\n");
 		return 1;
     }
     const char* hostname = argv[1];
     const char* port = argv[2];
+    const char* client_id = argc > 3 ? argv[3] : NULL;  // names a session, which keeps our subscriptions and messages until we are back
 
     // set up signal handelling for SIGINT and SIGTERM
     struct sigaction my_sa = {};
@@ -251,32 +177,50 @@ int main(int argc, char* argv[]) {
 	my_sa.sa_handler = sig_handler;
 	sigaction(SIGINT, &my_sa, NULL);
 	sigaction(SIGTERM, &my_sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
 
-    client = new Client(); // create a new client object
+    Client* client = new Client(); // create a new client object
 
     printf("Host: %s Port: %s\n", hostname, port);
 
-    if (client->connect_to_server(hostname, port)) {
+    if (client->connect_to_server(hostname, port, client_id)) {
         delete client;
         return 1;
     }
+    printf("Listening\n");
 
     std::string input;
+    char buf[4096];
+    int eof = 0;
 
-    while (!cleanup) { // while the client is not shutting down, constantly poll the user for input
+    while (!cleanup && !eof && !client->get_closed()) { // until we are told to stop, stdin ends or the server goes away, run the user's commands
         struct pollfd pfd = {0, POLLIN, 0};
 
-        poll(&pfd, 1, 0); // I used poll so that it's nonblocking, and the cleanup flag can be checked
+        poll(&pfd, 1, INPUT_POLL_MS); // waiting on stdin with a timeout lets the loop notice the flags without spinning
 
-        if ((pfd.revents & POLLIN) == POLLIN) {
-            std::getline(std::cin, input);
-            client->process_string(input.c_str());
+        if ((pfd.revents & (POLLIN | POLLHUP)) == 0) continue;
+        ssize_t nread = read(0, buf, sizeof(buf)); // read stdin ourselves, lines buffered by stdio would not wake poll
+        if (nread == -1 && errno == EINTR) continue;
+        if (nread <= 0) {
+            eof = 1;
+            if (input.size() == 0) break;
+            input += '\n'; // a last line without a newline still counts
         }
-    };
+        else input.append(buf, nread);
+
+        size_t newline;
+        while (!cleanup && (newline = input.find('\n')) != std::string::npos) {
+            std::string line = input.substr(0, newline);
+            input.erase(0, newline + 1);
+            client->process_string(line.c_str());
+        }
+    }
+
+    if (!client->get_closed()) client->disconnect_from_server();
 
     printf("Shutting down\n");
 
     delete client;
 
     return 0;
-}
\ No newline at end of file
+}
@@ -5,35 +5,35 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
 #include <signal.h>
-#include <semaphore.h>
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <netdb.h>
-#include <arpa/inet.h>
-#include <sys/wait.h>
-#include <fcntl.h>
 #include <poll.h>
-#include <thread>
+#include <atomic>
+#include <chrono>
+#include <future>
 #include <string>
-#include <iostream>
 #include "payload.h"
+#include "pubsub.h"
+
+#define INPUT_POLL_MS 100             // longest the REPL waits on stdin before checking if it should exit
 
 int main(int argc, char* argv[]);
 
-// Client class
+// Client class, the interactive client, a REPL over one libpubsub connection
+// the loop runs on its own thread and prints whatever the server sends, the main thread reads commands and posts them to it
 class Client {
     private:
-        int sock_fd;
-        std::thread* listen_thread;
-        static void listen_loop(Client* client);
+        PubSubLoop* loop = new PubSubLoop();
+        PubSubClient* conn;
+        std::atomic<int> closed;      // set by the loop once the connection is gone, whoever closed it
+        std::atomic<int> leaving;     // set once we asked to disconnect, so the close is not reported as unexpected
+        int qos = 0;                  // the QoS of the PUB, PUBRET and SUB requests the user makes, changed with QOS
+        int post(std::function<void(PubSubClient*)> fn);
     public:
-        int connect_to_server(const char* hostname, const char* port);
+        int connect_to_server(const char* hostname, const char* port, const char* client_id);
         int disconnect_from_server();
         int process_string(const char* str);
-        inline int send_to_server(payload_t* payload) { return write(sock_fd, payload, PACKET_SIZE); }
-        int get_server_fd() { return sock_fd; }
+        int get_closed() { return closed.load(); }
         Client();
         ~Client();
 };
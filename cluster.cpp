@@ -0,0 +1,199 @@
+#include "cluster.h"
+#include "server.h"
+
+// the body of the cluster thread, which links to every peer and then runs the links until stop is called
+void Cluster::cluster_loop(Cluster* cluster) {
+    Log::set_thread_name("cluster");
+    for (auto it : *cluster->peers) cluster->connect_peer(it);
+    while (!cluster->stopped.load()) {
+        if (cluster->loop->run_once(-1) == -1) break;                   // the wheel wakes it for retries, stop through the loop's eventfd
+    }
+    for (auto it : *cluster->peers) {                                   // the peers keep the links' sessions until they expire
+        cluster->loop->get_reactor()->get_timers()->cancel(&it->timer);
+        delete it->client;
+        it->client = NULL;
+    }
+}
+
+// function called by the loop's timer wheel once a link that went down has waited out its retry, ctx is the peer
+int Cluster::retry_expired(void* ctx) {
+    cluster_peer_t* peer = (cluster_peer_t*) ctx;
+    return peer->cluster->connect_peer(peer);
+}
+
+// function which starts a link to a peer, which is up once the peer acks its CONN, or is tried again later if it fails
+int Cluster::connect_peer(cluster_peer_t* peer) {
+    if (peer->client->connect(peer->host.c_str(), peer->port.c_str(), [this, peer](int status) {
+        if (status == 0) link_up(peer);                                 // a failed connect also closes the link, which retries it
+    }) == 0) return 0;
+    log_debug("Could not connect to peer %s:%s", peer->host.c_str(), peer->port.c_str());
+    return link_down(peer);
+}
+
+// function which tells a peer whose link just came up what this node is interested in, in batches of SUBs and UNSUBs
+// a resumed session kept what the link had subscribed to, so only what changed since is sent, otherwise all of it is
+int Cluster::link_up(cluster_peer_t* peer) {
+    int present = peer->client->get_session_present();
+    if (!present) peer->advertised.clear();
+    peer->up = 1;
+    peer->retry = CLUSTER_RETRY_MIN;
+    log_info("Linked to peer %s:%s%s", peer->host.c_str(), peer->port.c_str(), present ? ", session resumed" : "");
+
+    std::string subscribe, unsubscribe;
+    std::lock_guard<std::mutex> guard(interest_lock);
+    for (auto& it : *interest) {
+        if (!peer->advertised.insert(it.first).second) continue;
+        encode_entry(&subscribe, std::string_view(it.first->name, it.first->name_len));
+        if (subscribe.size() < CLUSTER_BATCH_BYTES) continue;
+        peer->client->subscribe_batch("", subscribe, 1);
+        subscribe.clear();
+    }
+    for (auto it = peer->advertised.begin(); it != peer->advertised.end();) {
+        if (interest->count(*it)) {
+            it++;
+            continue;
+        }
+        encode_entry(&unsubscribe, std::string_view((*it)->name, (*it)->name_len));
+        it = peer->advertised.erase(it);
+        if (unsubscribe.size() < CLUSTER_BATCH_BYTES) continue;
+        peer->client->unsubscribe_batch("", unsubscribe);
+        unsubscribe.clear();
+    }
+    if (subscribe.size() > 0) peer->client->subscribe_batch("", subscribe, 1);
+    if (unsubscribe.size() > 0) peer->client->unsubscribe_batch("", unsubscribe);
+    return 0;
+}
+
+// function which waits out the peer's retry before linking to it again, doubling the wait for the next failure
+int Cluster::link_down(cluster_peer_t* peer) {
+    if (peer->up) log_warn("Lost link to peer %s:%s", peer->host.c_str(), peer->port.c_str());
+    peer->up = 0;
+    loop->get_reactor()->get_timers()->arm(&peer->timer, peer->retry);
+    peer->retry = std::min<uint64_t>(peer->retry * 2, CLUSTER_RETRY_MAX);
+    return 0;
+}
+
+// function which brings what a link is subscribed to on its peer in line with whether this node is still interested in a topic
+// it only looks at where interest stands now, so however many SUBs and UNSUBs a topic saw since, the link sends at most one request
+int Cluster::advertise(cluster_peer_t* peer, struct topic* topic) {
+    if (!peer->up) return 0;                                            // the link catches up once it is up
+    int wanted = 0;
+    {
+        std::lock_guard<std::mutex> guard(interest_lock);
+        wanted = interest->count(topic) > 0;
+    }
+    if (wanted == (int) peer->advertised.count(topic)) return 0;
+    std::string_view filter(topic->name, topic->name_len);
+    if (wanted) {
+        peer->advertised.insert(topic);
+        return peer->client->subscribe(filter, 1);                      // QoS 1, so a QoS 1 publish stays QoS 1 across the link
+    }
+    peer->advertised.erase(topic);
+    return peer->client->unsubscribe(filter);
+}
+
+// function which adds the peers in a comma-separated list of host:port pairs, the ports their clients connect to
+// returns 1 if an entry has no port, or there are no entries
+int Cluster::add_peers(const char* list) {
+    std::string_view rest(list);
+    while (rest.size() > 0) {
+        size_t comma = rest.find(',');
+        std::string_view entry = rest.substr(0, comma);
+        rest = comma == std::string_view::npos ? std::string_view() : rest.substr(comma + 1);
+        if (entry.size() == 0) continue;
+        size_t colon = entry.rfind(':');
+        if (colon == std::string_view::npos || colon == 0 || colon == entry.size() - 1) {
+            log_error("Peer %s is not a host:port pair", std::string(entry).c_str());
+            return 1;
+        }
+
+        cluster_peer_t* peer = new cluster_peer_t;
+        peer->cluster = this;
+        peer->host = std::string(entry.substr(0, colon));
+        peer->port = std::string(entry.substr(colon + 1));
+        peer->client = new PubSubClient(loop);
+        peer->client->set_session(name, 1);                             // a new node starts over, reconnects after that resume
+        peer->client->set_on_message([this, peer](const std::string& topic, const std::string& msg, int retained) {
+            server->publish_forwarded(topic, msg, retained, peer->client->get_message_qos(), peer->client->get_message_snapshot());
+        });
+        peer->client->set_on_close([this, peer](int status) { link_down(peer); });
+        peer->timer.fn = retry_expired;
+        peer->timer.ctx = peer;
+        peers->push_back(peer);
+    }
+    if (peers->size() > 0) return 0;
+    log_error("No peers given to link to");
+    return 1;
+}
+
+// function which starts the cluster thread, once the shards exist to forward to
+int Cluster::start() {
+    if (thread || peers->size() == 0) return 0;
+    log_info("Linking to %ld peer%s as %s", peers->size(), peers->size() == 1 ? "" : "s", name.c_str());
+    thread = new std::thread(cluster_loop, this);
+    return 0;
+}
+
+// function which stops the cluster thread and closes the links, the shards may still call in to drop their interest afterwards
+int Cluster::stop() {
+    if (!thread) return 0;
+    stopped.store(1);
+    loop->stop();                                                       // wakes the thread out of its wait
+    thread->join();
+    delete thread;
+    thread = NULL;
+    return 0;
+}
+
+// function which counts a client's subscription to a topic or filter, and has the links subscribe to it if it is the first
+// called from the subscribing client's shard, topics under $ belong to each node and are never linked
+int Cluster::add_interest(struct topic* topic) {
+    if (topic->name[0] == '$') return 0;
+    {
+        std::lock_guard<std::mutex> guard(interest_lock);
+        if ((*interest)[topic]++ > 0) return 0;
+    }
+    if (stopped.load()) return 0;
+    return loop->post([this, topic]() {
+        for (auto it : *peers) advertise(it, topic);
+    });
+}
+
+// function which drops a client's subscription to a topic or filter from the count, and has the links unsubscribe if it was the last
+int Cluster::remove_interest(struct topic* topic) {
+    if (topic->name[0] == '$') return 0;
+    {
+        std::lock_guard<std::mutex> guard(interest_lock);
+        auto it = interest->find(topic);
+        if (it == interest->end() || --it->second > 0) return 0;
+        interest->erase(it);
+    }
+    if (stopped.load()) return 0;
+    return loop->post([this, topic]() {
+        for (auto it : *peers) advertise(it, topic);
+    });
+}
+
+// function which checks whether a client id is another node's link, returns 1 if it is
+int Cluster::is_peer_id(std::string_view client_id) {
+    return client_id.compare(0, strlen(CLUSTER_PREFIX), CLUSTER_PREFIX) == 0;
+}
+
+Cluster::Cluster(Server* server, const char* port) {
+    this->server = server;
+    this->stopped.store(0);
+    char host[256] = {};
+    if (gethostname(host, sizeof(host) - 1)) strcpy(host, "localhost");
+    this->name = std::string(CLUSTER_PREFIX) + host + ":" + port;      // unique as long as no two nodes share a host and a port
+}
+
+Cluster::~Cluster() {
+    stop();
+    for (auto it : *peers) {
+        delete it->client;                                              // NULL unless the thread never ran
+        delete it;
+    }
+    delete peers;
+    delete loop;
+    delete interest;
+}
@@ -0,0 +1,81 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "log.h"
+#include "pubsub.h"
+#include "timer.h"
+
+#define CLUSTER_PREFIX "$cluster/"    // a client id starting with this names another node's link, the rest is the node's host and port
+#define CLUSTER_RETRY_MIN 100         // milliseconds before a failed link is tried again, doubled on every failure after that
+#define CLUSTER_RETRY_MAX 5000
+#define CLUSTER_BATCH_BYTES (64 * 1024) // most bytes of filters a link sends in one SUB or UNSUB batch when it comes up
+
+class Server;
+class Cluster;
+struct topic;
+
+// a node this one links to, and what this node's link has subscribed to there
+typedef struct cluster_peer {
+    Cluster* cluster;
+    std::string host;
+    std::string port;
+    PubSubClient* client = NULL;
+    std::unordered_set<struct topic*> advertised;   // the topics and filters the link is subscribed to on the peer
+    wheel_timer_t timer;                            // times the next attempt while the link is down
+    uint64_t retry = CLUSTER_RETRY_MIN;
+    int up = 0;                                     // the peer acked the link's CONN and has been told this node's interest
+} cluster_peer_t;
+
+// Cluster class, the links from this node to the other nodes of a cluster, run on a thread of their own
+// every node links to every other one as a client of theirs, named CLUSTER_PREFIX and its own host and port, and subscribes
+// through the link to every topic and filter this node's clients are subscribed to, its interest, so a peer forwards a publish
+// only to the nodes with a subscriber for it, over the link that subscriber's node opened, batched with the rest of the pass
+// a node never forwards what a link delivered to it, so with every node linked to every other one each publish crosses at most
+// one link, and interest only counts clients' subscriptions, never links', so it never echoes back to the node it came from
+// links hold sessions on their peers, so what is published while a link is down is queued for it and sent once it is back
+class Cluster {
+    private:
+        Server* server;
+        std::string name;                           // the client id this node's links connect with
+        PubSubLoop* loop = new PubSubLoop();        // run by the cluster thread itself, it only ever touches the links
+        std::thread* thread = NULL;
+        std::atomic<int> stopped;
+        std::vector<cluster_peer_t*>* peers = new std::vector<cluster_peer_t*>();
+        std::mutex interest_lock;                   // taken by shards on every SUB and UNSUB, and by the cluster thread to read them back
+        std::unordered_map<struct topic*, int>* interest = new std::unordered_map<struct topic*, int>(); // clients subscribed to each topic or filter
+        static void cluster_loop(Cluster* cluster);
+        static int retry_expired(void* ctx);
+        int connect_peer(cluster_peer_t* peer);
+        int link_up(cluster_peer_t* peer);
+        int link_down(cluster_peer_t* peer);
+        int advertise(cluster_peer_t* peer, struct topic* topic);
+
+    public:
+        Cluster(Server* server, const char* port);
+        ~Cluster();
+        int add_peers(const char* list);
+        int start();
+        int stop();
+        int add_interest(struct topic* topic);
+        int remove_interest(struct topic* topic);
+        static int is_peer_id(std::string_view client_id);
+        const std::string& get_name() { return name; }
+        size_t get_peer_count() { return peers->size(); }
+};
+
+#endif
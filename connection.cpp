@@ -1,123 +1,639 @@
 #include "connection.h"
 
 // function to disconnect client
+// sends DISC and returns straight away, the reactor keeps running and handle_payload sets cleanup once DISC_ACK arrives,
+// or the connection's timer does once the client has had DISC_TIMEOUT to answer
 int Connection::disconnect_client() {
-    printf("Disconnecting client %d\n", client_fd);
-    payload_t payload = {0};
-    snprintf(payload.req, REQ_SIZE, "DISC");
-    send_to_client(&payload);                       // send disconnect request to client
-
-    int tries = 0;
-    while (!disconnected) {                         // wait for client to return DISC_ACK, which will set disconnected to 1
-        if (tries >= 10) {
-            printf("Client did not send DISC_ACK\n");
-            cleanup = 1;                            // if client does not respond, set cleanup to 1 anyway and force shut down
-            return 1;
-        }
+    log_info("Disconnecting client %d", client_fd);
+    if (!connected) {                               // the client never finished connecting, there is no point waiting for it
+        cleanup = 1;
+        return 1;
+    }
+    disc_sent = 1;
+    shard->get_reactor()->get_timers()->arm(&timer, DISC_TIMEOUT * 1000);
+    frame_t frame = {OP_DISC, "", ""};
+    return send_to_client(&frame);
+}
 
-        usleep(100000);                             // sleep for 100ms, this is the timeout
-        tries++;
+// function called by the shard's timer wheel when the connection's timer expires, ctx is the connection
+int Connection::timer_expired(void* ctx) {
+    Connection* conn = (Connection*) ctx;
+    if (conn->client_fd == -1) return conn->shard->expire_session(conn);  // a session nobody came back for, it is deleted here
+    if (conn->cleanup) return 0;
+    if (!conn->connected) {
+        log_info("Client %d failed to connect", conn->client_fd);
+        conn->cleanup = 1;
+        return 0;
     }
+    if (conn->disc_sent) {
+        log_warn("Client %d did not send DISC_ACK", conn->client_fd);
+        conn->cleanup = 1;
+        return 0;
+    }
+    return conn->check_keepalive();
+}
 
-    cleanup = 1;                                    // set cleanup to 1, which will cause the listen thread to exit
+// function which starts timing the client's silence once it is connected
+// only framed clients are kept alive, a legacy client cannot answer a PING and a legacy subscriber may never send anything
+int Connection::start_keepalive() {
+    TimerWheel* timers = shard->get_reactor()->get_timers();
+    heard = 0;
+    ping_sent = 0;
+    if (server->get_keepalive() > 0 && version == PROTOCOL_FRAMED) timers->arm(&timer, server->get_keepalive() * 1000);
+    else timers->cancel(&timer);
     return 0;
 }
 
-// function to add topic to client's subscription list
-int Connection::add_topic(char* topic) {
-    for (unsigned long i = 0; i < topics->size(); i++) {
-        if (strncmp(topics->at(i), topic, TOPIC_SIZE) == 0) {
-            return 1;
-        }
+// function called once every keepalive interval, which pings a client that was silent for the whole interval and closes it if it
+// is still silent an interval later, so a half-open connection goes within three intervals
+// reads only set a flag, so a busy client costs one timer per interval rather than anything per read
+int Connection::check_keepalive() {
+    TimerWheel* timers = shard->get_reactor()->get_timers();
+    uint64_t interval = (uint64_t) server->get_keepalive() * 1000;
+    if (heard) {
+        heard = 0;
+        ping_sent = 0;
+        return timers->arm(&timer, interval);
     }
-    topics->push_back(strdup(topic));
+    if (!ping_sent) {
+        log_debug("Client %d has been silent for %d seconds, sending PING", client_fd, server->get_keepalive());
+        frame_t ping = {OP_PING, "", ""};
+        send_to_client(&ping);
+        ping_sent = 1;
+        return timers->arm(&timer, interval);
+    }
+    log_info("Client %d did not answer PING, closing", client_fd);
+    return handle_hangup();                                                 // most likely a half-open connection, a session keeps its state
+}
+
+// function which finds the client's subscription to a topic, returns NULL if it is not subscribed
+struct subscription* Connection::find_subscription(struct topic* topic) {
+    auto it = subscription_index->find(topic);
+    if (it == subscription_index->end()) return NULL;
+    return it->second;
+}
+
+// function to add a subscription to the end of the client's subscription list
+int Connection::add_subscription(struct subscription* subscription) {
+    subscription->conn_prev = last_subscription;
+    subscription->conn_next = NULL;
+    if (last_subscription) last_subscription->conn_next = subscription;
+    else subscriptions = subscription;
+    last_subscription = subscription;
+    (*subscription_index)[subscription->topic] = subscription;
+    return 0;
+}
+
+// function to remove a subscription from the client's subscription list, it does not free it
+int Connection::remove_subscription(struct subscription* subscription) {
+    if (subscription->conn_prev) subscription->conn_prev->conn_next = subscription->conn_next;
+    else subscriptions = subscription->conn_next;
+    if (subscription->conn_next) subscription->conn_next->conn_prev = subscription->conn_prev;
+    else last_subscription = subscription->conn_prev;
+    subscription_index->erase(subscription->topic);
     return 0;
 }
 
-// function to remove topic from client's subscription list
-int Connection::remove_topic(char* topic) {
-    for (unsigned long i = 0; i < topics->size(); i++) {
-        if (strncmp(topic, topics->at(i), TOPIC_SIZE) == 0) {
-            topics->erase(topics->begin() + i);
-            return 0;
+// function to list topics in client's subscription list, in the order they were subscribed to
+// each LIST is answered with one frame of up to LIST_PAGE bytes of names, or what fits in a legacy packet, so a long list is neither
+// built in one piece nor queued all at once; a frame that did not reach the end has the last topic it lists as its own,
+// and a LIST naming that topic picks up after it, found through the subscription index
+// a LIST naming a topic the client has since unsubscribed from starts over from the first
+int Connection::list_topics(frame_t* request) {
+    size_t page = version == PROTOCOL_LEGACY ? MSG_SIZE - 1 : LIST_PAGE;
+    struct subscription* it = subscriptions;
+    if (request->topic.size() > 0) {
+        struct subscription* cursor = find_subscription(server->resolve_topic(request->topic, 0));
+        if (cursor) it = cursor->conn_next;
+    }
+
+    frame_t frame = {OP_LIST, "", ""};
+    for (struct subscription* last = NULL; it; last = it, it = it->conn_next) {
+        size_t len = it->topic->name_len + (frame.msg.size() > 0 ? 2 : 0);
+        if (frame.msg.size() > 0 && frame.msg.size() + len > page) {         // the page is full, the client asks for the next one
+            frame.topic.assign(last->topic->name, last->topic->name_len);
+            break;
         }
+        if (frame.msg.size() > 0) frame.msg.append(", ");
+        frame.msg.append(it->topic->name, it->topic->name_len);
     }
-    return 1;
+    send_to_client(&frame);
+    return 0;
 }
 
-// function to list topics in client's subscription list
-int Connection::list_topics() {
-    payload_t payload = {0};
-    snprintf(payload.req, REQ_SIZE, "LIST");
-    snprintf(payload.msg, MSG_SIZE, "%s", topics->at(0));
-    for (unsigned long i = 1; i < topics->size(); i++) {
-        char* temp_msg = strdup(payload.msg);
-        snprintf(payload.msg, MSG_SIZE, "%s, %s", temp_msg, topics->at(i));
-        free(temp_msg);
+// function which encodes a frame in whichever version of the protocol the client speaks
+Message* Connection::encode_for_client(frame_t* frame) {
+    if (version == PROTOCOL_LEGACY && (frame->topic.size() >= TOPIC_SIZE || frame->msg.size() >= MSG_SIZE)) {
+        log_warn("Truncated %s for legacy client %d", op_names[frame->op], client_fd);
     }
-    send_to_client(&payload);
+    return Message::encode(frame, version);
+}
+
+// function to send a control frame to the client, these are never dropped however far behind the client is
+// nothing is written here, the shard flushes every connection with queued frames once per reactor iteration
+int Connection::send_to_client(frame_t* frame) {
+    outq->push(encode_for_client(frame), 0, 0);
+    shard->schedule_flush(this);
     return 0;
 }
 
-// function to listen for messages to client
-// this is run in a separate thread with no hangup
-void Connection::listen_loop(Connection* connection) {
-    payload_t payload = {0};
-    while (!connection->cleanup) {                                              // while cleanup is not set, keep listening for messages
-        int nread = read(connection->get_client_fd(), &payload, PACKET_SIZE);   // read message from client, nonblocking
+// function to queue a published message for the client, subject to the queue's budget and slow consumer policy
+// the caller keeps its reference, the queue takes its own, so a framed client shares the publisher's bytes and only a legacy client gets a copy
+// published is when a live publish arrived, for the shard's latency histogram, a retained message sent later passes 0
+// qos is the QoS the client subscribed at, a QoS 1 publish to a framed client that subscribed at QoS 1 goes through its in-flight window
+// returns 0 if the message was queued and 1 if it was dropped or the client was disconnected for falling behind
+int Connection::publish_to_client(Message* message, uint64_t published, int qos) {
+    if (snapshots) shard->mark_live(this, message);                        // a snapshot in progress must not follow this with an older retained message
+    return queue_publish(message, published, qos);
+}
+
+// function which queues a message like publish_to_client, without telling the snapshots, they use it to queue their own messages
+// a session whose client is away, or is still being caught up on what queued while it was, gets it in its offline queue instead
+int Connection::queue_publish(Message* message, uint64_t published, int qos) {
+    if (!message->get_qos()) qos = 0;                                       // a publish is delivered at the lower of its own QoS and the subscription's
+    if (cleanup) {
+        if (client_id.empty() || ::cleanup) return 1;
+        return queue_offline(message, qos);                                 // the shard is about to detach the socket, the session keeps the message
+    }
+    if (client_fd == -1 || (offline && offline->get_count() > 0)) return queue_offline(message, qos);
+    int ret = send_publish(message, published, qos);
+    if (!cleanup) shard->schedule_flush(this);
+    return ret;
+}
 
-        if (nread > 0) printf("Read %d bytes from client %d: %s\n", nread, connection->get_client_fd(),  payload.req);
-        if (nread != PACKET_SIZE) continue;                                     // if message is not the correct size, ignore it
+// function which puts a publish in the output queue, or the in-flight window for a QoS 1 delivery, the caller schedules the flush
+// returns 0 if the message was queued and 1 if it was dropped or the client was disconnected for falling behind
+int Connection::send_publish(Message* message, uint64_t published, int qos) {
+    if (qos && version == PROTOCOL_FRAMED) return queue_qos1(message, published);
+    if (version == PROTOCOL_LEGACY && (message->get_topic_len() >= TOPIC_SIZE || message->get_msg_len() >= MSG_SIZE)) {
+        log_warn("Truncated %s for legacy client %d", op_names[message->get_op()], client_fd);
+    }
+    int ret = outq->push(message->to_version(version), 1, published);
+    if (ret == -1) {                                                        // the policy is to disconnect clients that cannot keep up
+        log_warn("Client %d is over its queue budget with %ld bytes queued, disconnecting", client_fd, outq->get_bytes());
+        shard->get_metrics()->disconnected.add(1);
+        cleanup = 1;
+        return 1;
+    }
+    return ret;
+}
 
-        if (strncmp(payload.req, "PUB", REQ_SIZE) == 0) {                       // if message is a PUB, send it to all clients subscribed to the topic
-            printf("Received PUB from client %d to topic %s, processing\n", connection->get_client_fd(), payload.topic);
-            connection->get_server()->publish_message(&payload, 0);
-        }
-        if (strncmp(payload.req, "PUBRET", REQ_SIZE) == 0) {                    // if message is a PUBRET, send it to all clients subscribed to the topic and retain the message
-            printf("Received PUBRET from client %d to topic %s, processing\n", connection->get_client_fd(), payload.topic);
-            connection->get_server()->publish_message(&payload, 1);
-        }
-        else if (strncmp(payload.req, "SUB", REQ_SIZE) == 0) {                  // if message is a SUB, add the topic to the client's subscription list
-            printf("Received SUB from client %d to topic %s, processing\n", connection->get_client_fd(), payload.topic);
-            connection->get_server()->subscribe_to_topic(connection->get_client_fd(), payload.topic);
+// function which keeps a publish for a session until its client is back and everything queued for it before is sent
+int Connection::queue_offline(Message* message, int qos) {
+    if (!offline) offline = new OfflineQueue(server->get_offline_dir(), server->get_offline_budget());
+    return offline->push(message->to_version(PROTOCOL_FRAMED), qos);       // the queue takes its own reference, or drops it if it is full
+}
+
+// function which moves publishes from the offline queue to the client while its output is under half its budget
+// a client coming back after a long time is caught up in budget sized steps, each flush that empties the socket pulls in the next
+// returns the number of publishes moved
+int Connection::pump_offline() {
+    if (!offline || client_fd == -1 || cleanup) return 0;
+    size_t limit = outq->get_budget() / 2;
+    offline_entry_t entry;
+    int moved = 0;
+    while (outq->get_bytes() + (inflight ? inflight->get_waiting_bytes() : 0) < limit && offline->pop(&entry)) {
+        send_publish(entry.message, 0, entry.qos);
+        entry.message->unref();
+        moved++;
+    }
+    return moved;
+}
+
+// function which queues a QoS 1 delivery, it is sent under a packet id as soon as the client's in-flight window has room
+// a QoS 1 delivery is never dropped, so whatever the policy, a client whose queue and waiting deliveries go over the budget is disconnected
+int Connection::queue_qos1(Message* message, uint64_t published) {
+    if (!inflight) inflight = new InflightWindow(server->get_inflight_window());
+    if (outq->get_bytes() + inflight->get_waiting_bytes() + message->get_size() > outq->get_budget()) {
+        log_warn("Client %d is over its queue budget with %ld QoS 1 messages unacked, disconnecting", client_fd, inflight->get_unacked());
+        shard->get_metrics()->disconnected.add(1);
+        cleanup = 1;
+        return 1;
+    }
+    inflight->push(message->to_version(version), published);
+    return send_inflight();
+}
+
+// function which queues as many of the QoS 1 deliveries waiting for the client's in-flight window as it has room for
+// the caller schedules the flush, this is also called from flush() itself while the shard walks its flush list
+int Connection::send_inflight() {
+    inflight_t entry;
+    int queued = 0;
+    while (inflight->next_ready(&entry)) {
+        entry.message->ref();                                               // the window keeps its own reference until the client acks
+        outq->push_with_id(entry.message, entry.id, entry.published);
+        queued++;
+    }
+    return queued;
+}
+
+// function which acks a QoS 1 publish from the client, once it has been handed to every subscriber
+int Connection::send_puback(uint16_t id) {
+    frame_t ack = {OP_PUBACK, "", ""};
+    ack.qos = 1;
+    ack.id = id;
+    return send_to_client(&ack);
+}
+
+// function which writes as much queued output as the socket will take
+// if the socket fills up, the reactor is asked to report when it is writable again so the rest can be sent then
+int Connection::flush() {
+    if (shard->get_reactor()->get_backend() == BACKEND_URING) return submit_send();
+    while (1) {
+        if (outq->write_to_fd(client_fd) == -1) {
+            if (!cleanup) log_warn("Failed to write to client %d: %s", client_fd, strerror(errno));
+            cleanup = 1;                                                    // the socket is broken, the shard will reap the connection
+            return 1;
         }
-        else if (strncmp(payload.req, "UNSUB", REQ_SIZE) == 0) {                // if message is a UNSUB, remove the topic from the client's subscription list
-            printf("Received UNSUB from client %d to topic %s, processing\n", connection->get_client_fd(), payload.topic);
-            connection->get_server()->unsubscribe_from_topic(connection->get_client_fd(), payload.topic);
+        if (outq->get_depth() > 0 || pump_offline() == 0) break;            // keep going while the socket takes everything and a session has more waiting
+    }
+
+    if (outq->get_depth() > 0 && !want_write && !cleanup) {                 // the socket is full, wait for EPOLLOUT
+        shard->get_reactor()->modify_fd(client_fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP, this);
+        want_write = 1;
+    }
+    else if (outq->get_depth() == 0 && want_write && !cleanup) {            // everything is sent, stop asking about writability
+        shard->get_reactor()->modify_fd(client_fd, EPOLLIN | EPOLLRDHUP, this);
+        want_write = 0;
+    }
+    return 0;
+}
+
+// function which hands the front of the queued output to an io_uring reactor as one sendmsg, submitted together with the sends of
+// every other connection flushed this iteration; one send is in flight at a time, handle_sent sends whatever queued meanwhile
+int Connection::submit_send() {
+    if (sending || client_fd == -1) return 0;
+    if (outq->get_depth() == 0 && pump_offline() == 0) return 0;        // a session catching up has more waiting once the socket took everything
+    if (shard->get_reactor()->send(client_fd, outq->start_send())) {
+        outq->finish_send(0);
+        if (!cleanup) log_warn("Failed to queue a send to client %d", client_fd);
+        cleanup = 1;
+        return 1;
+    }
+    sending = 1;
+    return 0;
+}
+
+// function called by an io_uring reactor once a send has completed, with the bytes sent or -errno
+int Connection::handle_sent(ssize_t result) {
+    sending = 0;
+    outq->finish_send(result > 0 ? result : 0);
+    if (result < 0 && result != -EAGAIN && result != -EINTR) {
+        if (!cleanup) log_warn("Failed to write to client %d: %s", client_fd, strerror(-result));
+        cleanup = 1;                                                        // the socket is broken, the shard will reap the connection
+        return 1;
+    }
+    return flush();
+}
+
+// function to report the client's queue to it, so a client can see whether it is keeping up and how well its writes are coalesced
+int Connection::send_stats() {
+    char buf[512];
+    unsigned long writes = outq->get_writes();
+    double per_write = writes ? (double) outq->get_sent() / writes : 0;   // how many frames each writev() carried, the flush delay trades latency for this
+    snprintf(buf, sizeof(buf), "depth=%ld bytes=%ld max_depth=%ld dropped_oldest=%ld dropped_newest=%ld policy=%s writes=%ld sent=%ld per_write=%.2f inflight=%ld waiting=%ld offline=%ld",
+        outq->get_depth(), outq->get_bytes(), outq->get_max_depth(), outq->get_dropped_oldest(), outq->get_dropped_newest(), policy_names[outq->get_policy()],
+        writes, outq->get_sent(), per_write, inflight ? inflight->get_count() : 0, inflight ? inflight->get_waiting() : 0, offline ? offline->get_count() : 0);
+    frame_t frame = {OP_STATS, "", buf};
+    return send_to_client(&frame);
+}
+
+// function which handles a SUB or UNSUB batch, subscribing or unsubscribing the client from the batch's prefix followed by each entry,
+// in order, as if each had been sent on its own
+// returns 1 if the entries were malformed, those before the bad one are still handled
+int Connection::subscribe_batch(frame_t* frame) {
+    std::string_view entries(frame->msg);
+    std::string_view filter;
+    std::string name = frame->topic;
+    size_t prefix_len = name.size();
+    int ret;
+    while ((ret = decode_entry(&entries, &filter, NULL)) == 1) {
+        name.resize(prefix_len);
+        name.append(filter);
+        if (name.find('\0') != std::string::npos) {                      // stored as a C string, like a topic sent on its own
+            log_warn("Received topic with a NUL byte in a batch from client %d, ignoring", client_fd);
+            continue;
         }
-        else if (strncmp(payload.req, "LIST", REQ_SIZE) == 0) {                 // if message is a LIST, send the client a list of all topics they are subscribed to
-            printf("Received SUB from client %d to topic %s, processing\n", connection->get_client_fd(), payload.topic);
-            connection->list_topics();
+        if (frame->op == OP_SUB) server->subscribe_to_topic(this, name.c_str(), frame->qos);
+        else server->unsubscribe_from_topic(this, name.c_str());
+    }
+    if (ret == -1) log_warn("Received malformed %s batch from client %d, handled what came before", op_names[frame->op], client_fd);
+    return ret == -1;
+}
+
+// function which handles a single request from the client
+// returns 1 if the connection should stop reading, 0 otherwise
+int Connection::handle_frame(frame_t* frame) {
+    if (!connected) {                                                       // the first request from a client must be CONN
+        if (frame->op == OP_CONN) {                                         // if the request is CONN, we can connect the client
+            int requested = PROTOCOL_LEGACY;                                // a legacy CONN carries no version
+            if (version != PROTOCOL_LEGACY && frame->msg.size() > 0) requested = (uint8_t) frame->msg[0];
+            int accepted = requested < PROTOCOL_VERSION ? requested : PROTOCOL_VERSION;
+            if (accepted < PROTOCOL_LEGACY) accepted = PROTOCOL_LEGACY;
+            peer = accepted != PROTOCOL_LEGACY && Cluster::is_peer_id(frame->topic); // another node's link, with or without a session
+            if (peer && server->get_cluster() && frame->topic == server->get_cluster()->get_name()) {
+                log_warn("Client %d is this node's own cluster link, closing it", client_fd); // this node is in its own list of peers
+                cleanup = 1;
+                return 1;
+            }
+            if (accepted != PROTOCOL_LEGACY && frame->topic.size() > 0 && server->get_session_expiry() > 0) { // a framed CONN naming a client id starts or resumes its session
+                log_debug("Received CONN for version %d with session %s", requested, frame->topic.c_str());
+                version = accepted;
+                decoder->set_version(accepted);
+                connected = 1;
+                int clean = frame->msg.size() > 1 && (frame->msg[1] & CONN_CLEAN);
+                start_keepalive();
+                if (shard->open_session(this, frame->topic, clean)) return 1; // the session may live on another shard, which then takes the socket
+                return stream_input();
+            }
+
+            log_debug("Received CONN for version %d, sending CONN_ACK for version %d", requested, accepted);
+            frame_t ack = {OP_CONN_ACK, "", std::string(1, (char) accepted)};
+            if (version == PROTOCOL_LEGACY) ack.msg.clear();                // legacy clients do not expect a version back
+            send_to_client(&ack);                                           // send CONN_ACK to client, in the format it connected with
+            version = accepted;                                             // everything after the ack uses the accepted version
+            decoder->set_version(accepted);
+            connected = 1;
+            start_keepalive();
+            return stream_input();
         }
-        else if (strncmp(payload.req, "DISC", REQ_SIZE) == 0) {                 // if message is a DISC, send the client a DISC_ACK and set cleanup to 1, ending the listening thread's loop
-            printf("Received DISC from client %d, sending DISC_ACK\n", connection->get_client_fd());
-            snprintf(payload.req, REQ_SIZE, "DISC_ACK");
-            connection->send_to_client(&payload);
-            connection->cleanup = 1;
+        log_warn("Client %d did not send CONN", client_fd);                   // client did not send CONN, so it is probably not compatible, or there was an error
+        char buf[PACKET_SIZE] = {};
+        snprintf(buf, PACKET_SIZE, "Cannot join server, please try again later\n");
+        write(client_fd, buf, PACKET_SIZE);
+        cleanup = 1;
+        return 1;
+    }
+
+    if (frame->topic.find('\0') != std::string::npos) {                    // topics are stored as C strings, so an embedded NUL cannot be a valid topic
+        log_warn("Received topic with a NUL byte from client %d, ignoring", client_fd);
+        return 0;
+    }
+
+    switch (frame->op) {
+        case OP_PUB:                                                        // if message is a PUB, send it to all clients subscribed to the topic
+            log_debug("Received PUB from client %d to topic %s, processing", client_fd, frame->topic.c_str());
+            if (!frame->batch) server->publish_message(frame, 0, shard);
+            else if (server->publish_batch(frame, 0, shard)) log_warn("Received malformed PUB batch from client %d, published what came before", client_fd);
+            if (frame->qos) send_puback(frame->id);                         // a QoS 1 publish is acked whether or not it was valid, the client only waits on it
+            break;
+        case OP_PUBRET:                                                     // if message is a PUBRET, send it to all clients subscribed to the topic and retain the message
+            log_debug("Received PUBRET from client %d to topic %s, processing", client_fd, frame->topic.c_str());
+            if (!frame->batch) server->publish_message(frame, 1, shard);
+            else if (server->publish_batch(frame, 1, shard)) log_warn("Received malformed PUBRET batch from client %d, published what came before", client_fd);
+            if (frame->qos) send_puback(frame->id);
+            break;
+        case OP_SUB:                                                        // if message is a SUB, add the topic to the client's subscription list, at QoS 1 if OP_QOS1 was set
+            log_debug("Received SUB from client %d to topic %s, processing", client_fd, frame->topic.c_str());
+            if (frame->batch) subscribe_batch(frame);
+            else server->subscribe_to_topic(this, frame->topic.c_str(), frame->qos);
+            break;
+        case OP_UNSUB:                                                      // if message is a UNSUB, remove the topic from the client's subscription list
+            log_debug("Received UNSUB from client %d to topic %s, processing", client_fd, frame->topic.c_str());
+            if (frame->batch) subscribe_batch(frame);
+            else server->unsubscribe_from_topic(this, frame->topic.c_str());
+            break;
+        case OP_LIST:                                                       // if message is a LIST, send the client a list of all topics they are subscribed to
+            log_debug("Received LIST from client %d, processing", client_fd);
+            list_topics(frame);
+            break;
+        case OP_STATS:                                                      // if message is a STATS, send the client its outbound queue depth and drop counters
+            log_debug("Received STATS from client %d, processing", client_fd);
+            send_stats();
+            break;
+        case OP_PUBACK:                                                     // if message is a PUBACK, the client has a QoS 1 delivery, which makes room in its window
+            log_debug("Received PUBACK from client %d for packet %d", client_fd, frame->id);
+            if (inflight) {
+                Message* acked = inflight->ack(frame->id);
+                if (acked) {
+                    acked->unref();
+                    if (send_inflight()) shard->schedule_flush(this);
+                }
+                else log_debug("Client %d acked packet %d, which is not in flight", client_fd, frame->id);
+            }
+            break;
+        case OP_PING: {                                                     // if message is a PING, the client is checking we are still here
+            log_debug("Received PING from client %d, sending PONG", client_fd);
+            frame_t pong = {OP_PONG, "", ""};
+            send_to_client(&pong);
             break;
         }
-        else if (strncmp(payload.req, "DISC_ACK", REQ_SIZE) == 0) {             // if message is a DISC_ACK, set disconnected to 1, ending the disconnect_client() loop
-            printf("Received DISC_ACK from client %d\n", connection->get_client_fd());
-            connection->disconnected = 1;
+        case OP_PONG:                                                       // if message is a PONG, the client answered a keepalive PING, the read itself was what counted
+            log_debug("Received PONG from client %d", client_fd);
             break;
+        case OP_DISC: {                                                     // if message is a DISC, send the client a DISC_ACK and set cleanup to 1 so the shard reaps the connection
+            log_debug("Received DISC from client %d, sending DISC_ACK", client_fd);
+            frame_t ack = {OP_DISC_ACK, "", ""};
+            send_to_client(&ack);
+            cleanup = 1;
+            return 1;
         }
-        else { // something went horribly wrong
-            printf("Received unknown request from client %d: %s\n", connection->get_client_fd(), payload.req);
+        case OP_DISC_ACK:                                                   // if message is a DISC_ACK, the disconnect we started in disconnect_client() is complete
+            log_debug("Received DISC_ACK from client %d", client_fd);
+            disconnected = 1;
+            cleanup = 1;
+            return 1;
+        default: // something went horribly wrong
+            log_warn("Received unknown request from client %d", client_fd);
+    }
+    return 0;
+}
+
+// function called by the reactor when the client's socket has data to read
+// reads until the socket would block, feeding the bytes to the decoder and handling every whole frame it can make out of them
+int Connection::handle_readable() {
+    RingBuffer* inbuf = decoder->get_buffer();
+    while (!cleanup) {
+        ssize_t nread = inbuf->read_from_fd(client_fd, READ_SIZE);          // read whatever the client has sent straight into the input ring, nonblocking
+        if (nread == 0) return handle_hangup();                             // the client closed its end of the socket
+        if (nread == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;          // nothing left to read, wait for the next event
+            if (errno == EINTR) continue;
+            return handle_hangup();
         }
+        if (consume_input()) return 0;
+    }
+    return 0;
+}
+
+// function called by an io_uring reactor when a recv has completed, with what it read, or len 0 if the client closed its end
+// of the socket, or -errno; the data is in one of the reactor's buffers, so it is copied into the input ring before anything else
+int Connection::handle_received(const char* data, ssize_t len) {
+    if (cleanup) return 0;
+    if (len <= 0) return handle_hangup();
+    decoder->get_buffer()->write(data, len);
+    consume_input();
+    return 0;
+}
+
+// function which handles the bytes just added to the input ring
+// returns 1 if the connection should stop reading, because it gave its socket away or the stream is malformed
+int Connection::consume_input() {
+    frame_t frame;
+    heard = 1;
+    if (version == 0) {                                                     // the first byte tells us whether the client frames its requests or sends legacy packets
+        version = decoder->get_buffer()->at(0) == OP_CONN ? PROTOCOL_FRAMED : PROTOCOL_LEGACY;
+        decoder->set_version(version);
+    }
+
+    int ret = process_input(&frame);
+    if (ret == -1) {                                                        // the stream cannot be resynchronized after a bad frame
+        log_warn("Received malformed frame from client %d, disconnecting", client_fd);
+        handle_hangup();
+    }
+    return ret != 0;
+}
+
+// function which, once the client is connected and its socket is staying on this shard, keeps a multishot recv armed on it with an
+// io_uring reactor; until then each recv is only armed after the last was handled, so nothing the client sent after a CONN that hands
+// its socket to the shard holding its session is ever read here
+int Connection::stream_input() {
+    Reactor* reactor = shard->get_reactor();
+    if (reactor->get_backend() != BACKEND_URING) return 0;                 // epoll only reads when asked to
+    return reactor->receive_on(client_fd, this, 1);
+}
+
+// function which handles every whole frame the decoder can make out of the bytes read so far
+// returns 1 if the connection should stop reading, -1 if the stream is malformed, 0 otherwise
+int Connection::process_input(frame_t* frame) {
+    int ret = 0;
+    while (!cleanup && (ret = decoder->next(frame)) == 1) {
+        if (handle_frame(frame)) return 1;
+    }
+    return ret == -1 ? -1 : 0;
+}
+
+// function called by the reactor when the client's socket can be written to again after filling up
+int Connection::handle_writable() {
+    return flush();
+}
+
+// function called by the reactor when the client hung up or the socket errored
+int Connection::handle_hangup() {
+    if (!cleanup) log_info("Client %d hung up", client_fd);
+    cleanup = 1;                                                            // the shard will reap the connection after this reactor iteration
+    return 1;
+}
+
+// function which acks a CONN that named a session, saying whether the session's subscriptions and queued messages survived
+int Connection::send_conn_ack(int present) {
+    frame_t ack = {OP_CONN_ACK, "", std::string(1, (char) version)};
+    ack.msg.push_back((char) present);
+    return send_to_client(&ack);
+}
+
+// function which makes the connection a session, which outlives its socket until the server's session expiry
+int Connection::start_session(const std::string& client_id) {
+    this->client_id = client_id;
+    this->peer = Cluster::is_peer_id(client_id);                        // a session taken over from another shard is started here, not where the CONN arrived
+    log_info("Client %d started session %s", client_fd, client_id.c_str());
+    return 0;
+}
+
+// function which starts a session over for a client that asked for a clean one, dropping its subscriptions and everything queued for it
+int Connection::reset_session() {
+    while (subscriptions) server->remove_subscription(subscriptions);
+    delete offline;
+    offline = NULL;
+    delete inflight;
+    inflight = NULL;
+    return 0;
+}
+
+// function which lets go of the session's socket while keeping the session, the shard has already stopped watching the socket
+// publishes queued for the socket and never written in full go back to the front of the offline queue, the QoS 1 ones are still in the window
+int Connection::detach() {
+    close(client_fd);
+    client_fd = -1;
+    std::vector<Message*> unsent;
+    outq->clear(&unsent);
+    if (unsent.size() > 0 && !offline) offline = new OfflineQueue(server->get_offline_dir(), server->get_offline_budget());
+    for (auto it = unsent.rbegin(); it != unsent.rend(); it++) offline->push_front(*it, 0);
+    want_write = 0;
+    sending = 0;                                                            // removing the socket cancelled any send, its completion never comes here
+    flush_scheduled = 0;
+    disconnected = 0;
+    cleanup = 0;
+    disc_sent = 0;
+    shard->get_reactor()->get_timers()->arm(&timer, (uint64_t) server->get_session_expiry() * 1000);
+    return 0;
+}
+
+// function which gives a detached session the socket of a client that resumed it, the shard is already watching the socket
+// the client gets its CONN_ACK, then every QoS 1 delivery it never acked under its old packet id, then whatever queued while it was away,
+// and only then anything published from now on; input is what the client sent after its CONN, read before the socket changed shards
+int Connection::attach(int fd, int version, const std::string& input, int present) {
+    client_fd = fd;
+    this->version = version;
+    delete decoder;
+    decoder = new FrameDecoder(version, server->get_max_payload());
+    decoder->get_buffer()->write(input.data(), input.size());
+    connected = 1;
+    start_keepalive();
+    send_conn_ack(present);
+    if (inflight) {
+        inflight->for_each_unacked([](inflight_t* entry, void* ctx) {
+            Connection* conn = (Connection*) ctx;
+            entry->message->ref();                                          // the window keeps its reference until the client acks this time
+            return conn->outq->push_with_id(entry->message, entry->id, 0);
+        }, this);
+        send_inflight();
+    }
+    if (offline) {
+        log_info("Client %d resumed session %s with %ld messages queued, %ld spilled, %ld dropped", client_fd, client_id.c_str(),
+            offline->get_count(), offline->get_spilled(), offline->get_dropped());
+    }
+    pump_offline();
+    shard->schedule_flush(this);
+
+    frame_t frame;
+    if (process_input(&frame) == -1) {
+        log_warn("Received malformed frame from client %d, disconnecting", client_fd);
+        handle_hangup();
     }
+    return 0;
+}
+
+// function which takes the bytes the client sent after its CONN, for handing the socket to the shard that holds its session
+std::string Connection::take_input() {
+    RingBuffer* inbuf = decoder->get_buffer();
+    std::string input(inbuf->size(), '\0');
+    inbuf->peek(0, &input[0], input.size());
+    inbuf->consume(input.size());
+    return input;
+}
+
+// function which gives up the client's socket without closing it, returns the socket
+int Connection::release_socket() {
+    int fd = client_fd;
+    client_fd = -1;
+    return fd;
 }
 
-Connection::Connection(int client_fd, Server* server) {
+Connection::Connection(int client_fd, uint64_t id, Shard* shard) {
     this->client_fd = client_fd;
-	this->listen_thread = new std::thread(listen_loop, this);
-    this->server = server;
-    printf("Connection %d created\n", client_fd);
+    this->id = id;
+    this->shard = shard;
+    this->server = shard->get_server();
+    this->decoder = new FrameDecoder(0, server->get_max_payload());
+    this->outq = new OutQueue(server->get_queue_budget(), server->get_queue_policy(), shard->get_metrics());
+    this->timer.fn = timer_expired;
+    this->timer.ctx = this;
+    shard->get_reactor()->get_timers()->arm(&timer, CONN_TIMEOUT * 1000); // the client has this long to send CONN
+    log_info("Connection %d created", client_fd);
 }
 
 Connection::~Connection() {
-    close(client_fd);
-    listen_thread->join();
-    delete listen_thread;
+    shard->get_reactor()->get_timers()->cancel(&timer);
+    if (client_fd != -1) close(client_fd);                                  // a session detached from its socket or a connection that handed it on has none
+    delete subscription_index;                                              // the shard has already unsubscribed the client from everything
+    delete decoder;
+    if (outq->get_dropped_oldest() || outq->get_dropped_newest()) {
+        log_warn("Client %d dropped %ld oldest and %ld newest messages", client_fd, outq->get_dropped_oldest(), outq->get_dropped_newest());
+    }
+    delete outq;
+    delete inflight;                                                        // unacked deliveries are lost with the connection
+    delete offline;
 
-    printf("Connection %d closed\n", client_fd);
-}
\ No newline at end of file
+    log_info("Connection %d closed", client_fd);
+}
@@ -15,37 +15,123 @@
 #include <sys/wait.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <thread>
-#include <mutex>
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
+#include "buffer.h"
+#include "frame.h"
+#include "inflight.h"
+#include "log.h"
+#include "message.h"
+#include "offline.h"
+#include "outqueue.h"
 #include "payload.h"
+#include "reactor.h"
 #include "server.h"
+#include "shard.h"
+
+#define READ_SIZE 1024                // free bytes the input ring must have before each read() from a client's socket
+#define LIST_PAGE (16 * 1024)         // bytes of topic names in each frame of a LIST reply to a framed client
 
 class Server;
+class Shard;
+struct subscription;
+struct topic;
 
 // Connection class
-class Connection {
+// holds the state of a single client, its shard's reactor calls into it whenever the client's socket has an event
+class Connection : public EventHandler {
     private:
         int client_fd;
+        uint64_t id;                    // unique for the life of the server, unlike the fd which is reused
         Server* server;
-        std::thread* listen_thread;
-        std::vector<char*>* topics = new std::vector<char*>();
-        static void listen_loop(Connection* connection);
+        Shard* shard;
+        struct subscription* subscriptions = NULL;  // head of the client's list of subscriptions, oldest first
+        struct subscription* last_subscription = NULL;
+        std::unordered_map<struct topic*, struct subscription*>* subscription_index = new std::unordered_map<struct topic*, struct subscription*>(); // the client's subscriptions by topic
+        FrameDecoder* decoder;          // owns the input ring, partial frames wait there until the rest arrives
+        OutQueue* outq;                 // frames queued for the client that the socket has not taken yet
+        InflightWindow* inflight = NULL; // QoS 1 deliveries the client has not acked, NULL until the first one
+        std::string client_id;          // the session the client named in its CONN, empty if it has none
+        OfflineQueue* offline = NULL;   // publishes for the session while its client is away, and until what queued up then is sent
+        wheel_timer_t timer;            // one timer, what it times depends on the state: the CONN handshake, keepalive, DISC_ACK or session expiry
+        int heard = 0;                  // the client sent something since the keepalive timer last fired
+        int ping_sent = 0;              // a keepalive PING is waiting for the client to answer
+        int disc_sent = 0;              // we sent DISC and are waiting for DISC_ACK
+        static int timer_expired(void* ctx);
+        int start_keepalive();
+        int check_keepalive();
+        Message* encode_for_client(frame_t* frame);
+        int handle_frame(frame_t* frame);
+        int process_input(frame_t* frame);
+        int subscribe_batch(frame_t* frame);
+        int consume_input();
+        int stream_input();
+        int submit_send();
+        int send_publish(Message* message, uint64_t published, int qos);
+        int queue_qos1(Message* message, uint64_t published);
+        int queue_offline(Message* message, int qos);
+        int pump_offline();
+        int send_inflight();
+        int send_puback(uint16_t id);
+        int want_write = 0;             // set while the reactor is watching for EPOLLOUT because outq is not empty
+        int sending = 0;                // set while an io_uring send of outq is in flight
+        int flush_scheduled = 0;        // set while the connection is in its shard's list of connections to flush
+        uint64_t flush_since = 0;       // when the connection was put in that list, in microseconds, used by the shard's flush delay
+        int version = 0;                // the wire protocol version, 0 until the client's first byte tells us which one it speaks
+        int connected = 0;              // set to 1 once the client has sent CONN and received CONN_ACK
         int disconnected = 0;
         int cleanup = 0;
+        int snapshots = 0;              // retained snapshots the shard is streaming to the client
+        int peer = 0;                   // the client is another node's cluster link, its subscriptions are that node's interest
 
     public:
-        Connection(int client_fd, Server* server);
+        Connection(int client_fd, uint64_t id, Shard* shard);
         ~Connection();
         int disconnect_client();
-        int add_topic(char* topic);
-        int remove_topic(char* topic);
-        int list_topics();
-        inline int send_to_client(payload_t* payload) { return write(client_fd, payload, PACKET_SIZE); }
+        struct subscription* find_subscription(struct topic* topic);
+        int add_subscription(struct subscription* subscription);
+        int remove_subscription(struct subscription* subscription);
+        int list_topics(frame_t* request);
+        int handle_readable();
+        int handle_writable();
+        int handle_hangup();
+        int handle_received(const char* data, ssize_t len);
+        int handle_sent(ssize_t result);
+        int send_to_client(frame_t* frame);
+        int send_conn_ack(int present);
+        int start_session(const std::string& client_id);
+        int reset_session();
+        int detach();
+        int attach(int fd, int version, const std::string& input, int present);
+        std::string take_input();
+        int release_socket();
+        int publish_to_client(Message* message, uint64_t published, int qos);
+        int queue_publish(Message* message, uint64_t published, int qos);
+        int flush();
+        int send_stats();
+        int get_flush_scheduled() { return flush_scheduled; }
+        void set_flush_scheduled(int flush_scheduled) { this->flush_scheduled = flush_scheduled; }
+        uint64_t get_flush_since() { return flush_since; }
+        void set_flush_since(uint64_t flush_since) { this->flush_since = flush_since; }
+        OutQueue* get_outq() { return outq; }
+        int get_snapshots() { return snapshots; }
+        void set_snapshots(int snapshots) { this->snapshots = snapshots; }
         int get_client_fd() { return client_fd; }
+        uint64_t get_id() { return id; }
+        int get_version() { return version; }
+        int get_connected() { return connected; }
         int get_cleanup() { return cleanup; }
+        int get_session() { return client_id.size() > 0; }
+        int get_peer() { return peer; }
+        const std::string& get_client_id() { return client_id; }
+        struct subscription* get_subscriptions() { return subscriptions; }
+        size_t get_subscription_count() { return subscription_index->size(); }
         Server* get_server() { return server; }
+        Shard* get_shard() { return shard; }
 };
 
 #endif
\ No newline at end of file
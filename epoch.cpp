@@ -0,0 +1,125 @@
+#include "epoch.h"
+
+std::atomic<uint64_t> Epoch::global_epoch(0);
+std::atomic<int> Epoch::nslots(0);
+epoch_slot_t Epoch::default_slots[MAX_EPOCH_THREADS];
+epoch_slot_t* Epoch::slots = Epoch::default_slots;
+int Epoch::max_slots = MAX_EPOCH_THREADS;
+thread_local epoch_slot_t* Epoch::slot = NULL;
+
+// function which returns the calling thread's slot, claiming a new one the first time a thread uses the epoch
+epoch_slot_t* Epoch::get_slot() {
+    if (slot) return slot;
+    int index = nslots.fetch_add(1);
+    if (index >= max_slots) {                                           // every reader must have a slot or reclamation would be unsafe
+        log_error("Too many threads using the epoch, only %d were reserved, aborting", max_slots);
+        Log::stop();                                                    // flushes the record first
+        abort();
+    }
+    slot = &slots[index];
+    slot->local.store(EPOCH_IDLE);
+    slot->nesting = 0;
+    slot->limbo_head = NULL;
+    slot->limbo_tail = NULL;
+    slot->nretired = 0;
+    return slot;
+}
+
+// function which makes room for nthreads threads to use the epoch, if that is more than MAX_EPOCH_THREADS
+// it must be called before any thread has used the epoch, the slots are never moved once they are handed out
+// returns 1 if the slots could not be allocated
+int Epoch::reserve(int nthreads) {
+    if (nthreads <= max_slots) return 0;
+    if (nslots.load() > 0) {
+        log_error("Cannot reserve epoch slots once threads are using them");
+        return 1;
+    }
+    epoch_slot_t* more = new (std::nothrow) epoch_slot_t[nthreads];
+    if (!more) {
+        log_error("Could not allocate epoch slots for %d threads", nthreads);
+        return 1;
+    }
+    if (slots != default_slots) delete[] slots;                         // no thread has a slot yet, so nobody can be using the old ones
+    slots = more;                                                       // the last array is never freed, threads may still be in their sections at exit
+    max_slots = nthreads;
+    return 0;
+}
+
+// function which starts a read-side section, anything loaded from a shared pointer after this stays valid until exit()
+void Epoch::enter() {
+    epoch_slot_t* s = get_slot();
+    if (s->nesting++ > 0) return;
+    s->local.store(global_epoch.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);               // the epoch must be visible before any shared pointer is loaded
+}
+
+// function which ends a read-side section
+void Epoch::exit() {
+    epoch_slot_t* s = slot;
+    if (--s->nesting > 0) return;
+    s->local.store(EPOCH_IDLE, std::memory_order_release);
+}
+
+// function which schedules an object to be freed once no reader can still hold it
+// the object must already be unreachable from the shared structure
+void Epoch::retire(void* ptr, void (*free_fn)(void*)) {
+    epoch_slot_t* s = get_slot();
+    retired_t* item = new retired_t;
+    item->next = NULL;
+    item->ptr = ptr;
+    item->free_fn = free_fn;
+    item->epoch = global_epoch.load(std::memory_order_seq_cst);
+    if (s->limbo_tail) s->limbo_tail->next = item;
+    else s->limbo_head = item;
+    s->limbo_tail = item;
+    s->nretired++;
+    if (s->nretired >= RECLAIM_BATCH) reclaim();
+}
+
+// function which moves the global epoch forward if every thread inside a read-side section has caught up to it
+int Epoch::try_advance() {
+    uint64_t cur = global_epoch.load(std::memory_order_seq_cst);
+    int count = nslots.load(std::memory_order_acquire);
+    if (count > max_slots) count = max_slots;
+    for (int i = 0; i < count; i++) {
+        uint64_t local = slots[i].local.load(std::memory_order_seq_cst);
+        if (local != EPOCH_IDLE && local != cur) return 1;              // a reader from an older epoch may still hold retired objects
+    }
+    global_epoch.compare_exchange_strong(cur, cur + 1);
+    return 0;
+}
+
+// function which frees the objects in a slot's limbo list that were retired at or before safe_epoch
+int Epoch::free_limbo(epoch_slot_t* s, uint64_t safe_epoch) {
+    int nfreed = 0;
+    while (s->limbo_head && s->limbo_head->epoch <= safe_epoch) {
+        retired_t* item = s->limbo_head;
+        s->limbo_head = item->next;
+        item->free_fn(item->ptr);
+        delete item;
+        nfreed++;
+    }
+    if (!s->limbo_head) s->limbo_tail = NULL;
+    s->nretired -= nfreed;
+    return nfreed;
+}
+
+// function which frees whatever the calling thread retired that is now safe, called by each shard once per reactor iteration
+// an object retired in epoch e can be freed once the global epoch reaches e + 2
+int Epoch::reclaim() {
+    epoch_slot_t* s = get_slot();
+    if (!s->limbo_head) return 0;
+    try_advance();
+    uint64_t cur = global_epoch.load(std::memory_order_seq_cst);
+    if (cur < 2) return 0;
+    return free_limbo(s, cur - 2);
+}
+
+// function which frees everything every thread retired, only safe once all readers have stopped
+int Epoch::reclaim_all() {
+    int nfreed = 0;
+    int count = nslots.load();
+    if (count > max_slots) count = max_slots;
+    for (int i = 0; i < count; i++) nfreed += free_limbo(&slots[i], UINT64_MAX);
+    return nfreed;
+}
@@ -0,0 +1,64 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <atomic>
+#include <new>
+
+#include "log.h"
+
+#define MAX_EPOCH_THREADS 256         // max number of threads that can ever enter an epoch, unless more are reserved at startup
+#define EPOCH_IDLE UINT64_MAX         // the local epoch of a thread that is not inside a read-side section
+#define RECLAIM_BATCH 64              // number of retired objects a thread collects before it tries to advance the epoch
+
+// an object that has been unlinked from a shared structure but may still be in use by a reader
+typedef struct retired {
+    struct retired* next;
+    void* ptr;
+    void (*free_fn)(void*);
+    uint64_t epoch;                   // the global epoch when the object was retired
+} retired_t;
+
+// per-thread epoch state, padded to its own cache line so readers never share a line with each other
+typedef struct alignas(64) epoch_slot {
+    std::atomic<uint64_t> local;      // the epoch this thread entered at, or EPOCH_IDLE
+    int nesting;                      // read-side sections may nest, only the outermost one publishes the epoch
+    retired_t* limbo_head;            // retired objects, oldest first, only touched by the owning thread
+    retired_t* limbo_tail;
+    unsigned long nretired;
+} epoch_slot_t;
+
+// Epoch class, epoch-based reclamation for the lock-free read paths of the topic tree
+// readers wrap their accesses in enter()/exit(), writers unlink an object and hand it to retire(),
+// and the object is only freed once every thread that could have seen it has left its read-side section
+class Epoch {
+    private:
+        static std::atomic<uint64_t> global_epoch;
+        static std::atomic<int> nslots;
+        static epoch_slot_t default_slots[MAX_EPOCH_THREADS];
+        static epoch_slot_t* slots;                 // default_slots, or a bigger array if reserve was called for more threads
+        static int max_slots;
+        static thread_local epoch_slot_t* slot;
+        static epoch_slot_t* get_slot();
+        static int try_advance();
+        static int free_limbo(epoch_slot_t* slot, uint64_t safe_epoch);
+
+    public:
+        static int reserve(int nthreads);
+        static void enter();
+        static void exit();
+        static void retire(void* ptr, void (*free_fn)(void*));
+        static int reclaim();
+        static int reclaim_all();
+};
+
+// EpochGuard class, holds a read-side section open for as long as it is in scope
+class EpochGuard {
+    public:
+        EpochGuard() { Epoch::enter(); }
+        ~EpochGuard() { Epoch::exit(); }
+};
+
+#endif
@@ -0,0 +1,209 @@
+#include "frame.h"
+
+const char* op_names[OP_COUNT] = {"", "CONN", "CONN_ACK", "PUB", "PUBRET", "SUB", "UNSUB", "LIST", "DISC", "DISC_ACK", "STATS", "PUBACK", "PING", "PONG"};
+
+// function which writes value as a little-endian base-128 varint, 7 bits per byte with the high bit set on all but the last
+// out must have room for MAX_VARINT bytes, returns the number of bytes written
+size_t encode_varint(uint64_t value, uint8_t* out) {
+    size_t len = 0;
+    while (value >= 0x80) {
+        out[len++] = (uint8_t) (value | 0x80);
+        value >>= 7;
+    }
+    out[len++] = (uint8_t) value;
+    return len;
+}
+
+// function which appends the version 2 encoding of a frame to out
+int encode_frame(frame_t* frame, std::string* out) {
+    uint8_t header[1 + 2 * MAX_VARINT];
+    size_t len = 0;
+    header[len++] = (frame->qos ? frame->op | OP_QOS1 : frame->op) | (frame->batch ? OP_BATCH : 0) | (frame->snapshot ? OP_SNAPSHOT : 0);
+    if (frame->qos) len += encode_varint(frame->id, header + len);
+    len += encode_varint(frame->topic.size(), header + len);
+    out->reserve(out->size() + len + frame->topic.size() + MAX_VARINT + frame->msg.size());
+    out->append((char*) header, len);
+    out->append(frame->topic);
+
+    len = encode_varint(frame->msg.size(), header);
+    out->append((char*) header, len);
+    out->append(frame->msg);
+    return 0;
+}
+
+// function which appends the version 2 encoding of a frame to a ring buffer
+int encode_frame(frame_t* frame, RingBuffer* out) {
+    uint8_t header[1 + 2 * MAX_VARINT];
+    size_t len = 0;
+    header[len++] = (frame->qos ? frame->op | OP_QOS1 : frame->op) | (frame->batch ? OP_BATCH : 0) | (frame->snapshot ? OP_SNAPSHOT : 0);
+    if (frame->qos) len += encode_varint(frame->id, header + len);
+    len += encode_varint(frame->topic.size(), header + len);
+    if (out->write(header, len) || out->write(frame->topic.data(), frame->topic.size())) return 1;
+
+    len = encode_varint(frame->msg.size(), header);
+    if (out->write(header, len) || out->write(frame->msg.data(), frame->msg.size())) return 1;
+    return 0;
+}
+
+// function which converts a frame to a legacy payload
+// the legacy format cannot carry more than TOPIC_SIZE - 1 topic bytes or MSG_SIZE - 1 message bytes, so returns 1 if anything was truncated
+int encode_legacy(frame_t* frame, payload_t* payload) {
+    memset(payload, 0, sizeof(payload_t));
+    if (frame->op < OP_COUNT) snprintf(payload->req, REQ_SIZE, "%s", op_names[frame->op]);
+    snprintf(payload->topic, TOPIC_SIZE, "%s", frame->topic.c_str());
+    snprintf(payload->msg, MSG_SIZE, "%s", frame->msg.c_str());
+    return frame->topic.size() >= TOPIC_SIZE || frame->msg.size() >= MSG_SIZE;
+}
+
+// function which converts a legacy payload to a frame, returns 1 if the request type is unknown
+// PUBACK has no legacy form, legacy requests are always QoS 0
+int decode_legacy(payload_t* payload, frame_t* frame) {
+    frame->op = OP_NONE;
+    frame->qos = 0;
+    frame->id = 0;
+    frame->batch = 0;
+    frame->snapshot = 0;
+    for (int i = 1; i < OP_PUBACK; i++) {
+        if (strncmp(payload->req, op_names[i], REQ_SIZE) == 0) {
+            frame->op = i;
+            break;
+        }
+    }
+    frame->topic.assign(payload->topic, strnlen(payload->topic, TOPIC_SIZE));
+    frame->msg.assign(payload->msg, strnlen(payload->msg, MSG_SIZE));
+    return frame->op == OP_NONE;
+}
+
+// function which reads a varint off the front of a batch's entries, returns 1 if it did, 0 if the entries ran out first or it is too long
+static int take_varint(std::string_view* entries, uint64_t* value) {
+    uint64_t result = 0;
+    for (size_t i = 0; i < MAX_VARINT && i < entries->size(); i++) {
+        uint8_t byte = (*entries)[i];
+        result |= (uint64_t) (byte & 0x7f) << (7 * i);
+        if (!(byte & 0x80)) {
+            entries->remove_prefix(i + 1);
+            *value = result;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// function which appends a topic or filter to a SUB or UNSUB batch's entries
+int encode_entry(std::string* out, std::string_view topic) {
+    uint8_t header[MAX_VARINT];
+    out->append((char*) header, encode_varint(topic.size(), header));
+    out->append(topic);
+    return 0;
+}
+
+// function which appends a topic and message to a PUB or PUBRET batch's entries
+int encode_entry(std::string* out, std::string_view topic, std::string_view msg) {
+    encode_entry(out, topic);
+    uint8_t header[MAX_VARINT];
+    out->append((char*) header, encode_varint(msg.size(), header));
+    out->append(msg);
+    return 0;
+}
+
+// function which takes the next entry off the front of a batch's entries, msg is NULL for a SUB or UNSUB batch, whose entries have none
+// topic and msg are views into the entries, nothing is copied
+// returns 1 if an entry was taken, 0 once there are none left, and -1 if the entries are malformed
+int decode_entry(std::string_view* entries, std::string_view* topic, std::string_view* msg) {
+    if (entries->size() == 0) return 0;
+    uint64_t len;
+    if (!take_varint(entries, &len) || len > MAX_TOPIC_LEN || len > entries->size()) return -1;
+    *topic = entries->substr(0, len);
+    entries->remove_prefix(len);
+    if (!msg) return 1;
+    if (!take_varint(entries, &len) || len > entries->size()) return -1;
+    *msg = entries->substr(0, len);
+    entries->remove_prefix(len);
+    return 1;
+}
+
+// function which adds bytes read off the socket to the decoder
+// connections read straight into get_buffer() instead, this is for callers that already have the bytes in hand
+int FrameDecoder::feed(const char* data, size_t len) {
+    return buffer->write(data, len);
+}
+
+// function which reads a varint starting at *pos, advancing *pos past it
+// returns 1 if the varint is complete, 0 if more bytes are needed, and -1 if it is too long to be valid
+int FrameDecoder::decode_varint(size_t* pos, uint64_t* value) {
+    uint64_t result = 0;
+    for (int i = 0; i < MAX_VARINT; i++) {
+        if (*pos >= buffer->size()) return 0;
+        uint8_t byte = buffer->at((*pos)++);
+        result |= (uint64_t) (byte & 0x7f) << (7 * i);
+        if (!(byte & 0x80)) {
+            *value = result;
+            return 1;
+        }
+    }
+    return -1;
+}
+
+// function which decodes the next whole frame out of the buffered bytes
+// returns 1 if a frame was decoded, 0 if more bytes are needed, and -1 if the stream is malformed and the connection should be dropped
+int FrameDecoder::next(frame_t* frame) {
+    if (version == PROTOCOL_LEGACY) {                                   // legacy requests are always exactly PACKET_SIZE bytes
+        if (buffer->size() < PACKET_SIZE) return 0;
+        payload_t payload;
+        buffer->peek(0, &payload, PACKET_SIZE);
+        buffer->consume(PACKET_SIZE);
+        decode_legacy(&payload, frame);                                 // an unknown request is passed on as OP_NONE for the caller to report
+        return 1;
+    }
+
+    size_t pos = 0;
+    if (pos >= buffer->size()) return 0;
+    uint8_t op = buffer->at(pos++);
+    uint8_t qos = op & OP_QOS1 ? 1 : 0;
+    uint8_t batch = op & OP_BATCH ? 1 : 0;
+    uint8_t snapshot = op & OP_SNAPSHOT ? 1 : 0;
+    op &= ~(OP_QOS1 | OP_BATCH | OP_SNAPSHOT);
+    if (op == OP_NONE || op >= OP_COUNT) return -1;
+    if (batch && op != OP_PUB && op != OP_PUBRET && op != OP_SUB && op != OP_UNSUB) return -1; // nothing else has a list to carry
+    if (snapshot && (op != OP_PUBRET || batch)) return -1;              // only a single retained message is ever sent that way
+
+    uint64_t id = 0, topic_len, msg_len;
+    int ret;
+    if (qos) {
+        ret = decode_varint(&pos, &id);
+        if (ret <= 0) return ret;
+        if (id > MAX_PACKET_ID) return -1;
+    }
+    ret = decode_varint(&pos, &topic_len);
+    if (ret <= 0) return ret;
+    if (topic_len > MAX_TOPIC_LEN) return -1;
+    if (buffer->size() - pos < topic_len) return 0;
+    size_t topic_pos = pos;
+    pos += topic_len;
+
+    ret = decode_varint(&pos, &msg_len);
+    if (ret <= 0) return ret;
+    if (msg_len > max_payload) return -1;
+    if (buffer->size() - pos < msg_len) return 0;
+
+    frame->op = op;
+    frame->qos = qos;
+    frame->batch = batch;
+    frame->snapshot = snapshot;
+    frame->id = (uint16_t) id;
+    frame->topic.resize(topic_len);
+    buffer->peek(topic_pos, &frame->topic[0], topic_len);
+    frame->msg.resize(msg_len);
+    buffer->peek(pos, &frame->msg[0], msg_len);
+    buffer->consume(pos + msg_len);
+    return 1;
+}
+
+FrameDecoder::FrameDecoder(int version, size_t max_payload) {
+    this->version = version;
+    this->max_payload = max_payload;
+}
+
+FrameDecoder::~FrameDecoder() {
+    delete buffer;
+}
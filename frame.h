@@ -0,0 +1,102 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <string_view>
+
+#include "buffer.h"
+#include "payload.h"
+
+// the wire protocol
+// version 1 is the legacy format, every request is a fixed PACKET_SIZE payload_t
+// version 2 frames every request as a 1-byte opcode, a varint topic length, the topic, a varint message length, then the message
+// a client picks its version with its first request: a framed CONN carries the version it wants as its one message byte,
+// anything else is read as a legacy CONN, and the server answers CONN_ACK with the version it accepted in that version's format
+// a framed request with OP_QOS1 set in its opcode byte has a varint packet id right after it: a PUB or PUBRET sent that way is
+// QoS 1 and is answered with a PUBACK carrying the same id, a SUB sent that way asks for QoS 1 deliveries and its id is unused
+// a framed CONN with a topic names a session by client id and carries CONN flags as its second message byte, its CONN_ACK carries
+// a second byte too, 1 if the session was resumed with its subscriptions and queued messages, 0 if it started out empty
+// a framed PUB, PUBRET, SUB or UNSUB with OP_BATCH set in its opcode byte carries a list of entries as its message, each a varint
+// topic length and the topic, and for a publish a varint message length and the message, and its topic is a prefix put in front
+// of every entry's topic; the entries are handled in order as if each had been sent on its own, and a QoS 1 batch is acked once
+// a framed PUBRET with OP_SNAPSHOT set in its opcode byte is a topic's stored retained message, sent because of a SUB rather than
+// published just now; the server only sends it that way to other nodes' cluster links
+#define PROTOCOL_LEGACY 1
+#define PROTOCOL_FRAMED 2
+#define PROTOCOL_VERSION 2            // the newest version this build speaks
+
+#define MAX_VARINT 10                 // max bytes in an encoded 64-bit varint
+#define MAX_TOPIC_LEN 65535           // max bytes in a framed topic
+#define MAX_PAYLOAD (8 * 1024 * 1024) // default max bytes in a framed message, the server can be started with another limit
+#define OP_QOS1 0x80                  // flag on a framed opcode byte, set when a packet id follows
+#define OP_BATCH 0x40                 // flag on a framed opcode byte, set when the message is a list of entries
+#define OP_SNAPSHOT 0x20              // flag on a framed opcode byte, set on a retained message sent because of a SUB
+#define MAX_PACKET_ID 0xFFFF          // packet ids are 16 bits, 0 is never handed out
+#define CONN_CLEAN 0x01               // CONN flag, start the session over instead of resuming it
+
+// request opcodes, the legacy req strings are the names in op_names
+enum {
+    OP_NONE = 0,
+    OP_CONN,
+    OP_CONN_ACK,
+    OP_PUB,
+    OP_PUBRET,
+    OP_SUB,
+    OP_UNSUB,
+    OP_LIST,
+    OP_DISC,
+    OP_DISC_ACK,
+    OP_STATS,
+    OP_PUBACK,                        // framed only, acks the QoS 1 publish or delivery with the packet id it carries
+    OP_PING,                          // framed only, either side checks the other is still there, answered with PONG
+    OP_PONG,
+    OP_COUNT
+};
+
+extern const char* op_names[OP_COUNT];
+
+// a decoded request, independent of which wire version it arrived in
+typedef struct frame {
+    uint8_t op;
+    std::string topic;
+    std::string msg;
+    uint8_t qos = 0;                  // 1 if OP_QOS1 was set, legacy requests are always 0
+    uint16_t id = 0;                  // the packet id that came with OP_QOS1
+    uint8_t batch = 0;                // 1 if OP_BATCH was set, msg is then the entries, read them with decode_entry
+    uint8_t snapshot = 0;             // 1 if OP_SNAPSHOT was set
+} frame_t;
+
+size_t encode_varint(uint64_t value, uint8_t* out);
+int encode_frame(frame_t* frame, std::string* out);
+int encode_frame(frame_t* frame, RingBuffer* out);
+int encode_legacy(frame_t* frame, payload_t* payload);
+int decode_legacy(payload_t* payload, frame_t* frame);
+int encode_entry(std::string* out, std::string_view topic);
+int encode_entry(std::string* out, std::string_view topic, std::string_view msg);
+int decode_entry(std::string_view* entries, std::string_view* topic, std::string_view* msg);
+
+// FrameDecoder class, turns a stream of bytes read off a socket into whole frames
+// bytes can arrive split anywhere, anything short of a full frame is kept in the ring buffer until the rest of it is read
+class FrameDecoder {
+    private:
+        RingBuffer* buffer = new RingBuffer(RING_SIZE); // bytes received but not yet decoded
+        int version;
+        size_t max_payload;
+        int decode_varint(size_t* pos, uint64_t* value);
+
+    public:
+        FrameDecoder(int version, size_t max_payload);
+        ~FrameDecoder();
+        int feed(const char* data, size_t len);
+        int next(frame_t* frame);
+        void set_version(int version) { this->version = version; }
+        int get_version() { return version; }
+        RingBuffer* get_buffer() { return buffer; }
+        size_t get_buffered() { return buffer->size(); }
+};
+
+#endif
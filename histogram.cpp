@@ -0,0 +1,28 @@
+#include "histogram.h"
+
+// function which returns the highest value recorded in a bucket, what percentiles are reported as
+uint64_t Histogram::value_of(int bucket) {
+    if (bucket < (1 << HISTOGRAM_SUB_BITS)) return bucket;
+    int shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+    uint64_t top = (bucket & ((1 << HISTOGRAM_SUB_BITS) - 1)) + (1u << HISTOGRAM_SUB_BITS);
+    return ((top + 1) << shift) - 1;
+}
+
+// function which returns the value below which q of the total values in a merged histogram were recorded
+uint64_t Histogram::percentile(const uint64_t* counts, uint64_t total, double q) {
+    if (total == 0) return 0;
+    uint64_t rank = (uint64_t) (q * total);
+    if (rank >= total) rank = total - 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += counts[i];
+        if (seen > rank) return value_of(i);
+    }
+    return value_of(HISTOGRAM_BUCKETS - 1);
+}
+
+// function which adds this histogram's buckets to out, merging it with the others added there
+int Histogram::add_to(uint64_t* out) {
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) out[i] += counts[i].get();
+    return 0;
+}
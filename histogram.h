@@ -0,0 +1,52 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+
+#define HISTOGRAM_SUB_BITS 4          // every power of two is split into 16 buckets, so a bucket is never wider than 1/16 of its values
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+// function which returns the time on the monotonic clock in nanoseconds, what publishes are stamped with
+static inline uint64_t metrics_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Counter class, a count written by one thread and read by any
+// with a single writer there is no read-modify-write to make atomic, so bumping it is a plain load and store, never a locked add
+class Counter {
+    private:
+        std::atomic<uint64_t> value;
+
+    public:
+        Counter() { value.store(0, std::memory_order_relaxed); }
+        void add(uint64_t n) { value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+        void set(uint64_t n) { value.store(n, std::memory_order_relaxed); }
+        uint64_t get() { return value.load(std::memory_order_relaxed); }
+};
+
+// Histogram class, an HDR-style log-linear histogram of values written by one thread
+// values below 16 get a bucket each, above that each power of two is split into 16 equal buckets, so any value is recorded within
+// 1/16 of itself with a fixed table and one bit scan, and the histograms of several threads are merged by adding their buckets
+class Histogram {
+    private:
+        Counter counts[HISTOGRAM_BUCKETS];
+
+    public:
+        static int bucket_of(uint64_t value) {
+            if (value < (1u << HISTOGRAM_SUB_BITS)) return value;
+            int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS; // how far the value must move for its top bits to index within its power of two
+            return ((shift + 1) << HISTOGRAM_SUB_BITS) + (int) ((value >> shift) - (1u << HISTOGRAM_SUB_BITS));
+        }
+        static uint64_t value_of(int bucket);
+        static uint64_t percentile(const uint64_t* counts, uint64_t total, double q);
+        void record(uint64_t value) { counts[bucket_of(value)].add(1); }
+        int add_to(uint64_t* out);
+};
+
+#endif
@@ -0,0 +1,64 @@
+#include "inflight.h"
+
+// function which queues a QoS 1 message to be sent, taking over the caller's reference to it
+// it waits behind anything already waiting, next_ready hands it out once the window has room
+int InflightWindow::push(Message* message, uint64_t published) {
+    waiting->push_back({message, published, 0});
+    waiting_bytes += message->get_size();
+    return 0;
+}
+
+// function which moves the oldest waiting message into the window if there is room, giving it its packet id
+// the window keeps its reference until the message is acked, the caller takes its own to send it
+// returns 1 if entry was filled in, 0 if nothing is waiting or the window is full
+int InflightWindow::next_ready(inflight_t* entry) {
+    if (waiting->size() == 0 || next - oldest > mask) return 0;
+    if ((next & MAX_PACKET_ID) == 0) {                                  // 0 is not a packet id, its number and slot are skipped
+        if (next - oldest == mask) return 0;
+        if (oldest == next) oldest++;
+        next++;
+    }
+    *entry = waiting->front();
+    waiting->pop_front();
+    waiting_bytes -= entry->message->get_size();
+    entry->id = (uint16_t) (next & MAX_PACKET_ID);
+    slots[next & mask] = *entry;
+    next++;
+    count++;
+    return 1;
+}
+
+// function which takes the message sent under id out of the window, the caller takes over the window's reference
+// returns NULL for an id that is not unacked, a duplicate ack or one for a connection that has since been reset
+Message* InflightWindow::ack(uint16_t id) {
+    inflight_t* slot = &slots[id & mask];
+    if (!slot->message || slot->id != id) return NULL;
+    Message* message = slot->message;
+    slot->message = NULL;
+    count--;
+    while (oldest < next && !slots[oldest & mask].message) oldest++;    // slide the window past every acked message at its start
+    return message;
+}
+
+// function which calls fn on every unacked message in the order they were sent, for resending them on a new connection
+int InflightWindow::for_each_unacked(int (*fn)(inflight_t* entry, void* ctx), void* ctx) {
+    for (uint64_t number = oldest; number < next; number++) {
+        inflight_t* slot = &slots[number & mask];
+        if (slot->message && fn(slot, ctx)) return 1;
+    }
+    return 0;
+}
+
+InflightWindow::InflightWindow(uint32_t size) {
+    this->slots = new inflight_t[size]();
+    this->mask = size - 1;
+}
+
+InflightWindow::~InflightWindow() {
+    for (uint32_t i = 0; i <= mask; i++) {
+        if (slots[i].message) slots[i].message->unref();
+    }
+    for (auto it : *waiting) it.message->unref();
+    delete[] slots;
+    delete waiting;
+}
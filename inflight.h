@@ -0,0 +1,50 @@
+#ifndef INFLIGHT_H
+#define INFLIGHT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <deque>
+
+#include "frame.h"
+#include "message.h"
+
+#define INFLIGHT_WINDOW 256           // default QoS 1 messages a sender may have unacked on one connection, a power of two
+#define MAX_INFLIGHT 32768            // the largest window, half the packet ids, so no two unacked messages can share an id
+
+// a QoS 1 message that is unacked or waiting for room in the window
+typedef struct inflight {
+    Message* message;                 // NULL while the slot is free
+    uint64_t published;               // passed back out with the message, for the server's latency histogram
+    uint16_t id;                      // the packet id it was sent under, 0 while it waits
+} inflight_t;
+
+// InflightWindow class, one sender's QoS 1 messages between being sent and being acked
+// messages are numbered in the order they are sent and the packet id is the low 16 bits of the number, skipping 0, so the slot
+// an ack lands in is found by masking its id, nothing is allocated per message and a message waits only when the span from the
+// oldest unacked message to the next one fills the window; acks may arrive in any order, so many are pipelined at once
+// a window is only ever used from one thread
+class InflightWindow {
+    private:
+        inflight_t* slots;            // the window, indexed by packet id
+        uint32_t mask;                // slots - 1
+        uint64_t next = 1;            // the number the next message is sent under
+        uint64_t oldest = 1;          // the lowest number that may still be unacked
+        size_t count = 0;             // messages sent and not yet acked
+        std::deque<inflight_t>* waiting = new std::deque<inflight_t>(); // queued while the window is full, oldest first
+        size_t waiting_bytes = 0;
+
+    public:
+        InflightWindow(uint32_t size);
+        ~InflightWindow();
+        int push(Message* message, uint64_t published);
+        int next_ready(inflight_t* entry);
+        Message* ack(uint16_t id);
+        int for_each_unacked(int (*fn)(inflight_t* entry, void* ctx), void* ctx);
+        size_t get_count() { return count; }
+        size_t get_waiting() { return waiting->size(); }
+        size_t get_waiting_bytes() { return waiting_bytes; }
+        size_t get_unacked() { return count + waiting->size(); }
+};
+
+#endif
@@ -0,0 +1,175 @@
+#include "log.h"
+
+const char* log_level_names[LOG_LEVELS] = {"debug", "info", "warn", "error"};
+static const char* level_labels[LOG_LEVELS] = {"DEBUG", "INFO ", "WARN ", "ERROR"};
+
+std::atomic<int> Log::level(LOG_INFO);
+std::mutex Log::rings_lock;
+std::vector<log_ring_t*>* Log::rings = new std::vector<log_ring_t*>();
+thread_local log_ring_t* Log::ring = NULL;
+std::thread* Log::flusher = NULL;
+std::atomic<int> Log::running(0);
+
+// function which returns the calling thread's ring, creating and registering it the first time the thread logs
+// rings are never freed while the server runs, a thread that exits leaves its ring for the flusher to drain
+log_ring_t* Log::get_ring() {
+    if (ring) return ring;
+    ring = new log_ring_t;
+    ring->head.store(0);
+    ring->tail.store(0);
+    ring->dropped.store(0);
+    ring->buf = (char*) malloc(LOG_RING_SIZE);
+    std::lock_guard<std::mutex> guard(rings_lock);
+    snprintf(ring->name, sizeof(ring->name), "thread %ld", rings->size());
+    rings->push_back(ring);
+    return ring;
+}
+
+// function which finds room for a record of size bytes in a ring, skipping to the start if it does not fit before the end
+// returns where to write it and sets head to the position it starts at, or returns NULL and counts a drop if the ring is full
+char* Log::reserve(log_ring_t* ring, size_t size, uint64_t* head) {
+    uint64_t start = ring->head.load(std::memory_order_relaxed);
+    uint64_t tail = ring->tail.load(std::memory_order_acquire);
+    size_t offset = start & (LOG_RING_SIZE - 1);
+    size_t filler = offset + size > LOG_RING_SIZE ? LOG_RING_SIZE - offset : 0;
+    if (start + filler + size - tail > LOG_RING_SIZE) {
+        ring->dropped++;
+        return NULL;
+    }
+    if (filler) {                                                       // a record is never split across the end, the flusher skips the filler
+        log_record_t* record = (log_record_t*) (ring->buf + offset);
+        record->size = filler;
+        record->level = LOG_WRAP;
+        start += filler;
+    }
+    *head = start;
+    return ring->buf + (start & (LOG_RING_SIZE - 1));
+}
+
+// function which formats a time in seconds as a local date and time, only the flusher calls it and it only changes once a second
+static const char* date_of(time_t second) {
+    static time_t last_second = -1;
+    static char date[32];
+    if (second != last_second) {
+        struct tm tm;
+        localtime_r(&second, &tm);
+        strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+        last_second = second;
+    }
+    return date;
+}
+
+// function which formats a record as one line, time, level, thread and message, and adds it to the flusher's output
+// lines are gathered in one buffer and written with a single fwrite once it fills up, only the flusher calls this
+int Log::write_record(log_ring_t* ring, log_record_t* record) {
+    static char out[LOG_OUT_SIZE];
+    static size_t used = 0;
+    if (!record) {                                                      // a NULL record writes out what has been gathered so far
+        fwrite(out, 1, used, stdout);
+        used = 0;
+        return 0;
+    }
+    if (used + LOG_LINE_SIZE > sizeof(out)) write_record(NULL, NULL);
+
+    char* line = out + used;
+    int prefix = snprintf(line, LOG_LINE_SIZE, "%s.%06lu %s [%s] ", date_of(record->time / 1000000000),
+        (unsigned long) (record->time % 1000000000 / 1000), level_labels[record->level], ring->name);
+    int len = record->format(line + prefix, LOG_LINE_SIZE - prefix - 1, record->fmt, (const char*) (record + 1));
+    if (len < 0) return 1;
+    if (len > LOG_LINE_SIZE - prefix - 2) len = LOG_LINE_SIZE - prefix - 2; // cut short, snprintf stopped at the end of the line
+    while (len > 0 && line[prefix + len - 1] == '\n') len--;            // every record is a line of its own
+    line[prefix + len] = '\n';
+    used += prefix + len + 1;
+    return 0;
+}
+
+// function which writes out every record in every ring, oldest first across the rings
+// returns the number of records written
+int Log::flush_rings() {
+    std::vector<log_ring_t*> current;
+    {
+        std::lock_guard<std::mutex> guard(rings_lock);
+        current = *rings;
+    }
+
+    int written = 0;
+    while (1) {
+        log_ring_t* oldest = NULL;
+        log_record_t* oldest_record = NULL;
+        for (auto it : current) {                                       // the next record of each ring, the rings are each in order already
+            uint64_t tail = it->tail.load(std::memory_order_relaxed);
+            if (tail == it->head.load(std::memory_order_acquire)) continue;
+            log_record_t* record = (log_record_t*) (it->buf + (tail & (LOG_RING_SIZE - 1)));
+            if (record->level == LOG_WRAP) {
+                it->tail.store(tail + record->size, std::memory_order_release);
+                if (tail + record->size == it->head.load(std::memory_order_acquire)) continue;
+                record = (log_record_t*) it->buf;
+            }
+            if (!oldest_record || record->time < oldest_record->time) {
+                oldest = it;
+                oldest_record = record;
+            }
+        }
+        if (!oldest) break;
+
+        write_record(oldest, oldest_record);
+        oldest->tail.fetch_add(oldest_record->size, std::memory_order_release); // hand the space back to the thread
+        written++;
+    }
+
+    for (auto it : current) {
+        unsigned long dropped = it->dropped.exchange(0);
+        if (dropped) write_record(NULL, NULL);
+        if (dropped) fprintf(stdout, "%s.000000 %s [%s] dropped %lu log records, its ring was full\n", date_of(time(NULL)), level_labels[LOG_WARN], it->name, dropped);
+    }
+    return written;
+}
+
+// the body of the flusher thread, which drains the rings until the logger is stopped and everything logged before has been written
+void Log::flusher_loop() {
+    while (running.load()) {
+        if (flush_rings() == 0) {
+            write_record(NULL, NULL);
+            fflush(stdout);
+            usleep(LOG_FLUSH_MS * 1000);
+        }
+    }
+    flush_rings();
+    write_record(NULL, NULL);
+    fflush(stdout);
+}
+
+// function which starts the flusher thread, records logged before it starts wait in their rings
+int Log::start() {
+    if (flusher) return 0;
+    running.store(1);
+    flusher = new std::thread(flusher_loop);
+    return 0;
+}
+
+// function which stops the flusher once it has written everything logged so far
+int Log::stop() {
+    if (!flusher) return 0;
+    running.store(0);
+    flusher->join();
+    delete flusher;
+    flusher = NULL;
+    return 0;
+}
+
+// function which names the calling thread in its records
+void Log::set_thread_name(const char* fmt, ...) {
+    log_ring_t* ring = get_ring();
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(ring->name, sizeof(ring->name), fmt, args);
+    va_end(args);
+}
+
+// function which turns a level's name into the level, returns -1 if there is no such level
+int Log::parse_level(const char* name) {
+    for (int i = 0; i < LOG_LEVELS; i++) {
+        if (strcmp(name, log_level_names[i]) == 0) return i;
+    }
+    return -1;
+}
@@ -0,0 +1,157 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+// log levels, a record is kept if it is at or above the level chosen at runtime
+enum {
+    LOG_DEBUG = 0,                    // every request and publish
+    LOG_INFO,                         // connections coming and going, startup and shutdown
+    LOG_WARN,                         // clients falling behind or misbehaving
+    LOG_ERROR,                        // something on the server failed
+    LOG_LEVELS
+};
+
+extern const char* log_level_names[LOG_LEVELS];
+
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_DEBUG   // build with -DLOG_COMPILE_LEVEL=1 to compile the debug records out altogether
+#endif
+
+#define LOG_RING_SIZE (1 << 20)       // bytes in each thread's ring, a power of two, a thread that fills its ring drops records until the flusher catches up
+#define LOG_ARG_MAX 1024              // longest string argument copied into a record, longer ones are cut short
+#define LOG_LINE_SIZE 4096            // longest formatted line
+#define LOG_OUT_SIZE (1 << 16)        // bytes of formatted lines the flusher gathers before writing them out
+#define LOG_FLUSH_MS 10               // milliseconds the flusher sleeps once every ring is empty
+#define LOG_WRAP LOG_LEVELS           // the level of the filler record that skips the end of a ring a record did not fit in
+
+// a record in a ring, followed by its encoded arguments
+// nothing is formatted by the thread that logs, the flusher calls format to rebuild the arguments and run them through the format string
+typedef struct log_record {
+    uint32_t size;                    // bytes in the record, header and arguments, rounded up to 8
+    int level;
+    uint64_t time;                    // nanoseconds on the realtime clock, the flusher merges the threads' rings in this order
+    const char* fmt;                  // a string literal, so it outlives the record
+    int (*format)(char* out, size_t size, const char* fmt, const char* args);
+} log_record_t;
+
+// a thread's ring, written only by the thread and read only by the flusher, so the two positions are all the synchronization it needs
+typedef struct log_ring {
+    alignas(64) std::atomic<uint64_t> head; // bytes ever written, the producer's
+    alignas(64) std::atomic<uint64_t> tail; // bytes ever consumed, the flusher's
+    std::atomic<unsigned long> dropped;     // records lost to a full ring since the flusher last reported them
+    char name[32];                          // printed with every record from the thread
+    char* buf;
+} log_ring_t;
+
+// LogArg struct, how one argument is copied into a record and read back out
+// numbers and pointers are copied as they are, strings are copied in with their NUL so the caller's buffer may be gone by the time
+// the record is formatted
+template <typename T>
+struct LogArg {
+    static size_t size(T) { return sizeof(T); }
+    static char* put(char* p, T value) { memcpy(p, &value, sizeof(T)); return p + sizeof(T); }
+    static T get(const char*& p) { T value; memcpy(&value, p, sizeof(T)); p += sizeof(T); return value; }
+};
+
+template <>
+struct LogArg<const char*> {
+    static size_t size(const char* s) { return (s ? strnlen(s, LOG_ARG_MAX) : 6) + 1; }
+    static char* put(char* p, const char* s) {
+        size_t len = size(s) - 1;
+        memcpy(p, s ? s : "(null)", len);
+        p[len] = '\0';
+        return p + len + 1;
+    }
+    static const char* get(const char*& p) { const char* s = p; p += strlen(s) + 1; return s; }
+};
+
+template <>
+struct LogArg<char*> : LogArg<const char*> {};
+
+// checks a record's format string against its arguments at compile time, it is never called
+static inline void log_check(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+static inline void log_check(const char* fmt, ...) {}
+
+// Log class, asynchronous logging for the server
+// a thread logging a record only checks the level, copies the arguments into its own ring and moves the ring's head,
+// a background thread formats the records, merges the rings by time and writes them out, so a record below the level costs one
+// comparison and one that is kept never touches stdio's lock on the thread that logged it
+class Log {
+    private:
+        static std::atomic<int> level;
+        static std::mutex rings_lock;                   // only taken to add a thread's ring and by the flusher to see the list
+        static std::vector<log_ring_t*>* rings;
+        static thread_local log_ring_t* ring;
+        static std::thread* flusher;
+        static std::atomic<int> running;
+        static log_ring_t* get_ring();
+        static char* reserve(log_ring_t* ring, size_t size, uint64_t* head);
+        static int flush_rings();
+        static int write_record(log_ring_t* ring, log_record_t* record);
+        static void flusher_loop();
+
+        template <typename... Args>
+        static int format_record(char* out, size_t size, const char* fmt, const char* args) {
+            if constexpr (sizeof...(Args) == 0) return snprintf(out, size, "%s", fmt);
+            else {
+                std::tuple<decltype(LogArg<Args>::get(args))...> values{LogArg<Args>::get(args)...}; // braces read the arguments in order
+                return std::apply([out, size, fmt](auto... value) { return snprintf(out, size, fmt, value...); }, values);
+            }
+        }
+
+    public:
+        static int start();
+        static int stop();
+        static int parse_level(const char* name);
+        static void set_level(int level) { Log::level.store(level, std::memory_order_relaxed); }
+        static int get_level() { return level.load(std::memory_order_relaxed); }
+        static void set_thread_name(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+
+        template <typename... Args>
+        static void write(int level, const char* fmt, Args... args) {
+            log_ring_t* ring = get_ring();
+            size_t size = (sizeof(log_record_t) + (0 + ... + LogArg<Args>::size(args)) + 7) & ~(size_t) 7;
+            uint64_t head;
+            char* p = reserve(ring, size, &head);
+            if (!p) return;
+
+            log_record_t* record = (log_record_t*) p;
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            record->size = size;
+            record->level = level;
+            record->time = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+            record->fmt = fmt;
+            record->format = format_record<Args...>;
+            p += sizeof(log_record_t);
+            ((p = LogArg<Args>::put(p, args)), ...);
+            ring->head.store(head + size, std::memory_order_release);  // publish the record to the flusher
+        }
+};
+
+// logs a record if its level is compiled in and at or above the runtime level, the arguments are not even evaluated otherwise
+#define LOG_AT(lvl, ...) do { \
+        if ((lvl) >= LOG_COMPILE_LEVEL && (lvl) >= Log::get_level()) { \
+            if (0) log_check(__VA_ARGS__); \
+            Log::write(lvl, __VA_ARGS__); \
+        } \
+    } while (0)
+
+#define log_debug(...) LOG_AT(LOG_DEBUG, __VA_ARGS__)
+#define log_info(...) LOG_AT(LOG_INFO, __VA_ARGS__)
+#define log_warn(...) LOG_AT(LOG_WARN, __VA_ARGS__)
+#define log_error(...) LOG_AT(LOG_ERROR, __VA_ARGS__)
+
+#endif
@@ -0,0 +1,92 @@
+#include "message.h"
+
+// function which allocates a message with room for size encoded bytes right after its header, holding one reference
+Message* Message::allocate(size_t size) {
+    void* mem = malloc(sizeof(Message) + size);
+    if (!mem) return NULL;
+    Message* message = new (mem) Message();
+    message->refs.store(1, std::memory_order_relaxed);
+    message->size = size;
+    message->published = 0;
+    message->qos = 0;
+    return message;
+}
+
+// function which drops a reference, freeing the message once nobody holds it
+void Message::unref() {
+    if (refs.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+    this->~Message();
+    free(this);
+}
+
+// function which encodes a frame into a new message in the given protocol version
+Message* Message::encode(frame_t* frame, int version) {
+    return encode(frame->op, frame->topic.data(), frame->topic.size(), frame->msg.data(), frame->msg.size(), version, frame->qos ? frame->id : 0);
+}
+
+// function which encodes a request into a new message in the given protocol version, the caller owns the one reference
+// a legacy message is truncated to fit a payload_t like encode_legacy does
+// a nonzero packet_id is written into a framed message with OP_QOS1, which is how a PUBACK is sent; a shared publish never carries
+// one, each QoS 1 delivery of it is given its own id in the subscriber's queue instead
+Message* Message::encode(uint8_t op, const char* topic, size_t topic_len, const char* msg, size_t msg_len, int version, uint16_t packet_id) {
+    if (version == PROTOCOL_LEGACY) {
+        Message* message = allocate(PACKET_SIZE);
+        if (!message) return NULL;
+        payload_t* payload = (payload_t*) message->bytes();
+        memset(payload, 0, PACKET_SIZE);
+        if (op < OP_COUNT) snprintf(payload->req, REQ_SIZE, "%s", op_names[op]);
+        if (topic_len >= TOPIC_SIZE) topic_len = TOPIC_SIZE - 1;
+        if (msg_len >= MSG_SIZE) msg_len = MSG_SIZE - 1;
+        memcpy(payload->topic, topic, topic_len);
+        memcpy(payload->msg, msg, msg_len);
+        message->version = version;
+        message->op = op;
+        message->topic_off = offsetof(payload_t, topic);
+        message->topic_len = topic_len;
+        message->msg_off = offsetof(payload_t, msg);
+        message->msg_len = msg_len;
+        return message;
+    }
+
+    uint8_t topic_header[1 + 2 * MAX_VARINT];
+    uint8_t msg_header[MAX_VARINT];
+    size_t topic_header_len = 1;
+    topic_header[0] = packet_id ? op | OP_QOS1 : op;
+    if (packet_id) topic_header_len += encode_varint(packet_id, topic_header + topic_header_len);
+    topic_header_len += encode_varint(topic_len, topic_header + topic_header_len);
+    size_t msg_header_len = encode_varint(msg_len, msg_header);
+
+    Message* message = allocate(topic_header_len + topic_len + msg_header_len + msg_len);
+    if (!message) return NULL;
+    char* out = message->bytes();
+    memcpy(out, topic_header, topic_header_len);
+    memcpy(out + topic_header_len, topic, topic_len);
+    memcpy(out + topic_header_len + topic_len, msg_header, msg_header_len);
+    memcpy(out + topic_header_len + topic_len + msg_header_len, msg, msg_len);
+    message->version = version;
+    message->op = op;
+    message->topic_off = topic_header_len;
+    message->topic_len = topic_len;
+    message->msg_off = topic_header_len + topic_len + msg_header_len;
+    message->msg_len = msg_len;
+    return message;
+}
+
+// function which returns a framed copy of a retained message with OP_SNAPSHOT set, for a cluster link the message is sent to
+// because it subscribed, the flag is kept in the op so QoS 1 resends and offline queues keep it too; the caller owns the reference
+Message* Message::as_snapshot() {
+    Message* message = encode(op | OP_SNAPSHOT, get_topic(), topic_len, get_msg(), msg_len, PROTOCOL_FRAMED);
+    if (message) message->qos = qos;
+    return message;
+}
+
+// function which returns a reference to this message in the given protocol version, re-encoding it only if the version differs
+Message* Message::to_version(int version) {
+    if (version == this->version) {
+        ref();
+        return this;
+    }
+    Message* message = encode(op, get_topic(), topic_len, get_msg(), msg_len, version);
+    if (message) message->qos = qos;
+    return message;
+}
@@ -0,0 +1,56 @@
+#ifndef MESSAGE_H
+#define MESSAGE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <new>
+#include <atomic>
+
+#include "frame.h"
+#include "payload.h"
+
+// Message class, an immutable, reference-counted, already-encoded frame
+// a publish is encoded into one of these once, and every subscriber's queue holds a reference to it instead of a copy,
+// the header and the encoded bytes share one allocation, which is freed when the last reference is dropped
+class Message {
+    private:
+        std::atomic<int> refs;
+        int version;                  // the protocol version the bytes are encoded in
+        uint8_t op;
+        size_t size;                  // total encoded bytes
+        size_t topic_off;             // where the topic and message sit inside the encoded bytes
+        size_t topic_len;
+        size_t msg_off;
+        size_t msg_len;
+        uint64_t published;           // when the publish arrived on the monotonic clock, in nanoseconds, 0 for anything else
+        int qos;                      // 1 for a QoS 1 publish, whose subscribers at QoS 1 each get it under a packet id of their own
+        char* bytes() { return (char*) (this + 1); }
+        static Message* allocate(size_t size);
+        Message() {}
+        ~Message() {}
+
+    public:
+        static Message* encode(frame_t* frame, int version);
+        static Message* encode(uint8_t op, const char* topic, size_t topic_len, const char* msg, size_t msg_len, int version, uint16_t packet_id = 0);
+        Message* to_version(int version);
+        Message* as_snapshot();
+        void ref() { refs.fetch_add(1, std::memory_order_relaxed); }
+        void unref();
+        const char* get_data() { return bytes(); }
+        size_t get_size() { return size; }
+        int get_version() { return version; }
+        uint8_t get_op() { return op; }
+        const char* get_topic() { return bytes() + topic_off; }
+        size_t get_topic_len() { return topic_len; }
+        const char* get_msg() { return bytes() + msg_off; }
+        size_t get_msg_len() { return msg_len; }
+        uint64_t get_published() { return published; }
+        void set_published(uint64_t published) { this->published = published; }
+        int get_qos() { return qos; }
+        void set_qos(int qos) { this->qos = qos; }
+};
+
+#endif
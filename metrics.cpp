@@ -0,0 +1,297 @@
+#include "metrics.h"
+#include "server.h"
+#include "shard.h"
+
+// function which counts a publish under its topic's first level, only called by the shard the metrics belong to
+// the table is open addressed and never shrinks, a level is added by setting its length and hash before publishing its name
+int count_publish(shard_metrics_t* metrics, const char* topic, size_t len) {
+    const char* slash = (const char*) memchr(topic, '/', len);
+    uint32_t prefix_len = slash ? slash - topic : len;
+    uint32_t hash = 2166136261u;                                        // FNV-1a, like the topic tree's children tables
+    for (uint32_t i = 0; i < prefix_len; i++) {
+        hash ^= (uint8_t) topic[i];
+        hash *= 16777619u;
+    }
+
+    for (uint32_t i = 0; i < METRICS_PROBES; i++) {
+        prefix_count_t* slot = &metrics->prefixes[(hash + i) & (METRICS_PREFIXES - 1)];
+        const char* name = slot->name.load(std::memory_order_relaxed);
+        if (!name) {
+            slot->len = prefix_len;
+            slot->hash = hash;
+            slot->name.store(topic, std::memory_order_release);         // topic names are interned for the life of the server, so the view stays good
+            slot->publishes.add(1);
+            return 0;
+        }
+        if (slot->hash == hash && slot->len == prefix_len && memcmp(name, topic, prefix_len) == 0) {
+            slot->publishes.add(1);
+            return 0;
+        }
+    }
+    metrics->other_prefixes.add(1);
+    return 1;
+}
+
+// function which adds a per second rate to values, from how far a total moved since the last sample
+int Metrics::add_rate(std::vector<std::pair<std::string, std::string>>* values, const char* name, uint64_t total, uint64_t elapsed) {
+    uint64_t& last = (*last_totals)[name];
+    double rate = elapsed ? (double) (total - last) * 1000000000 / elapsed : 0;
+    last = total;
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.1f", rate);
+    values->push_back({std::string(name) + "/per_second", buf});
+    return 0;
+}
+
+// function which adds up every shard's counters into a list of metric names and values, the names are relative to SYS_PREFIX
+// counters are totals since the server started, rates and latencies cover the time since the last sample
+int Metrics::sample(std::vector<std::pair<std::string, std::string>>* values) {
+    uint64_t now = metrics_now();
+    uint64_t elapsed = last_sample ? now - last_sample : 0;
+    last_sample = now;
+
+    uint64_t publishes_in = 0, bytes_in = 0, messages_out = 0, bytes_out = 0, subscribes = 0, unsubscribes = 0;
+    uint64_t dropped_oldest = 0, dropped_newest = 0, disconnected = 0, queued_bytes = 0, queued_messages = 0, other_prefixes = 0;
+    std::vector<uint64_t> latency(HISTOGRAM_BUCKETS, 0);
+    std::unordered_map<std::string, uint64_t> prefixes;
+    for (auto shard : *server->get_shards()) {
+        shard_metrics_t* it = shard->get_metrics();
+        publishes_in += it->publishes_in.get();
+        bytes_in += it->bytes_in.get();
+        messages_out += it->messages_out.get();
+        bytes_out += it->bytes_out.get();
+        subscribes += it->subscribes.get();
+        unsubscribes += it->unsubscribes.get();
+        dropped_oldest += it->dropped_oldest.get();
+        dropped_newest += it->dropped_newest.get();
+        disconnected += it->disconnected.get();
+        queued_bytes += it->queued_bytes.get();
+        queued_messages += it->queued_messages.get();
+        it->latency.add_to(latency.data());
+        for (int i = 0; i < METRICS_PREFIXES; i++) {
+            const char* name = it->prefixes[i].name.load(std::memory_order_acquire);
+            if (name) prefixes[std::string(name, it->prefixes[i].len)] += it->prefixes[i].publishes.get();
+        }
+        other_prefixes += it->other_prefixes.get();
+    }
+
+    uint64_t interval[HISTOGRAM_BUCKETS];                               // the latencies recorded since the last sample
+    uint64_t count = 0;
+    int highest = -1;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        interval[i] = latency[i] - last_latency[i];
+        last_latency[i] = latency[i];
+        count += interval[i];
+        if (interval[i]) highest = i;
+    }
+
+    auto add = [values](const char* name, uint64_t value) { values->push_back({name, std::to_string(value)}); };
+    auto add_usec = [values](const char* name, uint64_t nsec) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%.1f", nsec / 1000.0);
+        values->push_back({name, buf});
+    };
+    add("uptime", (now - started) / 1000000000);
+    add("clients/connected", server->get_client_count());
+    add("topics", server->get_topic_count());
+    add("subscriptions", subscribes - unsubscribes);
+    add("messages/received", publishes_in);
+    add_rate(values, "messages/received", publishes_in, elapsed);
+    add("messages/sent", messages_out);
+    add_rate(values, "messages/sent", messages_out, elapsed);
+    add("bytes/received", bytes_in);
+    add_rate(values, "bytes/received", bytes_in, elapsed);
+    add("bytes/sent", bytes_out);
+    add_rate(values, "bytes/sent", bytes_out, elapsed);
+    add("drops/oldest", dropped_oldest);
+    add("drops/newest", dropped_newest);
+    add("drops/disconnected", disconnected);
+    add("queue/bytes", queued_bytes);
+    add("queue/messages", queued_messages);
+    add("latency/count", count);
+    add_usec("latency/p50_usec", Histogram::percentile(interval, count, 0.5));
+    add_usec("latency/p90_usec", Histogram::percentile(interval, count, 0.9));
+    add_usec("latency/p99_usec", Histogram::percentile(interval, count, 0.99));
+    add_usec("latency/p999_usec", Histogram::percentile(interval, count, 0.999));
+    add_usec("latency/max_usec", highest == -1 ? 0 : Histogram::value_of(highest));
+    for (auto& it : prefixes) values->push_back({"publishes/" + it.first, std::to_string(it.second)});
+    if (other_prefixes) add("publishes/(other)", other_prefixes);
+    return 0;
+}
+
+// function which publishes every value that changed since the last sample as a retained message under SYS_PREFIX,
+// and keeps the whole sample as text for the stats endpoint
+int Metrics::publish(std::vector<std::pair<std::string, std::string>>* values) {
+    text.clear();
+    for (auto& it : *values) {
+        text += it.first + " " + it.second + "\n";
+        std::string& last = (*published)[it.first];
+        if (last == it.second) continue;                                // retained, so a subscriber already has the current value
+        last = it.second;
+        server->publish_sys(SYS_PREFIX + it.first, it.second);
+    }
+    return 0;
+}
+
+// function which decodes the %XX escapes and + signs of a query string value
+static std::string url_decode(std::string_view value) {
+    std::string decoded;
+    for (size_t i = 0; i < value.size(); i++) {
+        if (value[i] == '%' && i + 2 < value.size() && isxdigit(value[i + 1]) && isxdigit(value[i + 2])) {
+            decoded += (char) strtol(std::string(value.substr(i + 1, 2)).c_str(), NULL, 16);
+            i += 2;
+        }
+        else decoded += value[i] == '+' ? ' ' : value[i];
+    }
+    return decoded;
+}
+
+// function which escapes everything but unreserved characters and slashes, so a topic name can be pasted back into a query
+static std::string url_encode(std::string_view value) {
+    std::string encoded;
+    for (unsigned char c : value) {
+        if (isalnum(c) || strchr("-._~/", c)) encoded += c;
+        else {
+            char escape[4];
+            snprintf(escape, sizeof(escape), "%%%02X", c);
+            encoded += escape;
+        }
+    }
+    return encoded;
+}
+
+// function which returns the decoded value of a parameter in a query string, empty if it is not there
+static std::string query_param(std::string_view query, std::string_view name) {
+    while (query.size() > 0) {
+        size_t amp = query.find('&');
+        std::string_view param = query.substr(0, amp);
+        query = amp == std::string_view::npos ? std::string_view() : query.substr(amp + 1);
+        if (param.size() > name.size() && param.compare(0, name.size(), name) == 0 && param[name.size()] == '=') {
+            return url_decode(param.substr(name.size() + 1));
+        }
+    }
+    return "";
+}
+
+// function which answers a /topics request on the stats endpoint, a page of the topic tree from prefix down, listed after after
+// if the page filled up, the X-Next-After header holds the after that carries on from it
+// returns the HTTP status
+int Metrics::serve_tree(std::string_view query, std::string* headers, std::string* body) {
+    std::string prefix = query_param(query, "prefix");
+    std::string after = query_param(query, "after");
+    long limit = atol(query_param(query, "limit").c_str());
+    if (limit <= 0) limit = TREE_PAGE;
+    if (limit > TREE_PAGE_MAX) limit = TREE_PAGE_MAX;
+    std::string next;
+    if (server->list_tree(prefix, after, limit, body, &next)) {
+        *body = "after is not below prefix\n";
+        return 400;
+    }
+    if (next.size() > 0) *headers += "X-Next-After: " + url_encode(next) + "\r\n";
+    return 200;
+}
+
+// function which answers everyone waiting on the stats endpoint, with a page of the topic tree for GET /topics and with the last
+// sample as plain text for anything else, a browser or curl sees an HTTP response and nc sees it too once the read times out
+// the response is sent as the socket makes room for it, a client that stops reading for STATS_READ_TIMEOUT just gets cut off
+int Metrics::serve_stats() {
+    while (1) {
+        int fd = accept4(stats_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) return 0;                                         // nobody left waiting
+        char request[STATS_REQUEST_SIZE];
+        ssize_t len = 0;
+        struct pollfd pfd = {fd, POLLIN, 0};
+        if (poll(&pfd, 1, STATS_READ_TIMEOUT) == 1) len = read(fd, request, sizeof(request));
+        std::string_view line(request, len > 0 ? len : 0);
+        line = line.substr(0, line.find_first_of("\r\n"));            // only the request line matters
+
+        int status = 200;
+        std::string headers, body;
+        if (line.compare(0, 11, "GET /topics") == 0 && (line.size() == 11 || line[11] == ' ' || line[11] == '?')) {
+            std::string_view target = line.substr(4, line.find(' ', 4) - 4);
+            size_t question = target.find('?');
+            status = serve_tree(question == std::string_view::npos ? std::string_view() : target.substr(question + 1), &headers, &body);
+        }
+        else body = text;
+        std::string response = "HTTP/1.0 " + std::to_string(status) + (status == 200 ? " OK" : " Bad Request") +
+            "\r\nContent-Type: text/plain\r\nContent-Length: " + std::to_string(body.size()) + "\r\n" + headers + "Connection: close\r\n\r\n" + body;
+        for (size_t sent = 0; sent < response.size();) {
+            ssize_t ret = send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (ret > 0) {
+                sent += ret;
+                continue;
+            }
+            if (ret == -1 && errno == EINTR) continue;
+            pfd = {fd, POLLOUT, 0};
+            if (ret == -1 && errno == EAGAIN && poll(&pfd, 1, STATS_READ_TIMEOUT) == 1) continue;
+            break;
+        }
+        close(fd);
+    }
+}
+
+// the body of the metrics thread, which samples every METRICS_INTERVAL and answers the stats endpoint in between
+void Metrics::metrics_loop(Metrics* metrics) {
+    Log::set_thread_name("metrics");
+    uint64_t next = metrics_now();
+    while (!metrics->stop.load()) {
+        uint64_t now = metrics_now();
+        if (now >= next) {
+            std::vector<std::pair<std::string, std::string>> values;
+            metrics->sample(&values);
+            metrics->publish(&values);
+            next = now + (uint64_t) METRICS_INTERVAL * 1000000;
+            continue;
+        }
+
+        int timeout = (next - now + 999999) / 1000000;
+        if (timeout > POLL_TIMEOUT) timeout = POLL_TIMEOUT;             // wake up often enough to notice the server stopping
+        struct pollfd pfd = {metrics->stats_fd, POLLIN, 0};
+        if (poll(&pfd, metrics->stats_fd == -1 ? 0 : 1, timeout) == 1) metrics->serve_stats();
+    }
+}
+
+// function which opens the stats endpoint on the loopback interface, it is only meant for tools running on the same machine
+int Metrics::listen_stats(const char* port) {
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(port));
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    stats_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (stats_fd == -1) return 1;
+    int yes = 1;
+    setsockopt(stats_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+    if (bind(stats_fd, (struct sockaddr*) &addr, sizeof(addr)) || listen(stats_fd, BACKLOG)) {
+        log_error("Failed to open the stats endpoint on port %s: %s", port, strerror(errno));
+        close(stats_fd);
+        stats_fd = -1;
+        return 1;
+    }
+    log_info("Serving stats on 127.0.0.1:%s", port);
+    return 0;
+}
+
+// function which starts the metrics thread, once the shards exist
+int Metrics::start() {
+    thread = new std::thread(metrics_loop, this);
+    return 0;
+}
+
+Metrics::Metrics(Server* server) {
+    this->server = server;
+    this->started = metrics_now();
+    this->stop.store(0);
+}
+
+Metrics::~Metrics() {
+    if (thread) {
+        stop.store(1);
+        thread->join();
+        delete thread;
+    }
+    if (stats_fd != -1) close(stats_fd);
+    delete last_totals;
+    delete[] last_latency;
+    delete published;
+}
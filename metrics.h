@@ -0,0 +1,95 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <atomic>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "histogram.h"
+
+#define METRICS_INTERVAL 1000         // milliseconds between samples, each is published under $SYS and served by the stats endpoint
+#define METRICS_PREFIXES 256          // first levels each shard counts publishes for separately, a power of two
+#define METRICS_PROBES 8              // slots a first level may probe before its publishes are counted with the others that did not fit
+#define STATS_READ_TIMEOUT 100        // milliseconds the stats endpoint waits for a request before answering anyway, or for room to send more of it
+#define STATS_REQUEST_SIZE 8192       // max bytes in a request to the stats endpoint, enough for a long topic name in a query
+#define TREE_PAGE 256                 // topics /topics on the stats endpoint lists when it is not given a limit
+#define TREE_PAGE_MAX 4096            // the most it lists at once, however high the limit, so a big tree never holds up the samples
+#define SYS_PREFIX "$SYS/broker/"     // where the server publishes its metrics, as retained messages
+
+class Server;
+
+// the publishes a shard has seen under one first level
+typedef struct prefix_count {
+    std::atomic<const char*> name{NULL}; // the level, a view into the interned name of the first topic published under it, NULL while the slot is free
+    uint32_t len = 0;
+    uint32_t hash = 0;
+    Counter publishes;
+} prefix_count_t;
+
+// the counters of one shard, only ever written by the shard's own thread
+// the struct has its own cache lines, so publishing on a shard writes to nothing another thread writes, and the metrics thread
+// reads every shard's counters and adds them up when it samples
+typedef struct alignas(64) shard_metrics {
+    Counter publishes_in;             // PUB and PUBRET requests received
+    Counter bytes_in;                 // payload bytes they carried
+    Counter messages_out;             // frames written to clients in full
+    Counter bytes_out;
+    Counter subscribes;
+    Counter unsubscribes;             // including the subscriptions of closed connections
+    Counter dropped_oldest;
+    Counter dropped_newest;
+    Counter disconnected;             // clients disconnected for going over their queue budget
+    Counter queued_bytes;             // what the shard's connections had queued when it last went through them, every reactor iteration
+    Counter queued_messages;
+    Histogram latency;                // nanoseconds from a publish arriving to its last byte being written to a subscriber
+    prefix_count_t prefixes[METRICS_PREFIXES];
+    Counter other_prefixes;           // publishes under a first level that found its slots taken
+} shard_metrics_t;
+
+int count_publish(shard_metrics_t* metrics, const char* topic, size_t len);
+
+// Metrics class, the thread that samples every shard's counters, publishes them under $SYS and serves them on the stats endpoint
+// only this thread touches anything here, the shards just keep their counters up to date
+class Metrics {
+    private:
+        Server* server;
+        std::thread* thread = NULL;
+        std::atomic<int> stop;
+        int stats_fd = -1;                              // the local stats endpoint, -1 if it was not asked for
+        uint64_t started;
+        uint64_t last_sample = 0;
+        std::unordered_map<std::string, uint64_t>* last_totals = new std::unordered_map<std::string, uint64_t>(); // totals at the last sample, for rates
+        uint64_t* last_latency = new uint64_t[HISTOGRAM_BUCKETS]();                    // the merged histogram at the last sample
+        std::unordered_map<std::string, std::string>* published = new std::unordered_map<std::string, std::string>(); // what each $SYS topic was last set to
+        std::string text;                               // the last sample as the stats endpoint serves it
+        static void metrics_loop(Metrics* metrics);
+        int sample(std::vector<std::pair<std::string, std::string>>* values);
+        int add_rate(std::vector<std::pair<std::string, std::string>>* values, const char* name, uint64_t total, uint64_t elapsed);
+        int publish(std::vector<std::pair<std::string, std::string>>* values);
+        int serve_stats();
+        int serve_tree(std::string_view query, std::string* headers, std::string* body);
+
+    public:
+        Metrics(Server* server);
+        ~Metrics();
+        int listen_stats(const char* port);
+        int start();
+};
+
+#endif
@@ -0,0 +1,156 @@
+#include "offline.h"
+
+// function which appends a publish to the spill file, creating the file the first time
+// returns 0 if it was written, 1 if the file could not be created or written
+int OfflineQueue::spill(Message* message, int qos) {
+    if (spill_fd == -1) {
+        std::string path = std::string(dir) + "/offline-XXXXXX";
+        spill_fd = mkostemp(&path[0], O_CLOEXEC);
+        if (spill_fd == -1) {
+            log_error("Could not create spill file in %s: %s", dir, strerror(errno));
+            return 1;
+        }
+        unlink(path.c_str());                                           // the descriptor keeps it alive until the queue is deleted
+    }
+
+    spill_header_t header = {(uint32_t) message->get_topic_len(), (uint32_t) message->get_msg_len(), message->get_op(), (uint8_t) qos, 0};
+    struct iovec iov[3] = {{&header, sizeof(header)}, {(void*) message->get_topic(), message->get_topic_len()},
+        {(void*) message->get_msg(), message->get_msg_len()}};
+    size_t len = sizeof(header) + header.topic_len + header.msg_len;
+    ssize_t nwritten = pwritev(spill_fd, iov, 3, spill_write);
+    if (nwritten != (ssize_t) len) {                                    // a short write leaves a torn record past spill_write, the next one overwrites it
+        log_error("Could not write to spill file: %s", nwritten == -1 ? strerror(errno) : "short write");
+        return 1;
+    }
+    spill_write += len;
+    spilled++;
+    return 0;
+}
+
+// function which reads from the spill file until chunk holds at least needed bytes past chunk_pos
+// returns 0 once it does, 1 if the file ended or could not be read first
+int OfflineQueue::fill(size_t needed) {
+    if (chunk.size() - chunk_pos >= needed) return 0;
+    chunk.erase(0, chunk_pos);                                          // drop what was already popped before growing the chunk
+    chunk_pos = 0;
+    size_t want = needed > SPILL_READ ? needed : SPILL_READ;
+    if (want > spill_write - spill_read + chunk.size()) want = spill_write - spill_read + chunk.size();
+    while (chunk.size() < want) {
+        size_t have = chunk.size();
+        chunk.resize(want);
+        ssize_t nread = pread(spill_fd, &chunk[have], want - have, spill_read);
+        if (nread <= 0) {
+            chunk.resize(have);
+            if (nread == -1 && errno == EINTR) continue;
+            log_error("Could not read from spill file: %s", nread == -1 ? strerror(errno) : "unexpected end of file");
+            return 1;
+        }
+        chunk.resize(have + nread);
+        spill_read += nread;
+    }
+    return chunk.size() < needed;
+}
+
+// function which reads the oldest spilled publish back into a new message
+// once the last one is read, the file is emptied so the next spill starts from its beginning
+// returns 1 if entry was filled in, 0 if the file could not be read, in which case everything left in it is lost
+int OfflineQueue::unspill(offline_entry_t* entry) {
+    spill_header_t header;
+    Message* message = NULL;
+    if (fill(sizeof(header)) == 0) {
+        memcpy(&header, &chunk[chunk_pos], sizeof(header));
+        if (fill(sizeof(header) + header.topic_len + header.msg_len) == 0) {
+            const char* topic = &chunk[chunk_pos + sizeof(header)];
+            message = Message::encode(header.op, topic, header.topic_len, topic + header.topic_len, header.msg_len, PROTOCOL_FRAMED);
+            chunk_pos += sizeof(header) + header.topic_len + header.msg_len;
+        }
+    }
+    if (message) {
+        message->set_qos(header.qos);
+        entry->message = message;
+        entry->qos = header.qos;
+        bytes -= message->get_size();
+        count--;
+        spilled--;
+    }
+    else {
+        log_error("Lost %ld spilled messages", spilled);
+        dropped += spilled;
+        count -= spilled;
+        bytes = memory_bytes;
+        spilled = 0;
+    }
+    if (spilled == 0) {                                                 // caught up with the file, start it over
+        if (ftruncate(spill_fd, 0)) log_warn("Could not truncate spill file: %s", strerror(errno));
+        spill_read = 0;
+        spill_write = 0;
+        chunk.clear();
+        chunk_pos = 0;
+    }
+    return message != NULL;
+}
+
+// function which queues a publish at the back, taking over the caller's reference to message
+// it goes to memory while the memory has room and nothing is spilled ahead of it, otherwise to the spill file
+// returns 0 if it was queued, 1 if the queue is over its budget or the spill file failed, and it was dropped
+int OfflineQueue::push(Message* message, int qos) {
+    size_t size = message->get_size();
+    if (bytes + size > budget) {
+        dropped++;
+        message->unref();
+        return 1;
+    }
+    if (spilled == 0 && (!dir || memory_bytes + size <= OFFLINE_MEMORY)) {
+        memory->push_back({message, qos});
+        memory_bytes += size;
+    }
+    else {
+        int failed = spill(message, qos);
+        message->unref();                                               // the file has a copy, or there is nowhere for it to go
+        if (failed) {
+            dropped++;
+            return 1;
+        }
+    }
+    bytes += size;
+    count++;
+    return 0;
+}
+
+// function which queues a publish at the front, for output that was queued for the client's last connection but never written
+// it is kept in memory whatever the budget, it was already counted against the connection's
+int OfflineQueue::push_front(Message* message, int qos) {
+    memory->push_front({message, qos});
+    memory_bytes += message->get_size();
+    bytes += message->get_size();
+    count++;
+    return 0;
+}
+
+// function which takes the oldest publish off the queue, the caller takes over its reference
+// returns 1 if entry was filled in, 0 if nothing is left
+int OfflineQueue::pop(offline_entry_t* entry) {
+    if (memory->size() > 0) {
+        *entry = memory->front();
+        memory->pop_front();
+        memory_bytes -= entry->message->get_size();
+        bytes -= entry->message->get_size();
+        count--;
+        return 1;
+    }
+    while (spilled > 0) {
+        if (unspill(entry)) return 1;
+    }
+    return 0;
+}
+
+OfflineQueue::OfflineQueue(const char* dir, size_t budget) {
+    this->dir = dir;
+    this->budget = budget;
+}
+
+OfflineQueue::~OfflineQueue() {
+    for (auto it : *memory) it.message->unref();
+    delete memory;
+    if (spill_fd != -1) close(spill_fd);
+}
@@ -0,0 +1,76 @@
+#ifndef OFFLINE_H
+#define OFFLINE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <deque>
+#include <string>
+
+#include "frame.h"
+#include "log.h"
+#include "message.h"
+
+#define SESSION_EXPIRY 300                    // default seconds a session outlives its client's connection, 0 turns sessions off
+#define OFFLINE_BUDGET (64 * 1024 * 1024)     // default max bytes queued for one session while its client is away, memory and disk together
+#define OFFLINE_MEMORY (1024 * 1024)          // bytes of a session's queue kept in memory, the rest spills to disk if the server has somewhere to put it
+#define SPILL_READ (256 * 1024)               // bytes read back from a spill file at a time
+
+// a publish waiting for a session's client to come back, and the QoS it is to be delivered at
+typedef struct offline_entry {
+    Message* message;
+    int qos;
+} offline_entry_t;
+
+// a spilled publish, followed by the topic and then the message
+typedef struct spill_header {
+    uint32_t topic_len;
+    uint32_t msg_len;
+    uint8_t op;
+    uint8_t qos;
+    uint16_t reserved;
+} spill_header_t;
+
+// OfflineQueue class, the publishes for a session whose client is away, oldest first
+// the oldest OFFLINE_MEMORY bytes are kept in memory as shared messages, anything newer is appended to a spill file once the memory
+// is full, and read back in big sequential chunks once the memory has drained, so a client that was away a long time is caught up
+// at disk speed; the file is unlinked as soon as it is created, so nothing is left behind if the server dies
+// a queue is only ever used from its session's shard
+class OfflineQueue {
+    private:
+        std::deque<offline_entry_t>* memory = new std::deque<offline_entry_t>(); // everything in the spill file is newer than all of these
+        size_t memory_bytes = 0;
+        const char* dir;              // where to spill, NULL to keep everything in memory
+        int spill_fd = -1;            // -1 until the memory first fills up
+        uint64_t spill_read = 0;      // offset of the first byte of the file not yet read back into chunk
+        uint64_t spill_write = 0;     // offset the next record is appended at
+        size_t spilled = 0;           // records in the file or chunk not yet popped
+        std::string chunk;            // bytes read back from the file, records are popped from chunk_pos
+        size_t chunk_pos = 0;
+        size_t bytes = 0;             // encoded bytes queued, in memory and on disk
+        size_t count = 0;
+        size_t budget;
+        unsigned long dropped = 0;
+        int spill(Message* message, int qos);
+        int unspill(offline_entry_t* entry);
+        int fill(size_t needed);
+
+    public:
+        OfflineQueue(const char* dir, size_t budget);
+        ~OfflineQueue();
+        int push(Message* message, int qos);
+        int push_front(Message* message, int qos);
+        int pop(offline_entry_t* entry);
+        size_t get_count() { return count; }
+        size_t get_bytes() { return bytes; }
+        size_t get_spilled() { return spilled; }
+        unsigned long get_dropped() { return dropped; }
+};
+
+#endif
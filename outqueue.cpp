@@ -0,0 +1,229 @@
+#include "outqueue.h"
+
+const char* policy_names[POLICY_COUNT] = {"drop-oldest", "drop-newest", "disconnect"};
+
+// function which returns the bytes an entry puts on the wire, its own header takes the place of the message's opcode byte
+size_t OutQueue::entry_size(out_entry_t* entry) {
+    if (entry->header_len) return entry->header_len + entry->message->get_size() - 1;
+    return entry->message->get_size();
+}
+
+// function which drops the oldest droppable entries until needed more bytes fit in the budget
+// the front entry is skipped if part of it is already on the wire, cutting it short would corrupt the stream, and so are the entries
+// an io_uring send in flight covers
+// returns 0 if enough room was made, 1 otherwise
+int OutQueue::drop_oldest(size_t needed) {
+    auto it = entries->begin();
+    if (pinned) it += pinned;                                           // a send in flight still points at these
+    else if (it != entries->end() && offset > 0) it++;
+    while (bytes + needed > budget && it != entries->end()) {
+        if (!it->droppable) {
+            it++;
+            continue;
+        }
+        bytes -= entry_size(&*it);
+        it->message->unref();
+        it = entries->erase(it);
+        dropped_oldest++;
+        metrics->dropped_oldest.add(1);
+    }
+    return bytes + needed > budget;
+}
+
+// function which queues an encoded frame, taking over the caller's reference to message
+// published is when the publish it carries arrived, so the delay until it is written can be recorded, or 0 to leave it out
+// returns 0 if it was queued, 1 if it was dropped, and -1 if the queue is over budget and the policy is to disconnect
+int OutQueue::push(Message* message, int droppable, uint64_t published) {
+    size_t size = message->get_size();
+    if (droppable && bytes + size > budget) {
+        if (policy == POLICY_DISCONNECT) {
+            message->unref();
+            return -1;
+        }
+        if (policy == POLICY_DROP_NEWEST || drop_oldest(size)) {            // if dropping old entries was not enough, the new one cannot fit either
+            message->unref();
+            dropped_newest++;
+            metrics->dropped_newest.add(1);
+            return 1;
+        }
+    }
+
+    out_entry_t entry = {};
+    entry.message = message;
+    entry.droppable = droppable;
+    entry.published = published;
+    entries->push_back(entry);
+    bytes += size;
+    if (entries->size() > max_depth) max_depth = entries->size();
+    return 0;
+}
+
+// function which queues a framed publish as a QoS 1 delivery under packet_id, taking over the caller's reference to message
+// the entry is never dropped, the connection keeps its QoS 1 deliveries within the budget itself and disconnects a client that
+// goes over it, so this always returns 0
+int OutQueue::push_with_id(Message* message, uint16_t packet_id, uint64_t published) {
+    out_entry_t entry = {};
+    entry.message = message;
+    entry.published = published;
+    entry.header[0] = message->get_op() | OP_QOS1;
+    entry.header_len = 1 + encode_varint(packet_id, entry.header + 1);
+    entries->push_back(entry);
+    bytes += entry_size(&entry);
+    if (entries->size() > max_depth) max_depth = entries->size();
+    return 0;
+}
+
+// function which empties the queue, handing the publishes in it that were never written in full to the caller, oldest first
+// control frames are dropped, they were meant for the connection that is going away, and so are QoS 1 deliveries, which the
+// connection's in-flight window still holds
+int OutQueue::clear(std::vector<Message*>* publishes) {
+    for (auto& it : *entries) {
+        if (it.droppable) publishes->push_back(it.message);             // the caller takes over the reference
+        else it.message->unref();
+    }
+    entries->clear();
+    bytes = 0;
+    offset = 0;
+    pinned = 0;                                                         // a send in flight has its own references
+    return 0;
+}
+
+// function which points iov at up to max iovecs' worth of entries from the front of the queue, skipping the part already written
+// an entry with a header of its own takes two, and if copy is not NULL the headers are copied there and the iovecs point at the copies,
+// so they stay put whatever happens to the entries; copy must have room for max / 2 headers
+// returns the number of iovecs filled in, and leaves the number of entries they cover in gathered
+int OutQueue::gather(struct iovec* iov, int max, uint8_t* copy) {
+    int count = 0;
+    size_t skip = offset;                                               // skip the part of the front entry already written
+    gathered = 0;
+    for (auto it = entries->begin(); it != entries->end() && count < max - 1; it++) {
+        const char* data = it->message->get_data();
+        size_t size = it->message->get_size();
+        if (it->header_len) {
+            if (skip < it->header_len) {
+                uint8_t* header = it->header + skip;
+                size_t len = it->header_len - skip;
+                if (copy) {
+                    memcpy(copy, header, len);
+                    header = copy;
+                    copy += len;
+                }
+                iov[count].iov_base = header;
+                iov[count++].iov_len = len;
+                skip = 0;
+            }
+            else skip -= it->header_len;
+            data++;                                                     // the header replaces the message's own opcode
+            size--;
+        }
+        iov[count].iov_base = (void*) (data + skip);
+        iov[count++].iov_len = size - skip;
+        skip = 0;
+        gathered++;
+    }
+    return count;
+}
+
+// function which accounts for nwritten bytes of the queue having gone out, dropping the references to every entry now fully written
+// and recording how long the timed ones waited
+int OutQueue::consume(size_t nwritten) {
+    writes++;
+    metrics->bytes_out.add(nwritten);
+
+    size_t left = nwritten;
+    unsigned long completed = 0;
+    uint64_t now = 0;                                                   // read the clock once per write, and only if a timed entry went out
+    while (left > 0) {
+        Message* message = entries->front().message;
+        uint64_t published = entries->front().published;
+        size_t size = entry_size(&entries->front());
+        size_t rest = size - offset;
+        if (left < rest) {                                              // the write ended partway through this entry
+            offset += left;
+            break;
+        }
+        left -= rest;
+        bytes -= size;
+        if (published) {
+            if (!now) now = metrics_now();
+            metrics->latency.record(now - published);
+        }
+        message->unref();
+        entries->pop_front();
+        offset = 0;
+        completed++;
+    }
+    sent += completed;
+    metrics->messages_out.add(completed);
+    return 0;
+}
+
+// function which writes queued entries to fd until the queue is empty or the socket is full
+// everything queued goes out in one writev() of up to IOV_MAX entries, so a burst of frames costs one syscall rather than one each
+// returns the number of bytes written, which is short of get_bytes() if the socket filled up, or -1 with errno set if the socket failed
+ssize_t OutQueue::write_to_fd(int fd) {
+    struct iovec iov[IOV_MAX];
+    ssize_t total = 0;
+    while (entries->size() > 0) {
+        int count = gather(iov, IOV_MAX, NULL);
+        size_t requested = 0;
+        for (int i = 0; i < count; i++) requested += iov[i].iov_len;
+
+        ssize_t nwritten = writev(fd, iov, count);
+        if (nwritten == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return total;  // the socket is full, the rest stays queued
+            return -1;
+        }
+        total += nwritten;
+        consume(nwritten);
+        if ((size_t) nwritten < requested) return total;                // a short write means the socket is full, wait for EPOLLOUT
+    }
+    return total;
+}
+
+// function which builds a send of up to SEND_IOV iovecs' worth of the front of the queue for an io_uring reactor
+// the send holds its own reference to every message it points into and its own copy of their headers, so the kernel can keep
+// reading it after the connection is gone, and the entries it covers are pinned, nothing is dropped from under it until finish_send
+send_request_t* OutQueue::start_send() {
+    out_batch_t* batch = new out_batch_t();
+    int count = gather(batch->iov, SEND_IOV, batch->headers);
+    pinned = gathered;
+    batch->messages.reserve(pinned);
+    auto it = entries->begin();
+    for (size_t i = 0; i < pinned; i++, it++) {
+        it->message->ref();
+        batch->messages.push_back(it->message);
+    }
+    batch->request.msg.msg_iov = batch->iov;
+    batch->request.msg.msg_iovlen = count;
+    batch->request.release = release_batch;
+    batch->request.ctx = batch;
+    return &batch->request;
+}
+
+// function which accounts for a send from start_send having completed with nwritten bytes sent, 0 if it failed, and unpins its entries
+int OutQueue::finish_send(size_t nwritten) {
+    pinned = 0;
+    if (nwritten > 0) consume(nwritten);
+    return 0;
+}
+
+// function which the reactor calls once the kernel is done with a send, dropping the send's references
+int OutQueue::release_batch(void* ctx) {
+    out_batch_t* batch = (out_batch_t*) ctx;
+    for (auto it : batch->messages) it->unref();
+    delete batch;
+    return 0;
+}
+
+OutQueue::OutQueue(size_t budget, int policy, shard_metrics_t* metrics) {
+    this->budget = budget;
+    this->policy = policy;
+    this->metrics = metrics;
+}
+
+OutQueue::~OutQueue() {
+    for (auto it : *entries) it.message->unref();
+    delete entries;
+}
@@ -0,0 +1,99 @@
+#ifndef OUTQUEUE_H
+#define OUTQUEUE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/types.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "message.h"
+#include "metrics.h"
+#include "reactor.h"
+
+#define QUEUE_BUDGET (16 * 1024 * 1024)   // default max bytes a connection may have queued before the slow consumer policy applies
+
+// what to do with a publish when a connection's queue is over its budget
+enum {
+    POLICY_DROP_OLDEST = 0,           // make room by dropping the oldest queued publishes that have not started sending
+    POLICY_DROP_NEWEST,               // drop the publish that did not fit
+    POLICY_DISCONNECT,                // the client cannot keep up, disconnect it
+    POLICY_COUNT
+};
+
+extern const char* policy_names[POLICY_COUNT];
+
+#define ENTRY_HEADER 4                // bytes of an entry's own opcode and packet id, a 16-bit varint takes at most 3
+#define SEND_IOV 256                  // most iovecs in one io_uring send, the rest of the queue goes in the next one
+
+// a reference to an encoded frame waiting to be written
+// a QoS 1 delivery goes out under a packet id of its own, so it is written as its own opcode and id followed by the shared
+// message's bytes after their opcode, and the message itself is never copied or changed
+typedef struct out_entry {
+    Message* message;
+    int droppable;                    // control frames such as CONN_ACK and DISC are never dropped, nor are QoS 1 deliveries
+    uint8_t header_len;               // 0 unless the entry has a header of its own
+    uint8_t header[ENTRY_HEADER];
+    uint64_t published;               // when the publish it carries arrived, for the shard's latency histogram, 0 if it is not timed
+} out_entry_t;
+
+// a send of the front of a queue handed to an io_uring reactor, it lives until the kernel is done with it, however long the queue does
+typedef struct out_batch {
+    send_request_t request;
+    struct iovec iov[SEND_IOV];
+    uint8_t headers[SEND_IOV / 2 * ENTRY_HEADER];
+    std::vector<Message*> messages;   // a reference to every message the iovecs point into
+} out_batch_t;
+
+// OutQueue class, a connection's bounded queue of encoded frames waiting for the socket
+// publishers only ever append to it, so a subscriber that stops reading costs them nothing but its budget
+// entries are shared messages, a fan-out queues the same bytes on every subscriber and each queue drops its reference once written
+// every queue on a shard keeps the shard's drop, output and latency counters up to date, it is only ever used from that shard's thread
+class OutQueue {
+    private:
+        std::deque<out_entry_t>* entries = new std::deque<out_entry_t>();
+        size_t offset = 0;            // bytes of the front entry already written
+        size_t bytes = 0;             // bytes queued, including the written part of the front entry, a shared message counts against every queue holding it
+        size_t budget;
+        int policy;
+        shard_metrics_t* metrics;
+        unsigned long dropped_oldest = 0;
+        unsigned long dropped_newest = 0;
+        unsigned long max_depth = 0;
+        unsigned long writes = 0;     // writev() calls that wrote something
+        unsigned long sent = 0;       // entries written in full, sent / writes is how well writes are being coalesced
+        size_t gathered = 0;          // entries covered by the last gather
+        size_t pinned = 0;            // entries at the front covered by an io_uring send in flight
+        int drop_oldest(size_t needed);
+        int gather(struct iovec* iov, int max, uint8_t* copy);
+        int consume(size_t nwritten);
+        static size_t entry_size(out_entry_t* entry);
+        static int release_batch(void* ctx);
+
+    public:
+        OutQueue(size_t budget, int policy, shard_metrics_t* metrics);
+        ~OutQueue();
+        int push(Message* message, int droppable, uint64_t published);
+        int push_with_id(Message* message, uint16_t packet_id, uint64_t published);
+        int clear(std::vector<Message*>* publishes);
+        ssize_t write_to_fd(int fd);
+        send_request_t* start_send();
+        int finish_send(size_t nwritten);
+        size_t get_depth() { return entries->size(); }
+        size_t get_bytes() { return bytes; }
+        size_t get_budget() { return budget; }
+        unsigned long get_dropped_oldest() { return dropped_oldest; }
+        unsigned long get_dropped_newest() { return dropped_newest; }
+        unsigned long get_max_depth() { return max_depth; }
+        unsigned long get_writes() { return writes; }
+        unsigned long get_sent() { return sent; }
+        int get_policy() { return policy; }
+};
+
+#endif
@@ -0,0 +1,542 @@
+#include "pubsub.h"
+
+// the body of the loop's own thread, started by PubSubLoop::start
+void PubSubLoop::loop_thread(PubSubLoop* loop) {
+    loop->run();
+}
+
+// function which writes out every client that queued something since the last flush
+int PubSubLoop::flush_dirty() {
+    std::vector<PubSubClient*> clients;
+    clients.swap(*dirty);
+    for (auto it : clients) {
+        it->set_dirty(0);
+        it->flush();
+    }
+    return 0;
+}
+
+// function which runs one pass of the loop: waits up to timeout milliseconds for events, dispatches them and anything posted,
+// then writes out what the clients queued, all of a pass's requests leave in one write per client
+// returns what the reactor returned, -1 if waiting failed
+int PubSubLoop::run_once(int timeout) {
+    flush_dirty();                                                      // requests made outside the loop since its last pass
+    int nevents = reactor->poll_events(timeout);
+    flush_dirty();
+    return nevents;
+}
+
+// function which runs the loop until stop is called
+int PubSubLoop::run() {
+    while (!stopped.load()) {
+        if (run_once(-1) == -1) return 1;
+    }
+    return 0;
+}
+
+// function which runs the loop on a thread of its own, stop or delete the loop to end it
+int PubSubLoop::start() {
+    if (thread) return 1;
+    thread = new std::thread(loop_thread, this);
+    return 0;
+}
+
+// function which makes run return after its current pass, this can be called from any thread
+int PubSubLoop::stop() {
+    stopped.store(1);
+    uint64_t one = 1;
+    write(event_fd, &one, sizeof(one));
+    return 0;
+}
+
+// function which runs fn on the loop's thread during its next pass, this can be called from any thread
+int PubSubLoop::post(std::function<void()> fn) {
+    {
+        std::lock_guard<std::mutex> guard(posted_lock);
+        posted->push_back(fn);
+    }
+    uint64_t one = 1;
+    write(event_fd, &one, sizeof(one));
+    return 0;
+}
+
+// function which puts a client on the list to be written out at the end of the pass
+int PubSubLoop::mark_dirty(PubSubClient* client) {
+    dirty->push_back(client);
+    return 0;
+}
+
+// function which takes a client off the dirty list, called when it is deleted
+int PubSubLoop::forget(PubSubClient* client) {
+    for (size_t i = 0; i < dirty->size(); i++) {
+        if (dirty->at(i) != client) continue;
+        dirty->at(i) = dirty->back();
+        dirty->pop_back();
+        return 0;
+    }
+    return 0;
+}
+
+// called by the reactor when something was posted or stop was called, runs everything posted so far
+int PubSubLoop::handle_readable() {
+    uint64_t count;
+    read(event_fd, &count, sizeof(count));
+    std::vector<std::function<void()>> fns;
+    {
+        std::lock_guard<std::mutex> guard(posted_lock);
+        fns.swap(*posted);
+    }
+    for (auto& it : fns) it();
+    return 0;
+}
+
+// the eventfd is never watched for writing
+int PubSubLoop::handle_writable() {
+    return 0;
+}
+
+// the eventfd never hangs up
+int PubSubLoop::handle_hangup() {
+    return 0;
+}
+
+PubSubLoop::PubSubLoop() {
+    this->stopped.store(0);
+    this->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    reactor->add_fd(event_fd, EPOLLIN, this);
+}
+
+PubSubLoop::~PubSubLoop() {
+    if (thread) {
+        stop();
+        thread->join();
+        delete thread;
+    }
+    reactor->remove_fd(event_fd);
+    close(event_fd);
+    delete reactor;
+    delete posted;
+    delete dirty;
+}
+
+// function which appends a frame to the client's output, the same encoding as encode_frame without copying into a frame_t first
+// the client is written out at the end of the loop's pass, with whatever else was queued by then
+int PubSubClient::queue(uint8_t op, std::string_view topic, std::string_view msg, int qos, uint16_t id) {
+    if (state == PUBSUB_CLOSED || state == PUBSUB_DISCONNECTING) return 1;
+    uint8_t header[1 + 2 * MAX_VARINT];
+    size_t len = 0;
+    header[len++] = qos ? op | OP_QOS1 : op;
+    if (qos) len += encode_varint(id, header + len);
+    len += encode_varint(topic.size(), header + len);
+    if (out->write(header, len) || out->write(topic.data(), topic.size())) return 1;
+    len = encode_varint(msg.size(), header);
+    if (out->write(header, len) || out->write(msg.data(), msg.size())) return 1;
+    if (!dirty) {
+        dirty = 1;
+        loop->mark_dirty(this);
+    }
+    return 0;
+}
+
+// function which queues as many of the QoS 1 publishes waiting for the window as it has room for
+int PubSubClient::send_inflight() {
+    if (!inflight || state == PUBSUB_CLOSED || state == PUBSUB_DISCONNECTING) return 0;
+    inflight_t entry;
+    while (inflight->next_ready(&entry)) {
+        Message* message = entry.message;
+        queue(message->get_op(), std::string_view(message->get_topic(), message->get_topic_len()),
+            std::string_view(message->get_msg(), message->get_msg_len()), 1, entry.id);
+    }
+    return 0;
+}
+
+// function which starts connecting to the server, done is called once the server has acked the CONN or the connection failed
+// resolving the hostname is the one step that blocks, a numeric address skips it
+// requests made before done is called are queued behind the CONN and sent as soon as the socket is up
+int PubSubClient::connect(const char* hostname, const char* port, pubsub_done_t done) {
+    if (state != PUBSUB_CLOSED) return 1;
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* addr;
+    if (getaddrinfo(hostname, port, &hints, &addr)) return 1;
+    fd = socket(addr->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        freeaddrinfo(addr);
+        return 1;
+    }
+    int ret = ::connect(fd, addr->ai_addr, addr->ai_addrlen);
+    freeaddrinfo(addr);
+    if (ret == -1 && errno != EINPROGRESS) {
+        close(fd);
+        fd = -1;
+        return 1;
+    }
+    int yes = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(int));       // pipelining already batches writes, Nagle would only delay the last of them
+
+    delete decoder;
+    delete out;
+    decoder = new FrameDecoder(PROTOCOL_FRAMED, MAX_PAYLOAD);
+    out = new RingBuffer(RING_SIZE);
+    on_connect = done;
+    state = PUBSUB_CONNECTING;
+    acked = 0;
+    events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;                           // writable once the connection is up
+    if (loop->get_reactor()->add_fd(fd, events, this)) {
+        close(fd);
+        fd = -1;
+        state = PUBSUB_CLOSED;
+        return 1;
+    }
+    loop->get_reactor()->get_timers()->arm(&timer, PUBSUB_CONNECT_TIMEOUT);
+    char conn[2] = {PROTOCOL_FRAMED, (char) (clean ? CONN_CLEAN : 0)};
+    session_present = 0;
+    if (queue(OP_CONN, client_id, std::string_view(conn, client_id.empty() ? 1 : 2))) return 1;
+    clean = 0;                                                          // later connects resume what this one starts
+    if (inflight) {                                                     // publishes the last connection lost before they were acked go first, under the same ids
+        inflight->for_each_unacked([](inflight_t* entry, void* ctx) {
+            Message* message = entry->message;
+            return ((PubSubClient*) ctx)->queue(message->get_op(), std::string_view(message->get_topic(), message->get_topic_len()),
+                std::string_view(message->get_msg(), message->get_msg_len()), 1, entry->id);
+        }, this);
+        send_inflight();
+    }
+    return 0;
+}
+
+// function which queues a publish, retained if retain is set
+// a QoS 1 publish is copied and kept until the server acks it, and waits its turn if the in-flight window is full; one made while
+// the client is closed is held for the next connection
+int PubSubClient::publish(std::string_view topic, std::string_view msg, int retain, int qos) {
+    if (!qos) return queue(retain ? OP_PUBRET : OP_PUB, topic, msg);
+    if (state == PUBSUB_DISCONNECTING) return 1;
+    Message* message = Message::encode(retain ? OP_PUBRET : OP_PUB, topic.data(), topic.size(), msg.data(), msg.size(), PROTOCOL_FRAMED);
+    if (!message) return 1;
+    if (!inflight) inflight = new InflightWindow(inflight_window);
+    inflight->push(message, 0);
+    return send_inflight();
+}
+
+// function which queues a batch of publishes, each to prefix followed by its entry's topic, entries are built with encode_entry
+// a QoS 1 batch is kept and sent again as a whole until the server acks it, which it does once it has published every entry
+int PubSubClient::publish_batch(std::string_view prefix, std::string_view entries, int retain, int qos) {
+    uint8_t op = (retain ? OP_PUBRET : OP_PUB) | OP_BATCH;
+    if (!qos) return queue(op, prefix, entries);
+    if (state == PUBSUB_DISCONNECTING) return 1;
+    Message* message = Message::encode(op, prefix.data(), prefix.size(), entries.data(), entries.size(), PROTOCOL_FRAMED);
+    if (!message) return 1;
+    if (!inflight) inflight = new InflightWindow(inflight_window);
+    inflight->push(message, 0);
+    return send_inflight();
+}
+
+// function which queues a subscribe, at QoS 1 if qos is set, use sync to know when it has taken effect
+int PubSubClient::subscribe(std::string_view filter, int qos) {
+    return queue(OP_SUB, filter, "", qos, 0);
+}
+
+// function which queues a subscribe to prefix followed by each of a list of filters, built with encode_entry, in one request
+int PubSubClient::subscribe_batch(std::string_view prefix, std::string_view filters, int qos) {
+    return queue(OP_SUB | OP_BATCH, prefix, filters, qos, 0);
+}
+
+// function which queues an unsubscribe, use sync to know when it has taken effect
+int PubSubClient::unsubscribe(std::string_view filter) {
+    return queue(OP_UNSUB, filter, "");
+}
+
+// function which queues an unsubscribe from prefix followed by each of a list of filters, built with encode_entry, in one request
+int PubSubClient::unsubscribe_batch(std::string_view prefix, std::string_view filters) {
+    return queue(OP_UNSUB | OP_BATCH, prefix, filters);
+}
+
+// function which asks for the client's subscriptions, done gets them as the server lists them, once every page has arrived
+// the server answers each LIST with one page, the rest are asked for as each one arrives
+int PubSubClient::list(pubsub_reply_t done) {
+    if (queue(OP_LIST, "", "")) return 1;
+    list_waiters->push_back(done);
+    list_pages->emplace_back();
+    return 0;
+}
+
+// function which asks for the client's outbound queue stats, done gets them as the server formats them
+int PubSubClient::stats(pubsub_reply_t done) {
+    if (queue(OP_STATS, "", "")) return 1;
+    stats_waiters->push_back(done);
+    return 0;
+}
+
+// function which calls done once the server has handled every request queued before it
+// the server handles a connection's requests in order and has no acks of its own, so this is a LIST whose reply is ignored
+int PubSubClient::sync(pubsub_done_t done) {
+    return list([done](int status, const std::string& reply) { done(status); });
+}
+
+// function which calls done once the server has acked every QoS 1 publish, straight away if none are unacked
+// done is called with 1 if the connection closes first, the publishes are still kept for the next one
+int PubSubClient::drain(pubsub_done_t done) {
+    if (get_unacked() == 0) {
+        done(0);
+        return 0;
+    }
+    if (state == PUBSUB_CLOSED || state == PUBSUB_DISCONNECTING) return 1;
+    drain_waiters->push_back(done);
+    return 0;
+}
+
+// function which names the session the client resumes on every connect from now on, an empty client_id for none
+// clean asks the server to drop whatever the session held on the next connect, it can only be changed while the client is closed
+int PubSubClient::set_session(std::string_view client_id, int clean) {
+    if (state != PUBSUB_CLOSED) return 1;
+    this->client_id = client_id;
+    this->clean = clean;
+    return 0;
+}
+
+// function which sets how long the server may be silent before the client pings it, and then before it closes, 0 to never ping
+// the server pings the client in the same way, this is for noticing a server that went away without the connection breaking
+// it takes effect from the next connect
+int PubSubClient::set_keepalive(int seconds) {
+    if (seconds < 0) return 1;
+    keepalive = seconds;
+    return 0;
+}
+
+// function called by the loop's timer wheel when the client's timer expires, ctx is the client
+int PubSubClient::timer_expired(void* ctx) {
+    PubSubClient* client = (PubSubClient*) ctx;
+    if (client->state == PUBSUB_CONNECTED) return client->check_keepalive();
+    return client->close_conn(1);                                       // the connect or the disconnect took too long
+}
+
+// function called once every keepalive interval, which pings a server that was silent for the whole interval and closes the
+// connection if it is still silent an interval later, reads only set a flag
+int PubSubClient::check_keepalive() {
+    TimerWheel* timers = loop->get_reactor()->get_timers();
+    uint64_t interval = (uint64_t) keepalive * 1000;
+    if (heard) {
+        heard = 0;
+        ping_sent = 0;
+        return timers->arm(&timer, interval);
+    }
+    if (!ping_sent) {
+        queue(OP_PING, "", "");
+        ping_sent = 1;
+        return timers->arm(&timer, interval);
+    }
+    return close_conn(1);
+}
+
+// function which sets how many QoS 1 publishes may be unacked at once, a power of two no more than MAX_INFLIGHT
+// it can only be changed before the first QoS 1 publish
+int PubSubClient::set_inflight_window(uint32_t size) {
+    if (inflight || size == 0 || size > MAX_INFLIGHT || (size & (size - 1))) return 1;
+    inflight_window = size;
+    return 0;
+}
+
+// function which asks the server to disconnect us, done is called once it acks and the connection is closed
+// anything queued before the DISC is still sent, nothing can be queued after it
+int PubSubClient::disconnect(pubsub_done_t done) {
+    if (queue(OP_DISC, "", "")) return 1;
+    on_disconnect = done;
+    state = PUBSUB_DISCONNECTING;
+    loop->get_reactor()->get_timers()->arm(&timer, PUBSUB_DISCONNECT_TIMEOUT);
+    return 0;
+}
+
+// function which writes as much of the client's output as the socket takes, the rest waits for the socket to be writable
+int PubSubClient::flush() {
+    if (fd == -1 || state == PUBSUB_CONNECTING) return 0;               // handle_writable flushes once the connection is up
+    while (out->size() > 0) {
+        ssize_t nwritten = out->write_to_fd(fd);
+        if (nwritten == -1 && errno == EINTR) continue;
+        if (nwritten == -1 && errno == EAGAIN) break;
+        if (nwritten == -1) return close_conn(1);
+    }
+    return update_events();
+}
+
+// function which only watches the socket for writing while there is output the socket would not take
+int PubSubClient::update_events() {
+    if (fd == -1) return 0;
+    uint32_t wanted = EPOLLIN | EPOLLRDHUP | (out->size() > 0 || state == PUBSUB_CONNECTING ? EPOLLOUT : 0);
+    if (wanted == events) return 0;
+    events = wanted;
+    return loop->get_reactor()->modify_fd(fd, events, this);
+}
+
+// function which closes the connection and tells everyone waiting on it, status is 0 if it closed the way it was meant to
+// callbacks are taken off the client before any is called, so a callback may reconnect the client
+int PubSubClient::close_conn(int status) {
+    if (fd == -1) return 0;
+    loop->get_reactor()->remove_fd(fd);
+    loop->get_reactor()->get_timers()->cancel(&timer);
+    close(fd);
+    fd = -1;
+    int was = state;
+    state = PUBSUB_CLOSED;
+    events = 0;
+
+    pubsub_done_t connect_done, disconnect_done;
+    connect_done.swap(on_connect);
+    disconnect_done.swap(on_disconnect);
+    std::deque<pubsub_reply_t> lists, stats;
+    lists.swap(*list_waiters);
+    stats.swap(*stats_waiters);
+    list_pages->clear();
+    std::deque<pubsub_done_t> drains;
+    drains.swap(*drain_waiters);
+
+    if (connect_done && (was == PUBSUB_CONNECTING || was == PUBSUB_HANDSHAKE)) connect_done(1);
+    for (auto& it : lists) it(1, "");
+    for (auto& it : stats) it(1, "");
+    for (auto& it : drains) it(1);
+    if (disconnect_done) disconnect_done(status);
+    if (on_close) on_close(status);
+    return 0;
+}
+
+// function which handles a frame from the server
+int PubSubClient::handle_frame(frame_t* frame) {
+    switch (frame->op) {
+        case OP_CONN_ACK: {                                             // the server says which version it accepted
+            int version = frame->msg.size() > 0 ? (uint8_t) frame->msg[0] : PROTOCOL_LEGACY;
+            if (version != PROTOCOL_FRAMED) return close_conn(1);
+            session_present = frame->msg.size() > 1 && frame->msg[1];       // a server without sessions only sends the version
+            if (state == PUBSUB_HANDSHAKE) {
+                state = PUBSUB_CONNECTED;
+                TimerWheel* timers = loop->get_reactor()->get_timers();
+                heard = 0;
+                ping_sent = 0;
+                if (keepalive > 0) timers->arm(&timer, (uint64_t) keepalive * 1000);
+                else timers->cancel(&timer);
+            }
+            acked = 1;
+            pubsub_done_t done;
+            done.swap(on_connect);
+            if (done) done(0);
+            return 0;
+        }
+        case OP_PUB:
+        case OP_PUBRET:
+            message_qos = frame->qos;
+            message_snapshot = frame->snapshot;
+            if (on_message) on_message(frame->topic, frame->msg, frame->op == OP_PUBRET);
+            if (frame->qos) queue(OP_PUBACK, "", "", 1, frame->id);   // acked once handled, the ack goes out with the rest of the pass's output
+            return 0;
+        case OP_PUBACK: {                                               // the server has a QoS 1 publish, which makes room for the next
+            Message* message = inflight ? inflight->ack(frame->id) : NULL;
+            if (!message) return 0;
+            message->unref();
+            send_inflight();
+            if (inflight->get_unacked() > 0) return 0;
+            std::deque<pubsub_done_t> drains;
+            drains.swap(*drain_waiters);
+            for (auto& it : drains) it(0);
+            return 0;
+        }
+        case OP_LIST: {                                                 // every page but the last names where it stopped, they are put back together
+            if (list_waiters->size() == 0) return 0;
+            std::string& pages = list_pages->front();
+            if (pages.size() > 0 && frame->msg.size() > 0) pages.append(", ");
+            pages.append(frame->msg);
+            if (frame->topic.size() > 0) {                              // ask for the next page, answered after any request already queued
+                if (queue(OP_LIST, frame->topic, "")) return 0;         // closing, the waiter is failed with the rest
+                pubsub_reply_t done = list_waiters->front();
+                std::string sofar = std::move(pages);
+                list_waiters->pop_front();
+                list_pages->pop_front();
+                list_waiters->push_back(done);
+                list_pages->push_back(std::move(sofar));
+                return 0;
+            }
+            frame->msg.swap(pages);
+            list_pages->pop_front();
+            [[fallthrough]];
+        }
+        case OP_STATS: {
+            std::deque<pubsub_reply_t>* waiters = frame->op == OP_LIST ? list_waiters : stats_waiters;
+            if (waiters->size() == 0) return 0;
+            pubsub_reply_t done = waiters->front();
+            waiters->pop_front();
+            done(0, frame->msg);
+            return 0;
+        }
+        case OP_DISC: {                                                 // the server is shutting down, ack it and close
+            frame_t ack = {OP_DISC_ACK, "", ""};
+            encode_frame(&ack, out);                                    // straight into the output, even if we were disconnecting ourselves
+            while (out->size() > 0 && out->write_to_fd(fd) > 0);       // best effort, the server closes us either way
+            return close_conn(0);
+        }
+        case OP_DISC_ACK:
+            return close_conn(0);
+        case OP_PING:                                                   // the server is checking we are still here
+            return queue(OP_PONG, "", "");
+        default:
+            return 0;
+    }
+}
+
+// called by the reactor when the server sent something, reads until the socket is empty and handles every whole frame
+// reading it all now means a hangup right behind the data does not cut any of it off
+int PubSubClient::handle_readable() {
+    frame_t frame;
+    while (fd != -1) {
+        ssize_t nread = decoder->get_buffer()->read_from_fd(fd, PUBSUB_READ_SIZE);
+        if (nread == 0) return close_conn(state == PUBSUB_DISCONNECTING ? 0 : 1); // the server hung up
+        if (nread > 0) heard = 1;
+        if (nread == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) return 0;
+            return close_conn(1);
+        }
+        int ret;
+        while (fd != -1 && (ret = decoder->next(&frame)) == 1) handle_frame(&frame);
+        if (fd != -1 && ret == -1) return close_conn(1);                // the server sent something we cannot decode
+    }
+    return 0;
+}
+
+// called by the reactor once the connection is up, and whenever the socket drains while output is waiting
+int PubSubClient::handle_writable() {
+    if (fd == -1) return 0;
+    if (state == PUBSUB_CONNECTING) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len);
+        if (error) return close_conn(1);
+        state = PUBSUB_HANDSHAKE;
+    }
+    return flush();
+}
+
+// called by the reactor when the connection errors or the server hangs up, anything left to read was handled first
+int PubSubClient::handle_hangup() {
+    if (fd == -1) return 0;
+    return close_conn(state == PUBSUB_DISCONNECTING ? 0 : 1);
+}
+
+PubSubClient::PubSubClient(PubSubLoop* loop) {
+    this->loop = loop;
+    this->timer.fn = timer_expired;
+    this->timer.ctx = this;
+}
+
+// deleting a client closes it without calling any of its callbacks
+PubSubClient::~PubSubClient() {
+    if (dirty) loop->forget(this);
+    if (fd != -1) {
+        loop->get_reactor()->remove_fd(fd);
+        loop->get_reactor()->get_timers()->cancel(&timer);
+        close(fd);
+    }
+    delete decoder;
+    delete out;
+    delete list_waiters;
+    delete stats_waiters;
+    delete list_pages;
+    delete drain_waiters;
+    delete inflight;
+}
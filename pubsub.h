@@ -0,0 +1,167 @@
+#ifndef PUBSUB_H
+#define PUBSUB_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "buffer.h"
+#include "frame.h"
+#include "inflight.h"
+#include "message.h"
+#include "reactor.h"
+
+// libpubsub, an asynchronous client for the server
+// a PubSubLoop runs any number of PubSubClients on one thread, every request is queued and returns straight away, and whatever
+// the clients queued during one pass of the loop goes out in one write per client, so publishes are pipelined rather than each
+// waiting on the last
+// a client is only ever touched from its loop's thread, in its callbacks or in functions handed to PubSubLoop::post
+// QoS 1 publishes are kept until the server acks them and sent again if the connection is lost first, and QoS 1 deliveries are
+// acked once the message callback returns, so a message may arrive twice but is not lost between the client and the server
+// a client that names a session with set_session keeps its subscriptions across connections, and what was published to them
+// while it was away, or its QoS 1 deliveries that were never acked, are sent to it when it connects again
+
+#define PUBSUB_READ_SIZE 65536        // bytes of room a client makes in its input buffer before each read
+#define PUBSUB_CONNECT_TIMEOUT 5000   // milliseconds a connect may take, up to the CONN_ACK, before it fails
+#define PUBSUB_DISCONNECT_TIMEOUT 1000 // milliseconds to wait for DISC_ACK before closing anyway
+#define PUBSUB_KEEPALIVE 30           // default seconds the server may be silent before it is pinged, and then before the client gives up on it
+
+// the states of a client's connection
+enum {
+    PUBSUB_CLOSED = 0,
+    PUBSUB_CONNECTING,                // waiting for the TCP connection, requests are queued behind the CONN
+    PUBSUB_HANDSHAKE,                 // CONN sent, waiting for CONN_ACK, requests are pipelined behind it
+    PUBSUB_CONNECTED,
+    PUBSUB_DISCONNECTING              // DISC sent, waiting for DISC_ACK, nothing more can be queued
+};
+
+typedef std::function<void(int status)> pubsub_done_t;                             // status is 0 on success, 1 if the connection failed first
+typedef std::function<void(int status, const std::string& reply)> pubsub_reply_t;  // the text of a LIST or STATS reply
+typedef std::function<void(const std::string& topic, const std::string& msg, int retained)> pubsub_message_t;
+
+class PubSubClient;
+
+// PubSubLoop class, the event loop clients share
+// run it on a thread of your own with run_once or run, or on a thread of its own with start; other threads hand it work with post
+class PubSubLoop : public EventHandler {
+    private:
+        Reactor* reactor = new Reactor();
+        int event_fd;
+        std::thread* thread = NULL;
+        std::atomic<int> stopped;
+        std::mutex posted_lock;
+        std::vector<std::function<void()>>* posted = new std::vector<std::function<void()>>(); // functions waiting to run on the loop
+        std::vector<PubSubClient*>* dirty = new std::vector<PubSubClient*>(); // clients that queued output since the last flush
+        static void loop_thread(PubSubLoop* loop);
+        int flush_dirty();
+
+    public:
+        PubSubLoop();
+        ~PubSubLoop();
+        int run_once(int timeout);
+        int run();
+        int start();
+        int stop();
+        int post(std::function<void()> fn);
+        int mark_dirty(PubSubClient* client);
+        int forget(PubSubClient* client);
+        Reactor* get_reactor() { return reactor; }
+        int handle_readable();
+        int handle_writable();
+        int handle_hangup();
+};
+
+// PubSubClient class, one connection to the server
+// every request is queued and sent at the end of the loop's pass, replies arrive through callbacks in the order their requests
+// were made, and published messages arrive through the message callback
+// a client must not be deleted from inside one of its own callbacks, post the delete to the loop instead
+class PubSubClient : public EventHandler {
+    private:
+        PubSubLoop* loop;
+        int fd = -1;
+        int state = PUBSUB_CLOSED;
+        int acked = 0;                // the server acked our CONN on this connection
+        int dirty = 0;                // on the loop's dirty list
+        uint32_t events = 0;          // what the reactor is watching the socket for
+        FrameDecoder* decoder = NULL;
+        RingBuffer* out = NULL;
+        pubsub_done_t on_connect;
+        pubsub_done_t on_disconnect;  // for a disconnect we asked for
+        pubsub_done_t on_close;       // for every close, whoever caused it
+        pubsub_message_t on_message;
+        std::deque<pubsub_reply_t>* list_waiters = new std::deque<pubsub_reply_t>();
+        std::deque<pubsub_reply_t>* stats_waiters = new std::deque<pubsub_reply_t>();
+        std::deque<std::string>* list_pages = new std::deque<std::string>(); // the pages each LIST waiter has been sent so far, in step with list_waiters
+        std::deque<pubsub_done_t>* drain_waiters = new std::deque<pubsub_done_t>();
+        InflightWindow* inflight = NULL; // QoS 1 publishes the server has not acked, kept across connections, NULL until the first one
+        uint32_t inflight_window = INFLIGHT_WINDOW;
+        std::string client_id;        // the session named in every CONN, empty for none
+        int clean = 0;                // ask the server to start the session over on the next connect
+        int session_present = 0;      // the server resumed the session on this connection
+        int message_qos = 0;          // the QoS of the delivery the message callback was last called for
+        int message_snapshot = 0;     // set if that delivery was a retained message sent because of a SUB, only cluster links get those
+        wheel_timer_t timer;          // on the loop's wheel, times the connect, the keepalive or the disconnect, whichever is under way
+        int heard = 0;                // the server sent something since the keepalive timer last fired
+        int ping_sent = 0;
+        int keepalive = PUBSUB_KEEPALIVE;
+        static int timer_expired(void* ctx);
+        int check_keepalive();
+        int queue(uint8_t op, std::string_view topic, std::string_view msg, int qos = 0, uint16_t id = 0);
+        int send_inflight();
+        int handle_frame(frame_t* frame);
+        int update_events();
+        int close_conn(int status);
+
+    public:
+        PubSubClient(PubSubLoop* loop);
+        ~PubSubClient();
+        int connect(const char* hostname, const char* port, pubsub_done_t done);
+        int publish(std::string_view topic, std::string_view msg, int retain = 0, int qos = 0);
+        int publish_batch(std::string_view prefix, std::string_view entries, int retain = 0, int qos = 0);
+        int subscribe(std::string_view filter, int qos = 0);
+        int subscribe_batch(std::string_view prefix, std::string_view filters, int qos = 0);
+        int unsubscribe(std::string_view filter);
+        int unsubscribe_batch(std::string_view prefix, std::string_view filters);
+        int list(pubsub_reply_t done);
+        int stats(pubsub_reply_t done);
+        int sync(pubsub_done_t done);
+        int drain(pubsub_done_t done);
+        int set_inflight_window(uint32_t size);
+        int set_session(std::string_view client_id, int clean);
+        int set_keepalive(int seconds);
+        int disconnect(pubsub_done_t done);
+        int flush();
+        void set_on_message(pubsub_message_t fn) { on_message = fn; }
+        void set_on_close(pubsub_done_t fn) { on_close = fn; }
+        void set_dirty(int dirty) { this->dirty = dirty; }
+        int get_state() { return state; }
+        int get_acked() { return acked; }
+        int get_session_present() { return session_present; }
+        int get_message_qos() { return message_qos; }
+        int get_message_snapshot() { return message_snapshot; }
+        size_t get_pending() { return out ? out->size() : 0; }
+        size_t get_unacked() { return inflight ? inflight->get_unacked() : 0; }
+        int handle_readable();
+        int handle_writable();
+        int handle_hangup();
+};
+
+#endif
@@ -0,0 +1,346 @@
+#include "reactor.h"
+
+const char* backend_names[BACKEND_COUNT] = {"epoll", "io_uring"};
+
+// function which starts watching an fd on the io_uring, kind says what is armed on it
+int Reactor::watch_fd(int fd, int kind, uint32_t events, int multishot, EventHandler* handler) {
+    if (watches->count(fd)) {
+        log_error("Failed to add fd %d to reactor: %s", fd, strerror(EEXIST));
+        return 1;
+    }
+    uring_watch_t* watch = new uring_watch_t();
+    watch->fd = fd;
+    watch->kind = kind;
+    watch->events = events;
+    watch->multishot = multishot;
+    watch->handler = handler;
+    if (arm(watch)) {
+        delete watch;
+        return 1;
+    }
+    watches->insert(std::pair<int, uring_watch_t*>(fd, watch));
+    return 0;
+}
+
+// function which queues the poll, accept or recv a watch waits on, it goes to the kernel with the next wait
+// polls and accepts are always multishot, a recv is multishot if the watch asks for it, and picks a provided buffer either way
+int Reactor::arm(uring_watch_t* watch) {
+    struct io_uring_sqe* sqe = ring->get_sqe();
+    if (!sqe) {
+        log_error("Failed to arm fd %d, the io_uring submission queue is full", watch->fd);
+        return 1;
+    }
+    sqe->fd = watch->fd;
+    sqe->user_data = (uint64_t) watch | watch->kind;
+    switch (watch->kind) {
+        case URING_POLL:
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->poll32_events = watch->events;                             // epoll events have the same values as poll ones
+            sqe->len = IORING_POLL_ADD_MULTI;
+            break;
+        case URING_ACCEPT:
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->accept_flags = SOCK_NONBLOCK;                              // the same sockets accept4 gives the epoll backend
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            break;
+        case URING_RECV:
+            sqe->opcode = IORING_OP_RECV;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = URING_BUFFER_GROUP;
+            sqe->ioprio = watch->multishot ? IORING_RECV_MULTISHOT : 0;
+            break;
+    }
+    watch->armed = 1;
+    watch->pending++;
+    in_flight++;
+    return 0;
+}
+
+// function which queues a cancel of what is armed on a watch, or with everything of every operation on its fd, sends included
+int Reactor::cancel(uring_watch_t* watch, int everything) {
+    if (!everything && !watch->armed) return 0;
+    struct io_uring_sqe* sqe = ring->get_sqe();
+    if (!sqe) return 1;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->user_data = URING_CANCEL;
+    if (everything) {
+        sqe->fd = watch->fd;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    }
+    else {
+        sqe->fd = -1;
+        sqe->addr = (uint64_t) watch | watch->kind;
+    }
+    in_flight++;
+    return 0;
+}
+
+// function which frees a watch whose fd was removed, once the last operation pointing at it has completed
+int Reactor::release(uring_watch_t* watch) {
+    if (!watch->handler && watch->pending == 0) delete watch;
+    return 0;
+}
+
+// function to register a file descriptor with the reactor
+// events is a mask of EPOLLIN, EPOLLOUT, etc. and handler is the object which gets called back when one of them fires
+int Reactor::add_fd(int fd, uint32_t events, EventHandler* handler) {
+    if (ring) return watch_fd(fd, URING_POLL, events, 0, handler);
+    struct epoll_event event = {};
+    event.events = events;
+    event.data.ptr = handler;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        log_error("Failed to add fd %d to reactor: %s", fd, strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+// function to change the events a registered file descriptor is waiting on
+// with io_uring the poll is cancelled and a new one armed under a new watch, so late completions of the old one are dropped
+int Reactor::modify_fd(int fd, uint32_t events, EventHandler* handler) {
+    if (ring) {
+        auto it = watches->find(fd);
+        if (it == watches->end() || it->second->kind != URING_POLL) {
+            log_error("Failed to modify fd %d in reactor: %s", fd, strerror(ENOENT));
+            return 1;
+        }
+        uring_watch_t* watch = it->second;
+        if (watch->events == events) {
+            watch->handler = handler;
+            return 0;
+        }
+        watches->erase(it);
+        cancel(watch, 0);
+        watch->handler = NULL;
+        release(watch);
+        return watch_fd(fd, URING_POLL, events, 0, handler);
+    }
+    struct epoll_event event = {};
+    event.events = events;
+    event.data.ptr = handler;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event) == -1) {
+        log_error("Failed to modify fd %d in reactor: %s", fd, strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+// function to stop watching a file descriptor, must be called before the handler is deleted and before the fd is closed
+// with io_uring every operation on the fd is cancelled, and submitted straight away along with anything queued before it, so a
+// final send still gets its one try, as a write would with epoll, and nothing in the ring outlives the fd number
+int Reactor::remove_fd(int fd) {
+    if (ring) {
+        auto it = watches->find(fd);
+        if (it == watches->end()) return 1;
+        uring_watch_t* watch = it->second;
+        watches->erase(it);
+        watch->handler = NULL;
+        cancel(watch, 1);
+        ring->submit();
+        return release(watch);
+    }
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL) == -1) return 1;
+    return 0;
+}
+
+// function to watch a listening socket for clients
+// with epoll the handler is told the socket is readable and accepts them itself, with io_uring a multishot accept hands it each one
+int Reactor::accept_on(int fd, EventHandler* handler) {
+    if (ring) return watch_fd(fd, URING_ACCEPT, 0, 1, handler);
+    return add_fd(fd, EPOLLIN, handler);
+}
+
+// function to watch a socket for input
+// with epoll the handler is told the socket is readable and reads it itself, with io_uring recvs put the data in provided buffers and
+// the handler gets it from there; with multishot one recv stays armed, without it the next recv is only armed once the handler
+// has seen the last one, so a handler that gives the socket away never has data read for it that it cannot handle
+// calling this again for an fd already receiving on io_uring only changes multishot, which takes effect with the next recv armed
+int Reactor::receive_on(int fd, EventHandler* handler, int multishot) {
+    if (!ring) return add_fd(fd, EPOLLIN | EPOLLRDHUP, handler);
+    auto it = watches->find(fd);
+    if (it == watches->end()) return watch_fd(fd, URING_RECV, 0, multishot, handler);
+    uring_watch_t* watch = it->second;
+    watch->multishot = multishot;
+    if (!watch->armed) return arm(watch);
+    return 0;
+}
+
+// function which queues a sendmsg on an fd watched by an io_uring reactor, it goes to the kernel with the next wait,
+// along with every other send queued in the meantime, and handle_sent is called once it completes
+// returns 1 if it could not be queued, in which case the request has already been released
+int Reactor::send(int fd, send_request_t* request) {
+    auto it = watches->find(fd);
+    struct io_uring_sqe* sqe = it == watches->end() ? NULL : ring->get_sqe();
+    if (!sqe) {
+        request->release(request->ctx);
+        return 1;
+    }
+    request->watch = it->second;
+    request->watch->pending++;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) &request->msg;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uint64_t) request | URING_SEND;
+    in_flight++;
+    return 0;
+}
+
+// function which hands a completion to the handler it is for and re-arms whatever it ended, returns 0
+// completions for a watch whose fd was removed are dropped, handing back any buffer or socket they carry
+int Reactor::dispatch(struct io_uring_cqe* cqe) {
+    int kind = cqe->user_data & URING_KIND_MASK;
+    int res = cqe->res;
+    int more = cqe->flags & IORING_CQE_F_MORE;
+    if (kind == URING_CANCEL) {
+        in_flight--;
+        return 0;
+    }
+    if (kind == URING_SEND) {
+        send_request_t* request = (send_request_t*) (cqe->user_data & ~(uint64_t) URING_KIND_MASK);
+        uring_watch_t* watch = request->watch;
+        in_flight--;
+        if (watch->handler) watch->handler->handle_sent(res);
+        watch->pending--;
+        request->release(request->ctx);
+        return release(watch);
+    }
+
+    uring_watch_t* watch = (uring_watch_t*) (cqe->user_data & ~(uint64_t) URING_KIND_MASK);
+    if (!more) {                                                            // the kernel is done with this poll, accept or recv
+        watch->armed = 0;
+        watch->pending--;
+        in_flight--;
+    }
+    watch->pending++;                                                       // the handler may remove the fd, keep the watch until we are done with it
+    int rearm = 0;
+    switch (kind) {
+        case URING_POLL:
+            if (res > 0) {                                                  // the same order as with epoll, so data sent right before a hangup is still handled
+                if (watch->handler && (res & EPOLLIN)) watch->handler->handle_readable();
+                if (watch->handler && (res & EPOLLOUT)) watch->handler->handle_writable();
+                if (watch->handler && (res & (EPOLLHUP | EPOLLRDHUP | EPOLLERR))) watch->handler->handle_hangup();
+            }
+            rearm = res >= 0;
+            break;
+        case URING_ACCEPT:
+            if (res >= 0) {
+                if (watch->handler) watch->handler->handle_accepted(res);
+                else close(res);                                            // accepted just before the listening socket was removed
+            }
+            rearm = res != -ECANCELED;
+            break;
+        case URING_RECV: {
+            int transient = res == -ENOBUFS || res == -EAGAIN || res == -EINTR; // out of provided buffers, or interrupted, the recv is just armed again
+            if (watch->handler && !transient && res != -ECANCELED) {
+                const char* data = res > 0 ? ring->get_buffer(cqe->flags >> IORING_CQE_BUFFER_SHIFT) : NULL;
+                watch->handler->handle_received(data, res);
+            }
+            if (cqe->flags & IORING_CQE_F_BUFFER) ring->recycle_buffer(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+            rearm = res > 0 || transient;
+            break;
+        }
+    }
+    if (rearm && watch->handler && !watch->armed) arm(watch);
+    watch->pending--;
+    return release(watch);
+}
+
+// function which waits up to timeout milliseconds for io_uring completions, submitting everything queued since the last wait with
+// the same syscall, and dispatches them, then fires any timers that are due
+int Reactor::poll_completions(int timeout) {
+    if (ring->wait(timers->next_timeout(timeout)) == -1) return -1;
+    int ncompletions = 0;
+    struct io_uring_cqe* cqe;
+    while ((cqe = ring->peek())) {
+        struct io_uring_cqe completion = *cqe;
+        ring->advance();                                                    // free the slot first, handlers may submit
+        dispatch(&completion);
+        ncompletions++;
+    }
+    timers->advance();
+    return ncompletions;
+}
+
+// function which waits up to timeout milliseconds for events and dispatches them to their handlers, then fires any timers that are due
+// the wait is cut short when a timer is due sooner
+// returns the number of events dispatched, or -1 if epoll_wait failed for a reason other than a signal
+int Reactor::poll_events(int timeout) {
+    if (ring) return poll_completions(timeout);
+    struct epoll_event events[MAXEVENTS];
+    int nevents = epoll_wait(epoll_fd, events, MAXEVENTS, timers->next_timeout(timeout));
+    if (nevents == -1) {
+        if (errno == EINTR) nevents = 0;                                    // interrupted by a signal, the caller will check its cleanup flag
+        else {
+            log_error("epoll_wait failed: %s", strerror(errno));
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < nevents; i++) {
+        EventHandler* handler = (EventHandler*) events[i].data.ptr;
+        uint32_t mask = events[i].events;
+        if (mask & EPOLLIN) handler->handle_readable();                     // read first so that any data sent right before a hangup is still handled
+        if (mask & EPOLLOUT) handler->handle_writable();
+        if (mask & (EPOLLHUP | EPOLLRDHUP | EPOLLERR)) handler->handle_hangup();
+    }
+    timers->advance();
+
+    return nevents;
+}
+
+// function which cancels everything still in the io_uring and waits for it to complete, before the ring goes away
+// no handler is called from here on, and no send is left pointing at memory that is about to be freed
+int Reactor::drain() {
+    for (auto it : *watches) {                                              // their owners are gone or going
+        it.second->handler = NULL;
+        release(it.second);
+    }
+    watches->clear();
+    struct io_uring_sqe* sqe = ring->get_sqe();
+    if (sqe) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY | IORING_ASYNC_CANCEL_ALL;
+        sqe->user_data = URING_CANCEL;
+        in_flight++;
+    }
+    for (int i = 0; in_flight > 0 && i < 10; i++) {                        // cancelled operations complete straight away, this only guards against a stuck ring
+        if (ring->wait(100) == -1) break;
+        struct io_uring_cqe* cqe;
+        while ((cqe = ring->peek())) {
+            struct io_uring_cqe completion = *cqe;
+            ring->advance();
+            dispatch(&completion);
+        }
+    }
+    if (in_flight > 0) log_warn("%ld io_uring operations did not complete before the reactor closed", in_flight);
+    return 0;
+}
+
+Reactor::Reactor(int backend) {
+    this->backend = backend;
+    if (backend == BACKEND_URING) {
+        this->ring = new IoUring(URING_ENTRIES);
+        if (ring->get_ring_fd() != -1) {
+            this->watches = new std::unordered_map<int, uring_watch_t*>();
+            return;
+        }
+        delete ring;
+        this->ring = NULL;
+        this->backend = BACKEND_EPOLL;
+        log_warn("Falling back to epoll");
+    }
+    this->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) log_error("Failed to create epoll instance: %s", strerror(errno));
+}
+
+Reactor::~Reactor() {
+    if (ring) {
+        drain();
+        delete ring;
+        delete watches;
+    }
+    if (epoll_fd != -1) close(epoll_fd);
+    delete timers;                                                          // whatever still embeds a timer no longer has it armed
+}
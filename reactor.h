@@ -0,0 +1,111 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unordered_map>
+
+#include "log.h"
+#include "timer.h"
+#include "uring.h"
+
+#define MAXEVENTS 64                  // max number of events dispatched per call to poll_events
+
+// how a reactor waits for I/O
+enum {
+    BACKEND_EPOLL = 0,                // readiness, handlers read and write their sockets themselves
+    BACKEND_URING,                    // completions, accepts and recvs stay armed in the kernel and sends are submitted in batches
+    BACKEND_COUNT
+};
+
+extern const char* backend_names[BACKEND_COUNT];
+
+// interface for anything the reactor can dispatch events to
+// each handler returns 0 on success and 1 if it wants its fd to be closed
+// the completion handlers are only called by an io_uring reactor, for the fds a handler asked it to accept, receive or send on
+class EventHandler {
+    public:
+        virtual ~EventHandler() {}
+        virtual int handle_readable() = 0;
+        virtual int handle_writable() = 0;
+        virtual int handle_hangup() = 0;
+        virtual int handle_accepted(int fd) { close(fd); return 1; }
+        virtual int handle_received(const char* data, ssize_t len) { return 0; }    // len is 0 once the peer closed, or -errno
+        virtual int handle_sent(ssize_t result) { return 0; }                       // bytes sent, or -errno
+};
+
+// a send handed to an io_uring reactor, which owns it from then on
+// the reactor tells the handler how it went if the fd is still watched, then calls release, and only then may the memory
+// the iovecs point at go away
+typedef struct send_request {
+    struct msghdr msg;
+    int (*release)(void* ctx);
+    void* ctx;
+    struct uring_watch* watch;        // set by the reactor
+} send_request_t;
+
+// an fd an io_uring reactor is watching, and what is armed on it
+// the handler is cleared when the fd is removed, the watch itself is freed once nothing in flight points at it anymore
+typedef struct uring_watch {
+    int fd;
+    int kind;                         // URING_POLL, URING_ACCEPT or URING_RECV
+    uint32_t events;                  // for a poll, the epoll events it waits for
+    int multishot;                    // for a recv, 0 to arm one recv at a time
+    int armed;                        // the poll, accept or recv is in the kernel
+    int pending;                      // operations in flight that point at the watch, sends included
+    EventHandler* handler;
+} uring_watch_t;
+
+// what a completion is for, kept in the low bits of its user_data, the rest is the watch or send it points at
+enum {
+    URING_CANCEL = 0,
+    URING_POLL,
+    URING_ACCEPT,
+    URING_RECV,
+    URING_SEND,
+    URING_KIND_MASK = 7
+};
+
+// Reactor class, owns an epoll instance or an io_uring and dispatches readable, writable and hangup events to the registered handlers
+// it also owns the timer wheel of its thread, which is run after every batch of events, so handlers and timers never overlap
+// with io_uring, fds added with add_fd get a multishot poll so their handlers see the same events as with epoll, while the ones handed
+// to accept_on and receive_on get completions instead, and everything queued by handlers and the loop goes in with the next wait
+class Reactor {
+    private:
+        int backend;
+        int epoll_fd = -1;
+        IoUring* ring = NULL;
+        std::unordered_map<int, uring_watch_t*>* watches = NULL;   // only with io_uring, the watch of every registered fd
+        size_t in_flight = 0;           // io_uring operations not yet completed, so the reactor can wait for them before it goes
+        TimerWheel* timers = new TimerWheel();
+        int watch_fd(int fd, int kind, uint32_t events, int multishot, EventHandler* handler);
+        int arm(uring_watch_t* watch);
+        int cancel(uring_watch_t* watch, int everything);
+        int release(uring_watch_t* watch);
+        int dispatch(struct io_uring_cqe* cqe);
+        int poll_completions(int timeout);
+        int drain();
+
+    public:
+        Reactor(int backend = BACKEND_EPOLL);
+        ~Reactor();
+        int add_fd(int fd, uint32_t events, EventHandler* handler);
+        int modify_fd(int fd, uint32_t events, EventHandler* handler);
+        int remove_fd(int fd);
+        int accept_on(int fd, EventHandler* handler);
+        int receive_on(int fd, EventHandler* handler, int multishot);
+        int send(int fd, send_request_t* request);
+        int poll_events(int timeout);
+        int get_backend() { return backend; }
+        int get_epoll_fd() { return epoll_fd; }
+        TimerWheel* get_timers() { return timers; }
+};
+
+#endif
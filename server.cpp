@@ -1,342 +1,1065 @@
 #include "server.h"
 
 Server* server;
-int cleanup = 0;
+volatile sig_atomic_t cleanup = 0;
+volatile sig_atomic_t report_memory = 0;
+static subscriber_list_t no_subscribers; 									// the matched set of every topic nobody is subscribed to
 
 // catches SIGINT and SIGTERM and sets cleanup flag, initiating a graceful shutdown
+// SIGUSR1 instead asks the first shard to log the topic tree's memory footprint
+// nothing is logged here, the shards log their shutdown once they see the flag
 void sig_handler(int s){
-	printf("Caught signal, cleaning up server\n");
+	if (s == SIGUSR1) {
+		report_memory = 1;
+		return;
+	}
 	cleanup = 1;
 }
 
-// function which handles the connecting client
-// it runs on main thread, so this can only run for one client at a time
-int Server::create_connection(int client_fd) {
-	if (connections->size() == MAXCLIENTS) { 						// if we have reached the max number of clients
-		printf("reached maximum connections, dropping\n");
+// function which handles a client subscribing to a topic
+// this function is only called from within the Connection class, prompted by a SUB request by the client
+// a topic with + or # levels is a filter, it is stored as its own branch of the tree and matched against every later publish,
+// so the client also receives messages for matching topics created after it subscribed, and the retained messages it already
+// matches are streamed to it by a Snapshot rather than all queued here
+// a client that subscribes again at a different QoS has its subscription replaced, and is sent the retained messages again
+int Server::subscribe_to_topic(Connection* connection, const char* topic, int qos) {
+	int client_fd = connection->get_client_fd();
+	log_debug("Subscribing client %d to topic %s", client_fd, topic);
+
+	int wildcard = 0;
+	if (check_topic(topic, &wildcard)) { 									// check the levels are valid before touching the tree
+		log_warn("Topic %s is invalid", topic);
 		return 1;
 	}
+	topic_t* topic_struct = resolve_topic(topic, 1); 						// the topic, or the filter's node, creating any levels that do not exist yet
+	if (!topic_struct) {
+		log_error("Could not create topic %s", topic);
+		return 1;
+	}
+	subscription_t* existing = connection->find_subscription(topic_struct);
+	if (existing && existing->subscriber.qos == qos) { 					// if the client is already subscribed to the topic, we don't want to add it again
+		log_debug("Client %d already subscribed to topic %s", client_fd, topic);
+		return 0;
+	}
+	if (existing) remove_subscription(existing); 							// publishers copy the subscriber out without a lock, so it is replaced rather than changed
 
-	payload_t payload = {0};
-	int tries = 0;
-	while (read(client_fd, &payload, PACKET_SIZE) != PACKET_SIZE) { // nonblocking read checking for any input
-		if (tries >= 10) {
-            printf("Client failed to connect\n");
-            return 1;
-        }
-        usleep(100000); 											// sleep for 100ms, this is the timeout
-        tries++;
+	subscription_t* subscription = new subscription_t;
+	subscription->topic = topic_struct;
+	subscription->subscriber = {connection, connection->get_shard(), client_fd, qos, connection->get_peer(), connection->get_id()};
+	connection->add_subscription(subscription);
+	connection->get_shard()->get_metrics()->subscribes.add(1);
+	std::unique_lock<std::shared_mutex> write_lock(topic_struct->lock); 	// link the subscription in at the head, publishers see it whole or not at all
+	subscription_t* head = topic_struct->subscribers.load(std::memory_order_relaxed);
+	subscription->prev = NULL;
+	subscription->next.store(head, std::memory_order_relaxed);
+	if (head) head->prev = subscription;
+	topic_struct->subscribers.store(subscription, std::memory_order_release);
+	write_lock.unlock();
+	invalidate_matches(topic_struct); 					// the topics this subscription matches must rebuild their cached subscriber sets
+	if (cluster && !connection->get_peer()) cluster->add_interest(topic_struct); // the other nodes forward this node what it is now interested in
+
+	if (wildcard) { 														// a filter is sent the retained message of every existing topic it matches,
+		Snapshot* snapshot = new Snapshot(this, connection, topic_struct, topic, qos); // streamed by the shard and walked in the pool if there are many
+		connection->get_shard()->add_snapshot(snapshot);
+		snapshot->start();
+		return 0;
 	}
 
-	if (strncmp(payload.req, "CONN", REQ_SIZE) == 0) { 				// if the request is CONN, we can connect the client
-		printf("Received CONN, sending CONN_ACK\n");
-		snprintf(payload.req, REQ_SIZE, "CONN_ACK");
-		write(client_fd, &payload, PACKET_SIZE); 					// send CONN_ACK to client
+	EpochGuard guard; 														// retained messages are read without a lock
+	Message* retain = load_retained(topic_struct); 						// the epoch keeps the retained message alive until the queue has taken its reference
+	if (retain) { 															// if the topic has a retained message, send it to the client
+		log_debug("Sending retained message to client %d for topic %s", client_fd, topic);
+		Message* marked = connection->get_peer() ? retain->as_snapshot() : NULL; 	// a link's node tells it apart from a live PUBRET
+		connection->publish_to_client(marked ? marked : retain, 0, qos); 		// the subscriber is on the calling shard, so it can be queued to directly
+		if (marked) marked->unref();
 	}
-	else { 															// client did not send CONN, so we it is probably not compatible, or there was an error
-		printf("Client did not send CONN\n");
+
+	return 0;
+}
+
+// function which handles a client unsubscribing from a topic
+// this function is called from within the Connection class, prompted by a UNSUB request by the client, and by the shard when a connection closes
+// a filter is unsubscribed as a whole, the same way it was subscribed
+int Server::unsubscribe_from_topic(Connection* connection, const char* topic) {
+	int client_fd = connection->get_client_fd();
+	log_debug("Unsubscribing client %d from topic %s", client_fd, topic);
+
+	if (check_topic(topic, NULL)) {
+		log_warn("Topic %s is invalid", topic);
+		return 1;
+	}
+	topic_t* topic_struct = resolve_topic(topic, 0); 						// no need to create any topics
+	subscription_t* subscription = topic_struct ? connection->find_subscription(topic_struct) : NULL;
+	if (!subscription) { 													// if the client is not subscribed to the topic, we don't want to remove it
+		log_debug("Client %d not subscribed to topic %s", client_fd, topic);
 		return 1;
 	}
+	return remove_subscription(subscription);
+}
 
-	Connection* connection = new Connection(client_fd, this);
-	connections->insert(std::pair<int, Connection*>(client_fd, connection)); // add new client to connections map
+// function which unlinks a subscription from its topic and its connection, then retires it
+// called by UNSUB and by the shard for every subscription of a closing connection, so it must be called from the connection's shard
+int Server::remove_subscription(subscription_t* subscription) {
+	topic_t* topic_struct = subscription->topic;
+	subscription->subscriber.connection->remove_subscription(subscription);
+	subscription->subscriber.shard->get_metrics()->unsubscribes.add(1);
 
-	printf("Number of connections: %ld\n", connections->size());
+	std::unique_lock<std::shared_mutex> write_lock(topic_struct->lock); 	// unlink it from the topic's list, a publisher standing on it can still follow its next
+	subscription_t* next = subscription->next.load(std::memory_order_relaxed);
+	if (subscription->prev) subscription->prev->next.store(next, std::memory_order_release);
+	else topic_struct->subscribers.store(next, std::memory_order_release);
+	if (next) next->prev = subscription->prev;
+	write_lock.unlock();
+	if (cluster && !subscription->subscriber.peer) cluster->remove_interest(topic_struct);
+	Epoch::retire(subscription, [](void* p) { delete (subscription_t*) p; });
+	invalidate_matches(topic_struct);
 
 	return 0;
 }
 
-// function which handles a client subscribing to a topic
-// this function is only called from within the Connection class, prompted by a SUB request by the client
-int Server::subscribe_to_topic(int client_fd, char* topic) {
-	printf("Subscribing client %d to topic %s\n", client_fd, topic);
+// function which sends a message to every subscriber of a topic
+// subscribers on the publishing shard are queued to directly, the rest are grouped into one inbox item per shard,
+// every queue and inbox item takes a reference to the same encoded message, so the payload is never copied per subscriber
+// the subscriber's QoS goes with it, a QoS 1 publish is delivered at QoS 1 to those that subscribed at QoS 1
+// other nodes' links are only sent the message if the publish is to be forwarded, which publishes from this node's own clients are
+// a batch holds the inbox items back and posts them all once it is done, otherwise each is posted straight away
+// the caller must be inside an epoch read-side section
+int Server::route_message(Message* message, subscriber_list_t* subscribers, publish_t* publish) {
+	static thread_local std::vector<std::vector<delivery_target_t>*> remote; // reused by every publish on this thread
+	remote.assign(shards->size(), NULL);
 
-	std::string topic_str(topic);
+	for (auto& it : *subscribers) { 									// send the message to each subscriber
+		if (it.peer && !publish->forward) continue; 					// the node it came from already forwarded it to every node that wants it
+		if (it.shard == publish->origin) { 								// only this thread closes its own connections, so the pointer is still good
+			it.connection->publish_to_client(message, message->get_published(), it.qos);
+			continue;
+		}
+		std::vector<delivery_target_t>*& targets = remote[it.shard->get_id()];
+		if (!targets) targets = new std::vector<delivery_target_t>();
+		targets->push_back({it.fd, it.qos, it.id});
+	}
 
-	std::vector<std::string>* levels = new std::vector<std::string>(); 	// vector of topic levels
-	if (analyze_topic(std::string(topic_str), levels)) { 				// analyze the topic and put the levels in the vector
-		printf("Topic %s is invalid\n", topic);
-		delete levels;
-		return 1;
+	for (unsigned long i = 0; i < remote.size(); i++) { 				// hand the remote subscribers to their shards
+		if (!remote[i]) continue;
+		inbox_item_t* item = new inbox_item_t;
+		message->ref(); 												// the target shard drops this reference once it has delivered the item
+		item->message = message;
+		item->targets = remote[i];
+		if (!publish->held) {
+			shards->at(i)->post(item);
+			continue;
+		}
+		held_items_t* held = &publish->held->at(i); 					// linked newest first, the way the inbox's stack links them
+		item->next = held->newest;
+		held->newest = item;
+		if (!held->oldest) held->oldest = item;
 	}
+	return 0;
+}
 
-	int create = 1;
+// function which adds up the filter generations of a topic and every level above it, the value its cached matched set is checked against
+// a filter can only match topics below the levels it names before its first wildcard, which is where its SUBs and UNSUBs are counted,
+// so the sum moves for exactly the topics a filter change may affect, and as every generation only grows it never comes back
+uint32_t Server::filter_generations(topic_t* topic) {
+	uint32_t sum = 0;
+	for (; topic; topic = topic->parent) sum += topic->filter_generation.load(std::memory_order_acquire);
+	return sum;
+}
 
-	if (std::string(topic).find("+") != std::string::npos
-		|| std::string(topic).find("#") != std::string::npos) create = 0;	// if the topic levels contains wildcards, we don't want to create any topics
+// function which returns every subscriber a publish to a concrete topic goes to, from the topic itself and every filter matching it
+// the set is built by walking the tree once and then cached on the topic until a SUB or UNSUB on the topic itself drops it,
+// or one on a filter above it moves the topic's filter generations on, which a filter matching millions of topics does without touching them
+// sets are only cached under the topic's lock by a builder that saw the current filter generations and no invalidation of the topic
+// while it walked, invalidations take the same lock, so a set dropped by an UNSUB is never cached again by a walk that started before it
+// the caller must be inside an epoch read-side section, which keeps the returned set alive
+subscriber_list_t* Server::match_subscribers(topic_t* topic) {
+	static thread_local std::vector<subscription_t*> lists; 			// reused by every match on this thread, so matching allocates nothing once it has grown
+	static thread_local std::unordered_map<uint64_t, size_t> seen; 	// connections already in the set and where, only needed when more than one list matched
 
-	std::vector<topic_t*>* topic_structs = new std::vector<topic_t*>();		// vector of topic structs
-	std::map<std::string, topic_t*>* cur_topics = topics; 					// start at the root of the server's topic tree
-	if (poll_topics(levels, topic_structs, cur_topics, "", create)) { 		// poll the levels to see if any topics need to be created, and add the lowest-level topics to the topic_structs vector
-		printf("Topic %s is invalid\n", topic);
-		delete levels;
-		delete topic_structs;
-		return 1;
+	uint32_t filters = filter_generations(topic);
+	if (topic->matched_filters.load(std::memory_order_acquire) == filters) {
+		subscriber_list_t* matched = topic->matched.load(std::memory_order_acquire);
+		if (matched) return matched; 									// the hot path, the set is still cached
 	}
 
-	for (auto it : *topic_structs) { 										// for each topic in the topic_structs vector, add the client to the topic's subscribers
-		if (connections->at(client_fd)->add_topic(it->name)) { 				// if the client is already subscribed to the topic, we don't want to add it again
-			printf("Client %d already subscribed to topic %s\n", client_fd, it->name);
-			return 1;
-		}
-		it->connections->push_back(connections->at(client_fd)); 			// add the client to the topic's subscribers
-		if (it->retain) { 													// if the topic has a retained message, send it to the client
-			printf("Sending retained message to client %d for topic %s\n", client_fd, it->name);
-			payload_t payload = {0};
-			snprintf(payload.req, REQ_SIZE, "PUBRET");
-			snprintf(payload.topic, TOPIC_SIZE, "%s", it->name);
-			snprintf(payload.msg, MSG_SIZE, "%s", it->retain);
-			connections->at(client_fd)->send_to_client(&payload);
+	uint32_t generation = topic->match_generation.load(); 				// read before the lists, so an invalidation racing with the walk is noticed
+	lists.clear();
+	match_topic(root, std::string_view(topic->name, topic->name_len), &lists);
+	subscriber_list_t* matched = lists.size() > 0 ? new subscriber_list_t() : &no_subscribers; // most published topics have no subscribers, they share one empty set
+	if (lists.size() > 1) seen.clear();
+	for (auto list : lists) {
+		for (subscription_t* it = list; it; it = it->next.load(std::memory_order_acquire)) {
+			if (lists.size() > 1) { 									// a client whose filters overlap is sent the message once, at the highest QoS among them
+				auto found = seen.emplace(it->subscriber.id, matched->size());
+				if (!found.second) {
+					subscriber_t* first = &matched->at(found.first->second);
+					if (it->subscriber.qos > first->qos) first->qos = it->subscriber.qos;
+					continue;
+				}
+			}
+			matched->push_back(it->subscriber);
 		}
 	}
 
-	delete levels;
-	delete topic_structs;
+	std::unique_lock<std::shared_mutex> write_lock(topic->lock);
+	subscriber_list_t* cached = topic->matched.load(std::memory_order_relaxed);
+	if (cached && topic->matched_filters.load() == filters) { 			// another publisher cached a set first, use theirs
+		if (matched != &no_subscribers) delete matched;
+		return cached;
+	}
+	if (filter_generations(topic) != filters || topic->match_generation.load() != generation) { // a SUB or UNSUB changed the lists while we walked,
+		if (matched != &no_subscribers) Epoch::retire(matched, [](void* p) { delete (subscriber_list_t*) p; }); // the set is good for this publish but not to keep
+		return matched;
+	}
+	topic->matched.store(matched, std::memory_order_release);
+	topic->matched_filters.store(filters, std::memory_order_release);
+	write_lock.unlock();
+	if (cached && cached != &no_subscribers) Epoch::retire(cached, [](void* p) { delete (subscriber_list_t*) p; });
+	return matched;
+}
 
+// function which drops the cached subscriber set of every concrete topic a subscription on topic_struct matches
+// a plain topic only affects itself, a filter moves the filter generation of its last level without a wildcard on,
+// which the cached sets of the topics below it are checked against, a filter starting with a wildcard moves the root's
+int Server::invalidate_matches(topic_t* topic_struct) {
+	if (topic_struct->wildcard) {
+		topic_t* prefix = topic_struct;
+		while (prefix->wildcard) prefix = prefix->parent; 				// a node is a filter if any level of its name is a wildcard, the root never is
+		prefix->filter_generation.fetch_add(1);
+		return 0;
+	}
+	std::unique_lock<std::shared_mutex> write_lock(topic_struct->lock); 	// under the lock a builder checks the generation with, see match_subscribers
+	topic_struct->match_generation.fetch_add(1);
+	subscriber_list_t* old_matched = topic_struct->matched.exchange(NULL);
+	write_lock.unlock();
+	if (old_matched && old_matched != &no_subscribers) Epoch::retire(old_matched, [](void* p) { delete (subscriber_list_t*) p; });
 	return 0;
 }
 
-// function which handles a client unsubscribing from a topic
-// this function is only called from within the Connection class, prompted by a UNSUB request by the client
-int Server::unsubscribe_from_topic(int client_fd, char* topic) {
-	printf("Unsubscribing client %d from topic %s\n", client_fd, topic);
+// function which publishes a message to one concrete topic, retaining it there if asked, and sends it to every matching subscriber
+// the caller must be inside an epoch read-side section
+int Server::publish_to_topic(topic_t* topic, publish_t* publish) {
+	Message* message = Message::encode(publish->op, topic->name, topic->name_len, publish->msg.data(), publish->msg.size(), PROTOCOL_FRAMED);
+	message->set_qos(publish->qos);
+	if (publish->origin) {
+		message->set_published(metrics_now()); 							// subscribers' queues record how long it took to reach them
+		count_publish(publish->origin->get_metrics(), topic->name, topic->name_len);
+	}
+	if (publish->retain) { 												// if the client is publishing a retained message, the topic keeps a reference to it
+		log_debug("Retaining message for topic %s", topic->name);
+		message->ref();
+		Message* old_retain = topic->retain.exchange(message, std::memory_order_acq_rel); // swap in the new message, readers keep the old one until they leave the epoch
+		if (old_retain) Epoch::retire(old_retain, [](void* p) { ((Message*) p)->unref(); });
+		if (store && topic->name[0] != '$') persist_retained(topic, message); // written before any subscriber is sent it, though only synced within STORE_SYNC_MS, $SYS is not kept
+	}
+
+	subscriber_list_t* subscribers = match_subscribers(topic);
+	log_debug("Publishing to %s topic for %ld client%s", topic->name, subscribers->size(), subscribers->size() == 1 ? "" : "s");
+	route_message(message, subscribers, publish);
+	message->unref(); 													// the queues holding the message keep it alive until they have written it
+	return 0;
+}
+
+// function which publishes a client's message to the topic it named, on the shard it arrived on
+// a topic the publishing shard has seen before is found with one hash lookup, anything else is checked and walked level by level
+// a publish to a topic with wildcards goes to every existing topic it matches, under each topic's own name
+// the caller must be inside an epoch read-side section
+int Server::publish_named(std::string_view name, publish_t* publish) {
+	Shard* origin = publish->origin;
+	shard_metrics_t* metrics = origin->get_metrics(); 					// the shard's own counters, nothing another thread writes
+	metrics->publishes_in.add(1);
+	metrics->bytes_in.add(publish->msg.size());
 
-	std::string topic_str(topic);
+	topic_t* topic_struct = origin->find_cached_topic(name); 			// topics are never freed while the server runs, so a cached pointer stays good
+	if (topic_struct) return publish_to_topic(topic_struct, publish);
 
-	std::vector<std::string>* levels = new std::vector<std::string>(); 	// vector of topic levels
-	if (analyze_topic(std::string(topic_str), levels)) { 				// analyze the topic and put the levels in the vector
-		printf("Topic %s is invalid\n", topic);
-		delete levels;
+	if (name.size() > 0 && name[0] == '$') { 							// topics starting with $ belong to the server, like $SYS
+		log_warn("Topic %s is reserved for the server, ignoring publish", std::string(name).c_str());
 		return 1;
 	}
-
-	std::vector<topic_t*>* topic_structs = new std::vector<topic_t*>(); // vector of topic structs
-	std::map<std::string, topic_t*>* cur_topics = topics; 				// start at the root of the server's topic tree
-	if (poll_topics(levels, topic_structs, cur_topics, "", 0)) { 		// add the lowest-level topics to the topic_structs vector, no need to create any topics
-		printf("Topic %s is invalid\n", topic);
-		delete levels;
-		delete topic_structs;
+	int wildcard = 0;
+	if (check_topic(name, &wildcard)) { 								// check the levels are valid before touching the tree
+		log_warn("Topic %s is invalid", std::string(name).c_str());
 		return 1;
 	}
 
-	for (auto it : *topic_structs) { 									// for each topic in the topic_structs vector, remove the client from the topic's subscribers
-		if (connections->at(client_fd)->remove_topic(it->name)) { 		// if the client is not subscribed to the topic, we don't want to remove it
-			printf("Client %d not subscribed to topic %s\n", client_fd, topic);
+	if (!wildcard) {
+		topic_struct = resolve_topic(name, 1);
+		if (!topic_struct) { 											// the arena could not allocate the node
+			log_error("Could not create topic %s", std::string(name).c_str());
 			return 1;
 		}
-
-		for (unsigned long i = 0; i < it->connections->size(); i++) { 	// remove the client from the topic's subscribers
-			if (it->connections->at(i) == connections->at(client_fd)) {
-				it->connections->erase(it->connections->begin() + i);
-				break;
-			}
-		}
+		origin->cache_topic(topic_struct);
+		return publish_to_topic(topic_struct, publish);
 	}
 
-	delete levels;
-	delete topic_structs;
-
+	std::vector<topic_t*> topic_structs; 								// the existing topics the wildcard publish matches
+	expand_topic(root, name, &topic_structs);
+	if (topic_structs.size() == 0) log_debug("No topics match %s", std::string(name).c_str());
+	for (auto it : topic_structs) publish_to_topic(it, publish);
 	return 0;
 }
 
 // function which handles a client publishing a message to a topic
 // this function is only called from within the Connection class, prompted by a PUB or PUBRET request by the client
 // if the client is publishing a retained message, the retain flag will be set to 1
-int Server::publish_message(payload_t* payload, int retain) {
-	std::vector<std::string>* levels = new std::vector<std::string>(); 	// vector of topic levels
-	if (analyze_topic(std::string(payload->topic), levels)) { 			// analyze the topic and put the levels in the vector
-		printf("Topic %s is invalid\n", payload->topic);
-		delete levels;
+int Server::publish_message(frame_t* frame, int retain, Shard* origin) {
+	EpochGuard guard; 													// subscriber lists and retained messages are read without a lock
+	publish_t publish = {(uint8_t) (retain ? OP_PUBRET : OP_PUB), frame->msg, frame->qos, retain, 1, origin};
+	return publish_named(frame->topic, &publish);
+}
+
+// function which handles a client publishing a batch of messages, each to the batch's prefix followed by the entry's topic
+// this function is only called from within the Connection class, prompted by a PUB or PUBRET batch by the client
+// the whole batch is one epoch section, the messages are views into the request rather than copies of it, and what goes to other
+// shards is held back and handed to each of them in one inbox push at the end, so a batch wakes each shard once, not per message
+// returns 1 if an entry was malformed, the entries before it are still published
+int Server::publish_batch(frame_t* frame, int retain, Shard* origin) {
+	static thread_local std::string name; 								// the prefix and the entry's topic, reused so entries allocate no names
+	EpochGuard guard;
+	std::vector<held_items_t> held(shards->size());
+	publish_t publish = {(uint8_t) (retain ? OP_PUBRET : OP_PUB), "", frame->qos, retain, 1, origin, &held};
+	std::string_view entries(frame->msg);
+	std::string_view topic;
+	name.assign(frame->topic);
+	size_t prefix_len = name.size();
+	int ret;
+	while ((ret = decode_entry(&entries, &topic, &publish.msg)) == 1) {
+		name.resize(prefix_len);
+		name.append(topic);
+		if (name.find('\0') != std::string::npos) { 					// topics are stored as C strings
+			log_warn("Topic with a NUL byte in a batch, ignoring");
+			continue;
+		}
+		publish_named(name, &publish);
+	}
+
+	for (unsigned long i = 0; i < held.size(); i++) {
+		if (held[i].newest) shards->at(i)->post(held[i].newest, held[i].oldest);
+	}
+	return ret == -1;
+}
+
+// function which publishes a retained message from the server itself, used for the $SYS tree, this can be called from any thread
+// subscribers on every shard are reached through their inboxes, and the message is kept in memory only, never in the store
+int Server::publish_sys(std::string_view topic, std::string_view msg) {
+	EpochGuard guard;
+	topic_t* topic_struct = resolve_topic(topic, 1);
+	if (!topic_struct) {
+		log_error("Could not create topic %s", std::string(topic).c_str());
 		return 1;
 	}
+	publish_t publish = {OP_PUBRET, msg, 0, 1, 0, NULL}; 				// $SYS is each node's own, it is never forwarded
+	return publish_to_topic(topic_struct, &publish);
+}
 
-	int create = 1;
-	if (std::string(payload->topic).find("+") != std::string::npos
-		|| std::string(payload->topic).find("#") != std::string::npos) create = 0; // if the topic levels contains wildcards, we don't want to create any topics
+// function which publishes a message another node forwarded over its link to this one, called from the cluster thread
+// it goes to this node's clients only; a snapshot, the retained message the peer sent the link because it subscribed, is dropped
+// if this node already retains the same message, its subscribers were sent this node's copy when they subscribed
+int Server::publish_forwarded(std::string_view topic, std::string_view msg, int retain, int qos, int snapshot) {
+	EpochGuard guard;
+	int wildcard = 0;
+	if (topic.size() == 0 || topic[0] == '$' || check_topic(topic, &wildcard) || wildcard) { // a delivery is always to a concrete topic
+		log_warn("Peer forwarded a message to invalid topic %s, ignoring", std::string(topic).c_str());
+		return 1;
+	}
+	topic_t* topic_struct = resolve_topic(topic, 1);
+	if (!topic_struct) {
+		log_error("Could not create topic %s", std::string(topic).c_str());
+		return 1;
+	}
+	if (snapshot) { 													// live publishes always go through, the same value may be published again
+		Message* current = load_retained(topic_struct);
+		if (current && std::string_view(current->get_msg(), current->get_msg_len()) == msg) return 0;
+	}
+	publish_t publish = {(uint8_t) (retain ? OP_PUBRET : OP_PUB), msg, qos, retain, 0, NULL};
+	return publish_to_topic(topic_struct, &publish);
+}
 
-	std::vector<topic_t*>* topic_structs = new std::vector<topic_t*>(); // vector of topic structs
-	std::map<std::string, topic_t*>* cur_topics = topics; 				// start at the root of the server's topic tree
-	if (poll_topics(levels, topic_structs, cur_topics, "", create)) { 	// poll the levels to see if any topics need to be created, and add the lowest-level topics to the topic_structs vector
-		printf("Topic %s is invalid\n", payload->topic);
-		delete levels;
-		delete topic_structs;
+// function which appends a topic's new retained message to the store and points the topic at it
+// the shared persist lock keeps the append and the swap of the location together, so whoever takes it exclusively sees every
+// record before the log's end accounted for in the tree, and the topic's lock keeps two publishes to one topic in log order
+// and the location and size it records in step, the superseded record is charged at its own size
+int Server::persist_retained(topic_t* topic, Message* message) {
+	std::shared_lock<std::shared_mutex> read_lock(persist_lock);
+	std::unique_lock<std::shared_mutex> write_lock(topic->lock);
+	uint64_t location = store->append(topic->name, topic->name_len, message->get_msg(), message->get_msg_len());
+	if (!location) return 1; 											// the message is still retained in memory, it just will not survive a restart
+	uint64_t old_location = topic->stored.exchange(location);
+	uint64_t old_size = topic->stored_size;
+	topic->stored_size = RetainStore::record_size(topic->name_len, message->get_msg_len());
+	write_lock.unlock();
+	if (old_location) store->supersede(old_size);
+	return 0;
+}
+
+// function which returns a topic's retained message, reading it in from the store the first time it is needed after a restart
+// the topic keeps the loaded message, so only the first subscriber pays for the read
+// the caller must be inside an epoch read-side section
+Message* Server::load_retained(topic_t* topic) {
+	Message* retain = topic->retain.load(std::memory_order_acquire);
+	if (retain || !store) return retain;
+	for (int tries = 0; tries < 3; tries++) { 							// compaction may move the record between reading its location and reading the record
+		uint64_t location = topic->stored.load();
+		if (!location) return NULL;
+		Message* loaded = store->read(location);
+		if (!loaded) continue;
+		Message* expected = NULL;
+		if (topic->retain.compare_exchange_strong(expected, loaded, std::memory_order_acq_rel)) return loaded;
+		loaded->unref(); 												// a publish or another subscriber got there first
+		return expected;
+	}
+	log_error("Could not load retained message for topic %s", topic->name);
+	return NULL;
+}
+
+// function which points a topic at a retained record found in the store at startup, creating the topic
+// records are found in log order, so a later record for the same topic replaces an earlier one
+// live adds up the bytes of the records the topics end up pointing at, everything else in the log is superseded
+int Server::restore_retained(std::string_view topic, uint64_t location, uint64_t size, uint64_t* live) {
+	topic_t* topic_struct = resolve_topic(topic, 1);
+	if (!topic_struct) {
+		log_error("Could not create topic %s", std::string(topic).c_str());
 		return 1;
 	}
+	if (topic_struct->stored.exchange(location)) *live -= std::min(*live, topic_struct->stored_size);
+	topic_struct->stored_size = size;
+	*live += size;
+	return 0;
+}
+
+// function which calls fn on every topic below parent, parent included
+// children are copied out under the shared lock, so the walk does not hold up publishers adding topics
+int Server::for_each_topic(topic_t* parent, int (*fn)(Server* server, topic_t* topic, void* ctx), void* ctx) {
+	fn(this, parent, ctx);
+	std::vector<topic_t*> children;
+	std::shared_lock<std::shared_mutex> read_lock(parent->lock);
+	for (uint32_t i = 0; i < parent->subtopics.capacity; i++) {
+		if (parent->subtopics.slots[i].topic) children.push_back(parent->subtopics.slots[i].topic);
+	}
+	read_lock.unlock();
+	for (auto it : children) for_each_topic(it, fn, ctx);
+	return 0;
+}
 
-	for (auto it : *topic_structs) { 									// for each topic in the topic_structs vector, send the message to the topic's subscribers
-		unsigned long size = it->connections->size();
-		printf("Publishing to %s topic for %ld client", it->name, size);
-		if (size != 1) printf("s");
-		printf("\n");
+// function which writes a new index of the store from the locations in the topic tree
+// the high-water mark is taken with the persist lock held exclusively, so every record before it is already in the tree when it is walked;
+// records appended during the walk may or may not make the index, and are replayed at startup either way
+int Server::write_retained_index() {
+	std::unique_lock<std::shared_mutex> write_lock(persist_lock);
+	uint64_t hwm = store->get_hwm();
+	write_lock.unlock();
 
-		snprintf(payload->topic, TOPIC_SIZE, "%s", it->name);
+	if (store->begin_index(hwm)) return 1;
+	for_each_topic(root, [](Server* server, topic_t* topic, void* ctx) {
+		std::shared_lock<std::shared_mutex> read_lock(topic->lock); 		// the location and size are changed together under it
+		uint64_t location = topic->stored.load();
+		if (location) server->store->add_index_entry(topic->name, topic->name_len, location, topic->stored_size);
+		return 0;
+	}, NULL);
+	return store->finish_index();
+}
+
+// function which compacts the store, copying every live record out of the sealed segments and then deleting them
+// each record is moved with the persist lock held exclusively, so a publish cannot land between reading the topic's location and
+// replacing it, and the copy can never be newer in the log than a later publish to the same topic
+int Server::compact_retained() {
+	log_info("Compacting retained store, %lu of %lu bytes superseded", store->get_garbage(), store->get_total());
+	uint32_t first_kept = store->roll(); 								// every segment before it is sealed, live records are copied into it and later ones
+	for_each_topic(root, [](Server* server, topic_t* topic, void* ctx) {
+		uint32_t first_kept = *(uint32_t*) ctx;
+		if (!topic->stored.load() || LOCATION_SEGMENT(topic->stored.load()) >= first_kept) return 0;
+		std::unique_lock<std::shared_mutex> write_lock(server->persist_lock);
+		uint64_t location = topic->stored.load(); 						// check again now that no publish can move it
+		if (!location || LOCATION_SEGMENT(location) >= first_kept) return 0;
+		Message* message = server->store->read(location);
+		if (!message) return 1;
+		uint64_t moved = server->store->append(topic->name, topic->name_len, message->get_msg(), message->get_msg_len());
+		message->unref();
+		if (!moved) return 0;
+		topic->stored.store(moved); 									// the same record, so the same size, and the copy left behind is now superseded
+		server->store->supersede(topic->stored_size);
+		return 0;
+	}, &first_kept);
+	if (write_retained_index()) return 1; 								// the old index points into the segments about to go
+	store->drop_segments_before(first_kept);
+	log_info("Compacted retained store to %lu bytes", store->get_total());
+	return 0;
+}
+
+// function run by the store thread, which syncs the log every STORE_SYNC_MS and indexes or compacts it when it has grown enough
+void Server::store_loop(Server* server) {
+	Log::set_thread_name("store");
+	RetainStore* store = server->store;
+	while (!server->store_stop.load()) {
+		for (int waited = 0; waited < STORE_SYNC_MS && !server->store_stop.load(); waited += 100) usleep(100 * 1000);
+		store->sync();
+		if (store->get_garbage() >= COMPACT_MIN && store->get_garbage() * 2 >= store->get_total()) server->compact_retained();
+		else if (store->get_appended() >= INDEX_INTERVAL) server->write_retained_index();
+	}
+}
+
+// function which opens the retained store in dir, restores every retained topic in it, and starts the store thread
+// retained messages themselves are left on disk until a subscriber needs them
+int Server::open_store(const char* dir) {
+	store = new RetainStore(dir);
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	struct restore_t {
+		Server* server;
+		uint64_t live;
+	} restore = {this, 0};
+	int failed = store->open_store([](void* ctx, const char* topic, size_t topic_len, uint64_t location, uint64_t size) {
+		restore_t* restore = (restore_t*) ctx;
+		return restore->server->restore_retained(std::string_view(topic, topic_len), location, size, &restore->live);
+	}, &restore);
+	if (failed) {
+		delete store;
+		store = NULL;
+		return 1;
+	}
+	store->set_garbage(store->get_total() - std::min(store->get_total(), restore.live)); // what no topic points at was superseded before the restart
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	log_info("Opened retained store %s, %lu bytes, %lu superseded, %ld topics, in %.3f seconds", dir, store->get_total(), store->get_garbage(), ntopics.load(),
+		(end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+	store_thread = new std::thread(store_loop, this);
+	return 0;
+}
+
+// function which sets how long sessions outlive their clients' connections and where their offline queues go, before the shards start
+// an expiry of 0 turns sessions off, a CONN naming one is then treated like any other
+int Server::configure_sessions(int expiry, const char* offline_dir, size_t offline_budget) {
+	if (offline_dir && access(offline_dir, W_OK | X_OK)) {
+		log_error("Cannot spill offline queues to %s: %s", offline_dir, strerror(errno));
+		return 1;
+	}
+	this->session_expiry = expiry;
+	this->offline_dir = offline_dir;
+	this->offline_budget = offline_budget;
+	return 0;
+}
+
+// function which links this node to the other nodes of a cluster, a comma-separated list of the host:port pairs their clients
+// connect to, port is this node's own, which names its links to them
+int Server::join_cluster(const char* peers, const char* port) {
+	cluster = new Cluster(this, port);
+	return cluster->add_peers(peers);
+}
+
+// function which registers a new session for client_id, held by connection id on shard, this can be called from any thread
+// if the client already has a session, nothing changes and owner is set to where it lives, unless it is the stale session,
+// one its shard no longer has, which is replaced
+// returns 0 if the session was registered, 1 if the client's socket should be handed to owner instead
+int Server::claim_session(const std::string& client_id, Shard* shard, uint64_t id, uint64_t stale, session_owner_t* owner) {
+	std::lock_guard<std::mutex> guard(session_lock);
+	auto it = sessions->find(client_id);
+	if (it != sessions->end() && !(it->second.shard == shard && it->second.id == stale)) {
+		*owner = it->second;
+		return 1;
+	}
+	(*sessions)[client_id] = {shard, id};
+	return 0;
+}
 
-		for (auto it2 : *(it->connections)) { 	// send the message to each subscriber
-			it2->send_to_client(payload);
+// function which removes a session from the registry once it expires or the server shuts down, this can be called from any thread
+// the entry is only removed if it is still the one held by connection id on shard
+int Server::end_session(const std::string& client_id, Shard* shard, uint64_t id) {
+	std::lock_guard<std::mutex> guard(session_lock);
+	auto it = sessions->find(client_id);
+	if (it == sessions->end() || it->second.shard != shard || it->second.id != id) return 1;
+	sessions->erase(it);
+	return 0;
+}
+
+// function which checks every level of a topic is valid, and sets wildcard if it is a filter rather than a plain topic
+// a level containing + or # must be only that character, and # must be the last level
+int Server::check_topic(std::string_view topic, int* wildcard) {
+	if (wildcard) *wildcard = 0;
+	size_t pos = 0;
+	while (1) {
+		size_t slash = topic.find('/', pos);
+		std::string_view level = topic.substr(pos, slash == std::string_view::npos ? std::string_view::npos : slash - pos);
+		if (level.find_first_of("+#") != std::string_view::npos) {
+			if (level.size() != 1) return 1; 							// if the level contains a + or # character, it must be the only character in the level
+			if (level == "#" && slash != std::string_view::npos) return 1; // if the level is #, it must be the last level in the topic
+			if (wildcard) *wildcard = 1;
 		}
+		if (slash == std::string_view::npos) return 0;
+		pos = slash + 1;
+	}
+}
 
-		if (retain) { 							// if the client is publishing a retained message, set the topic's retain field to the message
-			printf("Retaining message for topic %s\n", it->name);
-			char** cur_retain = &it->retain; 	// set the topic's retain field to the message
-			if (*cur_retain) free(*cur_retain); // if the topic already had a retained message, free it
-			*cur_retain = strdup(payload->msg); // set the topic's retain field to the message
+// function which collects the subscription lists of every node matching a published topic, the topic itself and any + or # filters on the way to it
+// only the branches the topic can match are walked and nothing is allocated, so the cost is the topic's depth plus the lists that match
+// # matches one or more levels, + matches exactly one, and like MQTT neither matches a first level starting with $
+// the caller must be inside an epoch read-side section
+int Server::match_topic(topic_t* parent, std::string_view topic, std::vector<subscription_t*>* lists) {
+	size_t slash = topic.find('/');
+	std::string_view level = topic.substr(0, slash);
+	topic_t* next[2];
+	topic_t* hash;
+	{
+		std::shared_lock<std::shared_mutex> read_lock(parent->lock); 	// the lock only covers finding the children, not the recursion
+		next[0] = child_of(parent, level);
+		next[1] = child_of(parent, "+");
+		hash = child_of(parent, "#");
+	}
+	if (parent == root && level.size() > 0 && level[0] == '$') { 		// a filter starting with a wildcard does not match the server's $ topics
+		next[1] = NULL;
+		hash = NULL;
+	}
+
+	if (hash) { 														// # matches this level and everything below it
+		subscription_t* list = hash->subscribers.load(std::memory_order_acquire);
+		if (list) lists->push_back(list);
+	}
+	for (auto it : next) {
+		if (!it) continue;
+		if (slash != std::string_view::npos) { 							// there are more levels, keep walking this branch
+			match_topic(it, topic.substr(slash + 1), lists);
+			continue;
 		}
+		subscription_t* list = it->subscribers.load(std::memory_order_acquire);
+		if (list) lists->push_back(list);
 	}
+	return 0;
+}
 
-	delete levels;
-	delete topic_structs;
+// function which adds every existing topic matching a filter below parent to topic_structs, filter nodes themselves are skipped
+// used for publishes with wildcards, never on the plain publish path, Snapshot walks the tree the same way in pieces
+int Server::expand_topic(topic_t* parent, std::string_view filter, std::vector<topic_t*>* topic_structs) {
+	size_t slash = filter.find('/');
+	std::string_view level = filter.substr(0, slash);
+	std::vector<topic_t*> children; 									// take a copy of the children so the lock is not held while we recurse
+	{
+		std::shared_lock<std::shared_mutex> read_lock(parent->lock);
+		if (level == "+" || level == "#") {
+			for (uint32_t i = 0; i < parent->subtopics.capacity; i++) {
+				topic_t* child = parent->subtopics.slots[i].topic;
+				if (child && !child->wildcard && !(parent == root && child->name[0] == '$')) children.push_back(child); // nor is a $ topic published to by one
+			}
+		}
+		else {
+			topic_t* child = child_of(parent, level);
+			if (child) children.push_back(child);
+		}
+	}
+
+	for (auto it : children) {
+		if (level == "#") { 											// # matches the rest of the levels
+			topic_structs->push_back(it);
+			expand_topic(it, filter, topic_structs); 					// keep the wildcard as the last level
+		}
+		else if (slash == std::string_view::npos) topic_structs->push_back(it);
+		else expand_topic(it, filter.substr(slash + 1), topic_structs);
+	}
 	return 0;
 }
 
-// function which analyzes a topic and puts the levels in a vector
-// requires a topic string and a pointer to a vector of strings for the levels
-int Server::analyze_topic(std::string topic, std::vector<std::string>* levels) {
+// function which walks the tree to a topic or filter's node, creating missing levels if the create flag is set
+// returns NULL if a level does not exist and create is not set
+topic_t* Server::resolve_topic(std::string_view topic, int create) {
+	topic_t* node = root;
 	size_t pos = 0;
-	std::string token;
-	while ((pos = topic.find("/")) != std::string::npos) { 					// split the topic into levels by the / character
-		token = topic.substr(0, pos);
-		levels->push_back(token);
-		topic.erase(0, pos + 1);
+	while (node) {
+		size_t slash = topic.find('/', pos);
+		size_t end = slash == std::string_view::npos ? topic.size() : slash;
+		node = find_topic(node, topic.substr(pos, end - pos), topic.substr(0, end), create);
+		if (slash == std::string_view::npos) break;
+		pos = slash + 1;
 	}
+	return node;
+}
+
+// function which hashes a level for the children tables, FNV-1a
+static uint32_t hash_level(std::string_view level) {
+	uint32_t hash = 2166136261u;
+	for (char c : level) {
+		hash ^= (uint8_t) c;
+		hash *= 16777619u;
+	}
+	return hash;
+}
 
-	levels->push_back(topic); 												// add the last level to the vector
+// function which returns the last level of a topic's name, the key it is stored under in its parent's children table
+static std::string_view level_of(topic_t* topic) {
+	return std::string_view(topic->name + topic->level_off, topic->name_len - topic->level_off);
+}
 
-	for (auto it : *levels) { 												// check if any of the levels are invalid
-		if (it.find("+") != std::string::npos && it.size() != 1) return 1; 	// if the level contains a + character, it must be the only character in the level
-		else if (it.find("#") != std::string::npos) { 
-			if (it.size() != 1) return 1; 									// if the level contains a # character, it must be the only character in the level
-			else if (it != levels->back()) return 1; 						// if the level contains a # character, it must be the last level in the topic
+// function which looks up a child of a topic, the caller must hold the parent's lock
+topic_t* Server::child_of(topic_t* parent, std::string_view level) {
+	topic_children_t* children = &parent->subtopics;
+	if (!children->slots) return NULL;
+	uint32_t hash = hash_level(level);
+	uint32_t mask = children->capacity - 1;
+	for (uint32_t i = hash & mask; children->slots[i].topic; i = (i + 1) & mask) { 	// the table is never full, so an empty slot ends the probe
+		if (children->slots[i].hash == hash && level_of(children->slots[i].topic) == level) return children->slots[i].topic;
+	}
+	return NULL;
+}
+
+// function which adds a child to a topic's children table, growing the table once it is three quarters full
+// the caller must hold the parent's lock exclusively, so no reader can be probing the old table when it is freed
+int Server::add_child(topic_t* parent, topic_t* child, uint32_t hash) {
+	topic_children_t* children = &parent->subtopics;
+	if ((children->count + 1) * 4 > children->capacity * 3) {
+		uint32_t capacity = children->capacity ? children->capacity * 2 : 2; 	// most topics have a single child, which fits the smallest table
+		topic_slot_t* slots = (topic_slot_t*) calloc(capacity, sizeof(topic_slot_t));
+		if (!slots) return 1;
+		for (uint32_t i = 0; i < children->capacity; i++) { 			// rehash every child into the bigger table
+			topic_slot_t slot = children->slots[i];
+			if (!slot.topic) continue;
+			uint32_t j = slot.hash & (capacity - 1);
+			while (slots[j].topic) j = (j + 1) & (capacity - 1);
+			slots[j] = slot;
 		}
+		free(children->slots);
+		table_bytes += (capacity - children->capacity) * sizeof(topic_slot_t);
+		children->slots = slots;
+		children->capacity = capacity;
 	}
 
+	uint32_t i = hash & (children->capacity - 1);
+	while (children->slots[i].topic) i = (i + 1) & (children->capacity - 1);
+	children->slots[i] = {hash, child};
+	children->count++;
 	return 0;
 }
 
-// function which polls the topic levels to see if any topics need to be created, and adds the lowest-level topics to the topic_structs vector
-// requires a pointer to a vector of topic levels, a pointer to a topic structs vetor, a pointer to the temporary topic map, a name which it would iteratively build, and a flag for whether or not to create topics
-int Server::poll_topics(std::vector<std::string>* levels, std::vector<topic_t*>* topic_structs, std::map<std::string, topic_t*>* cur_topics, std::string cur_name, int create) {
-	if (levels->at(0) == "+") { 																					// if the level is a wildcard, we need to iterate through all of the topics in the current level of the topic map
-		for (auto it : *cur_topics) { 
-			if (levels->size() == 1) topic_structs->push_back(it.second); 											// if the level is the last level in the topic, add the topic to the topic_structs vector
-			else { 																									// if the level is not the last level in the topic, recursively call poll_topics with the next level
-				std::vector<std::string>* temp_levels = new std::vector<std::string>(); 							// create a temporary vector of topic levels
-				for (unsigned long i = 1; i < levels->size(); i++) { 												// copy the remaining levels into the temporary vector
-					temp_levels->push_back(levels->at(i));
-				}
-				poll_topics(temp_levels, topic_structs, it.second->subtopics, cur_name + it.first + "/", create);	// recursively call poll_topics with the next level
-				delete temp_levels;
+// function which finds a child of a topic, creating it if it does not exist and the create flag is set
+// the lookup only needs a shared lock, the exclusive lock is taken just to insert and the lookup is repeated under it in case another thread won the race
+topic_t* Server::find_topic(topic_t* parent, std::string_view level, std::string_view name, int create) {
+	{
+		std::shared_lock<std::shared_mutex> read_lock(parent->lock);
+		topic_t* child = child_of(parent, level);
+		if (child) return child;
+	}
+	if (!create) return NULL;
+
+	std::unique_lock<std::shared_mutex> write_lock(parent->lock);
+	topic_t* child = child_of(parent, level);
+	if (child) return child;
+	topic_t* topic_struct = create_topic(name);
+	if (!topic_struct || add_child(parent, topic_struct, hash_level(level))) return NULL; // out of memory, the node stays in the arena unused
+	topic_struct->parent = parent;
+	return topic_struct;
+}
+
+// function which creates a topic if one is required
+// requires the full leveled name of the topic, which is interned in the arena alongside the node, the caller links it into the tree
+topic_t* Server::create_topic(std::string_view name) {
+	void* mem = arena->allocate(sizeof(topic_t), alignof(topic_t));
+	const char* interned = arena->intern(name.data(), name.size());
+	if (!mem || !interned) return NULL;
+	log_debug("Creating topic %s", interned);
+
+	topic_t* topic_struct = new (mem) topic_t;
+	topic_struct->name = interned;
+	topic_struct->name_len = name.size();
+	topic_struct->parent = NULL;
+	size_t slash = name.rfind('/');
+	topic_struct->level_off = slash == std::string_view::npos ? 0 : slash + 1;
+	check_topic(name, &topic_struct->wildcard); 							// filter nodes hold subscriptions but are never published to
+	topic_struct->retain.store(NULL);
+	topic_struct->stored.store(0);
+	topic_struct->stored_size = 0;
+	topic_struct->subscribers.store(NULL);
+	topic_struct->matched.store(NULL);
+	topic_struct->match_generation.store(0);
+	topic_struct->filter_generation.store(0);
+	topic_struct->matched_filters.store(0);
+	topic_struct->subtopics = {NULL, 0, 0};
+	ntopics++;
+	return topic_struct;
+}
+
+// function which frees a topic and everything below it
+// the node and its name stay in the arena, which is freed as a whole once the tree is gone
+int Server::free_topic(topic_t* topic) {
+	for (uint32_t i = 0; i < topic->subtopics.capacity; i++) {
+		if (topic->subtopics.slots[i].topic) free_topic(topic->subtopics.slots[i].topic);
+	}
+	free(topic->subtopics.slots);
+	Message* retain = topic->retain.load();
+	if (retain) retain->unref();
+	subscription_t* subscription = topic->subscribers.load(); 				// every connection is gone by now, so this should already be empty
+	while (subscription) {
+		subscription_t* next = subscription->next.load();
+		delete subscription;
+		subscription = next;
+	}
+	subscriber_list_t* matched = topic->matched.load();
+	if (matched != &no_subscribers) delete matched;
+	topic->~topic_t();
+	return 0;
+}
+
+// function which lists up to limit topics and filters from prefix down, a line each with the node's name, how many subscriptions
+// it has and the bytes of its retained message, "-" for none and "stored" for one still only in the store
+// nodes are listed depth first with each node's children in order of their level, so a listing can carry on after the last name
+// of the page before it; next is set to that name if the page filled up and cleared if the listing is done
+// children are copied out under the shared lock and everything else is read without one, so publishers are never held up
+// returns 1 if after is not below prefix
+int Server::list_tree(std::string_view prefix, std::string_view after, size_t limit, std::string* out, std::string* next) {
+	next->clear();
+	if (prefix.size() > 0 && prefix.back() == '/') prefix.remove_suffix(1);
+	if (after.size() > 0 && prefix.size() > 0 && (after.compare(0, prefix.size(), prefix) != 0 ||
+		(after.size() > prefix.size() && after[prefix.size()] != '/'))) return 1;
+	topic_t* start = prefix.size() > 0 ? resolve_topic(prefix, 0) : root;
+	if (!start) return 0; 												// nothing was ever published or subscribed there
+
+	EpochGuard guard; 													// subscriber lists and retained messages are read without a lock
+	std::vector<std::pair<topic_t*, int>> stack = {{start, after.size() > 0}}; 	// each node, and whether after is it or below it
+	std::vector<topic_t*> children;
+	std::string_view last;
+	size_t listed = 0;
+	while (stack.size() > 0) {
+		auto [topic, on_path] = stack.back();
+		stack.pop_back();
+		if (!on_path && topic != root) { 								// a node on the path to after was listed before it
+			if (listed == limit) {
+				*next = std::string(last);
+				return 0;
 			}
+			size_t subscriptions = 0;
+			for (subscription_t* it = topic->subscribers.load(std::memory_order_acquire); it; it = it->next.load(std::memory_order_acquire)) subscriptions++;
+			Message* retain = topic->retain.load(std::memory_order_acquire);
+			char counts[64];
+			if (retain) snprintf(counts, sizeof(counts), "\t%lu\t%lu\n", subscriptions, retain->get_msg_len());
+			else snprintf(counts, sizeof(counts), "\t%lu\t%s\n", subscriptions, topic->stored.load() ? "stored" : "-");
+			out->append(topic->name, topic->name_len);
+			out->append(counts);
+			last = std::string_view(topic->name, topic->name_len);
+			listed++;
 		}
-	}
-	else if (levels->at(0) == "#") { 																				// if the level is a wildcard, we need to iterate through all of the topics in the rest of the levels of the topic map
-		for (auto it : *cur_topics) {
-			topic_structs->push_back(it.second); 																	// add the topic to the topic_structs vector
-			poll_topics(levels, topic_structs, it.second->subtopics, cur_name + it.first + "/", create); 			// recursively call poll_topics with the next subtopics, keeping the wildcard as the last level
+
+		children.clear();
+		{
+			std::shared_lock<std::shared_mutex> read_lock(topic->lock);
+			for (uint32_t i = 0; i < topic->subtopics.capacity; i++) {
+				if (topic->subtopics.slots[i].topic) children.push_back(topic->subtopics.slots[i].topic);
+			}
 		}
-	}
-	else if (levels->size() > 1) { 																					// if the level is not a wildcard, and there are more levels, recursively call poll_topics with the next level
-		if (cur_topics->find(levels->at(0)) == cur_topics->end()) {
-			if (create) create_topic(cur_topics, levels->at(0), cur_name + levels->at(0)); 							// if the topic does not exist, create it if the create flag is set
-			else return 1; 																							// else, return as it does not exist and we cannot create it
+		std::sort(children.begin(), children.end(), [](topic_t* a, topic_t* b) { return level_of(a) > level_of(b); }); // the stack pops the lowest level first
+		std::string_view level; 										// the level of after below this node, if the node is on its path
+		if (on_path && (topic == root || topic->name_len < after.size())) {
+			size_t pos = topic == root ? 0 : topic->name_len + 1;
+			level = after.substr(pos, after.find('/', pos) - pos);
 		}
-		cur_topics = cur_topics->at(levels->at(0))->subtopics; 														// set the current topic map to the next level of the topic map
-		std::string new_name = cur_name + levels->at(0) + "/";
-		levels->erase(levels->begin());
-		poll_topics(levels, topic_structs, cur_topics, new_name, create); 											// recursively call poll_topics with the next level
-	}
-	else { 																											// if the level is not a wildcard, and there are no more levels, add the topic to the topic_structs vector
-		if (cur_topics->find(levels->at(0)) == cur_topics->end()) {
-			if (create) create_topic(cur_topics, levels->at(0), cur_name + levels->at(0)); 							// if the topic does not exist, create it if the create flag is set
-			else return 1; 																							// else, return as it does not exist and we cannot create it
+		else on_path = 0; 												// after is the node itself, every child comes after it
+		for (auto it : children) {
+			int cmp = on_path ? level_of(it).compare(level) : 1;
+			if (cmp >= 0) stack.push_back({it, cmp == 0}); 				// the ones before after's level were listed before it, and so was all below them
 		}
-		topic_structs->push_back(cur_topics->at(levels->at(0))); 													// add the topic to the topic_structs vector
 	}
-	
 	return 0;
 }
 
-// function which creates a topic if one is required
-// requires a pointer to the current topic map, the name of the topic to be used as the key, and the full leveled name of the topic to be stored for the client
-int Server::create_topic(std::map<std::string, topic_t*>* cur_topics, std::string topic, std::string name) {
-	printf("Creating topic %s\n", name.c_str());
-	topic_t* topic_struct = new topic_t;
-	topic_struct->name = strdup(name.c_str());
-	topic_struct->connections = new std::vector<Connection*>();
-	topic_struct->subtopics = new std::map<std::string, topic_t*>();
-	(*cur_topics)[topic] = topic_struct;
+// function which logs how much memory the topic tree takes, in total and scaled to a million topics
+// subscriber lists and retained messages are not counted, they depend on the clients rather than the number of topics
+int Server::memory_report() {
+	size_t topics = ntopics.load();
+	size_t used = arena->get_used();
+	size_t reserved = arena->get_reserved();
+	size_t tables = table_bytes.load();
+	size_t total = used + tables; 											// the reserved tail of the last chunk would skew small trees
+	log_info("Topic tree: %ld topics, %ld bytes of nodes and names (%ld reserved), %ld bytes of children tables", topics, used, reserved, tables);
+	if (topics > 0) log_info("Topic tree: %ld bytes per topic, %.1f MB per million topics", total / topics, (double) total / topics * 1000000 / (1024 * 1024));
 	return 0;
 }
 
-// function which recursively frees and deletes elements of a topic map
-int Server::free_topics(std::map<std::string, topic_t*>* topics) {
-	for (auto it = topics->begin(); it != topics->end(); it++) {
-		free_topics(it->second->subtopics);
-		free(it->second->name);
-		delete it->second->connections;
-		delete it->second;
+// function which increments the client count, refusing the client if the server is full
+int Server::add_client() {
+	if (nclients.fetch_add(1) >= MAXCLIENTS) {
+		nclients--;
+		return 1;
 	}
-	delete topics;
 	return 0;
 }
 
-// the loop which always runs (nonblocking) to check for new connections
-// this is run in a separate thread
-void Server::accept_loop(Server* server) {
-	printf("server: waiting for connections...\n");
+// function which creates one listening socket per shard, all bound to the same port with SO_REUSEPORT
+// the kernel then spreads incoming connections across the shards without any shared accept queue
+int Server::listen_on(const char* port, int nshards) {
+	struct sockaddr_in server_addr;
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_port = htons(atoi(port));
+	server_addr.sin_addr.s_addr = INADDR_ANY;
+
+	for (int i = 0; i < nshards; i++) {
+		int server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0); 			// create the shard's nonblocking listening socket
+		if (server_fd == -1) return 1;
 
-	struct sockaddr_in client_addr;
-	int client_fd;
-	while(!cleanup) { 																					// while the server is not being cleaned up
-		socklen_t clientsize = sizeof client_addr;
-		client_fd = accept(server->get_server_fd(), (struct sockaddr*) &client_addr, &clientsize);
-		if (client_fd == -1) continue; 																	// if the accept failed, continue. this happens most of the time as the socket is set to nonblocking
+		int yes = 1;
+		setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)); 		// set the socket to reuse the address (so we can restart the server without waiting for the port to be freed)
+		setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)); 		// let every shard bind the same port
 
-		fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) | O_NONBLOCK); 								// set the client socket to nonblocking
+		if (bind(server_fd, (struct sockaddr*) &server_addr, sizeof(server_addr))) { // bind the socket to the address
+			log_error("Failed to bind port %s: %s", port, strerror(errno));
+			close(server_fd);
+			return 1;
+		}
 
-		printf("Connection from %s:%d\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+		if (listen(server_fd, BACKLOG)) { 											// listen for connections with a backlog set by the BACKLOG constant
+			log_error("Failed to listen on port %s: %s", port, strerror(errno));
+			close(server_fd);
+			return 1;
+		}
 
-		if (server->create_connection(client_fd)) { 													// if the connection object could not be created, close the socket
-			char buf[PACKET_SIZE] = {};
-			snprintf(buf, PACKET_SIZE, "Cannot join server, please try again later\n");
-			write(client_fd, buf, PACKET_SIZE);
-			close(client_fd);
-		};
+		shards->push_back(new Shard(i, server_fd, this));
 	}
+	return 0;
+}
+
+// function which runs every shard on its own thread until a signal sets the cleanup flag
+int Server::run() {
+	log_info("Waiting for connections on %ld shard%s", shards->size(), shards->size() == 1 ? "" : "s");
+
+	metrics->start(); 														// the shards' counters exist now, they are sampled from here on
+	if (cluster) cluster->start(); 											// and there are shards to hand what the links deliver to
+	for (auto it : *shards) it->start();
+	for (auto it : *shards) it->join();
+	return 0;
 }
 
-Server::Server(int server_fd) {
-	this->accept_thread = new std::thread(accept_loop, this); 											// create the accept thread
-	this->server_fd = server_fd;
+Server::Server(size_t max_payload, size_t queue_budget, int queue_policy, uint64_t flush_delay, uint32_t inflight_window, int keepalive, int backend) {
+	this->max_payload = max_payload;
+	this->queue_budget = queue_budget;
+	this->queue_policy = queue_policy;
+	this->flush_delay = flush_delay;
+	this->inflight_window = inflight_window;
+	this->keepalive = keepalive;
+	this->backend = backend;
+	nclients.store(0);
+	connection_ids.store(0);
+	ntopics.store(0);
+	table_bytes.store(0);
+	store_stop.store(0);
+	root = create_topic("");
+	root->filter_generation.store(1); 									// every sum includes the root's, so a new topic's matched_filters of 0 is stale from the start
+	snapshot_pool = new SnapshotPool(SnapshotPool::default_threads());
 }
 
 Server::~Server() {
-	accept_thread->join(); 																				// wait for the accept thread to finish
-	delete accept_thread;
-	if (connections->size() > 0) { 																		// if there are still connections, close them
-		for (auto it = connections->begin(); it != connections->end();){
-			Connection* conn = it->second;
-			if (!conn->get_cleanup()) conn->disconnect_client(); 										// if the connection is not already being cleaned up, disconnect the client
-			printf("Client %d disconnected\n", conn->get_client_fd());
-			delete conn;
-			it = connections->erase(it);
-		}
+	delete metrics; 														// it publishes to the shards' inboxes, so it stops before them
+	if (cluster) cluster->stop(); 											// so do the links, though the shards drop their interest as they close
+	delete snapshot_pool; 													// the workers may still wake shards, so they go first
+	for (auto it : *shards) delete it; 										// shards close their remaining connections, which unsubscribes them from the tree
+	delete shards;
+
+	if (store) { 															// index the store on the way out, so the next start has nothing to replay
+		store_stop.store(1);
+		store_thread->join();
+		delete store_thread;
+		write_retained_index();
+		delete store;
 	}
 
-	free_topics(topics);
+	delete sessions; 														// the shards ended every session as they closed their connections
+	delete cluster;
+	memory_report();
+	free_topic(root);
+	Epoch::reclaim_all(); 													// every shard has stopped, so nothing retired can still be in use
+	delete arena;
+}
 
-	delete connections;
+// function which lets the server have as many descriptors as the system allows it, the default soft limit is far below MAXCLIENTS
+static int raise_fd_limit() {
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit)) return 1;
+	limit.rlim_cur = limit.rlim_max;
+	return setrlimit(RLIMIT_NOFILE, &limit);
 }
 
-// main function, which runs main server loop
+// main function, which sets up the shards and runs them until shut down
 int main(int argc, char* argv[]) {
 	
-    if(argc < 2){
-        printf("Correct usage:\n./server <port>\n");
+	size_t max_payload = MAX_PAYLOAD;
+	size_t queue_budget = QUEUE_BUDGET;
+	int queue_policy = POLICY_DROP_OLDEST;
+	uint64_t flush_delay = 0;
+	uint32_t inflight_window = INFLIGHT_WINDOW;
+	int keepalive = KEEPALIVE;
+	int backend = BACKEND_EPOLL;
+	int session_expiry = SESSION_EXPIRY;
+	const char* offline_dir = NULL;
+	size_t offline_budget = OFFLINE_BUDGET;
+	const char* retain_dir = NULL;
+	const char* stats_port = NULL;
+	const char* peers = NULL;
+	int log_level = LOG_INFO;
+	int opt;
+	while ((opt = getopt(argc, argv, "m:q:p:d:r:l:s:i:e:o:b:k:u:c:")) != -1) { 							// options may come before or after the positional arguments
+		switch (opt) {
+			case 'm': max_payload = strtoul(optarg, NULL, 10); break; 				// the largest framed message a client may send
+			case 'q': queue_budget = strtoul(optarg, NULL, 10); break; 			// the most bytes a client may have queued before the policy applies
+			case 'p': 																// what to do with a client over its budget
+				queue_policy = -1;
+				for (int i = 0; i < POLICY_COUNT; i++) {
+					if (strcmp(optarg, policy_names[i]) == 0) queue_policy = i;
+				}
+				if (queue_policy != -1) break;
+				printf("Unknown policy %s, expected drop-oldest, drop-newest or disconnect\n", optarg);
+				return 1;
+			case 'd': flush_delay = strtoull(optarg, NULL, 10); break; 			// how long output may wait to be coalesced with more, off by default
+			case 'r': retain_dir = optarg; break; 									// where to keep retained messages across restarts, in memory only by default
+			case 'l': 																// the least severe records to log, info by default
+				log_level = Log::parse_level(optarg);
+				if (log_level != -1) break;
+				printf("Unknown log level %s, expected debug, info, warn or error\n", optarg);
+				return 1;
+			case 's': stats_port = optarg; break; 									// serve the metrics as text on this port of the loopback interface, off by default
+			case 'i': 																// how many QoS 1 deliveries a client may have unacked
+				inflight_window = strtoul(optarg, NULL, 10);
+				if (inflight_window > 0 && inflight_window <= MAX_INFLIGHT && (inflight_window & (inflight_window - 1)) == 0) break;
+				printf("Inflight window %s must be a power of two no more than %d\n", optarg, MAX_INFLIGHT);
+				return 1;
+			case 'e': session_expiry = atoi(optarg); break; 						// how long a session outlives its client's connection, 0 for no sessions
+			case 'o': offline_dir = optarg; break; 									// where offline queues spill once they outgrow memory, in memory only by default
+			case 'b': offline_budget = strtoul(optarg, NULL, 10); break; 			// the most bytes queued for one session while its client is away
+			case 'k': keepalive = atoi(optarg); break; 								// how long a framed client may be silent before it is pinged, 0 to never ping
+			case 'u': 																// how the shards wait for I/O, epoll by default
+				backend = -1;
+				for (int i = 0; i < BACKEND_COUNT; i++) {
+					if (strcmp(optarg, backend_names[i]) == 0) backend = i;
+				}
+				if (backend != -1) break;
+				printf("Unknown backend %s, expected epoll or io_uring\n", optarg);
+				return 1;
+			case 'c': peers = optarg; break; 										// the other nodes of the cluster, this node runs on its own by default
+			default:
+				printf("Correct usage:\n%s\n", USAGE);
+				return 1;
+		}
+	}
+
+    if(argc - optind < 1){
+        printf("Correct usage:\n%s\n", USAGE);
 		return 1;
     }
-	const char* port = argv[1];
+	const char* port = argv[optind];
+
+	int nshards = std::thread::hardware_concurrency(); 								// default to one shard per core
+	if (argc - optind >= 2) nshards = atoi(argv[optind + 1]);
+	if (nshards < 1) nshards = 1;
 
-	printf("Setting up server on port %s\n", port);
+	Log::set_level(log_level);
+	Log::set_thread_name("main");
+	Log::start(); 																	// from here on every thread logs through its ring
+	if (backend == BACKEND_URING && !IoUring::supported()) { 						// the kernel is too old, or io_uring is disabled
+		log_warn("io_uring is not available, using epoll");
+		backend = BACKEND_EPOLL;
+	}
+	log_info("Setting up server on port %s with %d thread%s using %s", port, nshards, nshards == 1 ? "" : "s", backend_names[backend]);
+	if (nshards > MAXCLIENTS) {
+		log_error("Cannot run %d shards, at most %d can be run", nshards, MAXCLIENTS);
+		Log::stop();
+		return 1;
+	}
+	if (Epoch::reserve(nshards + SnapshotPool::default_threads() + EPOCH_SPARE_THREADS)) { // every thread reading the topic tree takes a slot for good
+		log_error("Could not reserve epoch slots for %d shards", nshards);
+		Log::stop();
+		return 1;
+	}
 	
 	// set up server to catch SIGINT and SIGTERM signals
 	struct sigaction my_sa = {};
@@ -344,48 +1067,18 @@ int main(int argc, char* argv[]) {
 	my_sa.sa_handler = sig_handler;
 	sigaction(SIGINT, &my_sa, NULL);
 	sigaction(SIGTERM, &my_sa, NULL);
+	sigaction(SIGUSR1, &my_sa, NULL);
+	signal(SIGPIPE, SIG_IGN); 														// a client hanging up mid-write should surface as EPIPE, not kill the server
+	if (raise_fd_limit()) log_warn("Could not raise the descriptor limit, the server may run out before MAXCLIENTS");
 
-	int server_fd = socket(AF_INET, SOCK_STREAM, 0); 								// create the server socket
-	if (server_fd == -1) return 1;
-
-	fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) | O_NONBLOCK); 				// set the server socket to nonblocking
-
-	struct sockaddr_in server_addr;
-	server_addr.sin_family = AF_INET;
-	server_addr.sin_port = htons(atoi(port));
-	server_addr.sin_addr.s_addr = INADDR_ANY;
-
-	int yes = 1;
-	setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)); 			// set the socket to reuse the address (so we can restart the server without waiting for the port to be freed)
-
-	if (bind(server_fd, (struct sockaddr*) &server_addr, sizeof(server_addr))) { 	// bind the socket to the address
-		printf("failed to bind\n");
-		close(server_fd);
-		return 1;
-	}
-	
-	if (listen(server_fd, BACKLOG)) { 												// listen for connections with a backlog set by the BACKLOG constant
-		printf("failed to listen\n");
-		return 1;
-	}
-
-	server = new Server(server_fd); 												// create the server object
-	
-	while(!cleanup) {                                                              	// while the server is not being cleaned up, this is the main loop which acts as a garbage collector for connections
-		for (auto it = server->get_connections()->begin(); it != server->get_connections()->end();) {
-			int fd = it->first;
-			Connection* conn = it->second;
-			if (conn->get_cleanup()) {
-				printf("Client %d disconnected\n", fd);
-				delete conn;
-				it = server->get_connections()->erase(it);
-				printf("New number of connections: %ld\n", server->get_connections()->size());
-			}
-			else it++;
-		}
-	}
+	server = new Server(max_payload, queue_budget, queue_policy, flush_delay, inflight_window, keepalive, backend); 	// create the server object
+	int failed = server->configure_sessions(session_expiry, offline_dir, offline_budget) ||
+		(retain_dir && server->open_store(retain_dir)) || (peers && server->join_cluster(peers, port)) || server->listen_on(port, nshards) ||
+		(stats_port && server->get_metrics()->listen_stats(stats_port));
+	if (!failed) server->run(); 													// run the shards until we are told to shut down
 
 	delete server;
+	Log::stop(); 																	// write out whatever the threads logged on the way down
 
-	return 0;
-}
\ No newline at end of file
+	return failed;
+}
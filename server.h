@@ -13,52 +13,236 @@
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <fcntl.h>
+#include <time.h>
+#include <algorithm>
+#include <atomic>
 #include <map>
+#include <mutex>
+#include <shared_mutex>
 #include <string>
-#include <vector>
+#include <string_view>
 #include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
+#include "arena.h"
+#include "cluster.h"
 #include "connection.h"
+#include "epoch.h"
+#include "frame.h"
+#include "inflight.h"
+#include "log.h"
+#include "message.h"
+#include "metrics.h"
+#include "offline.h"
 #include "payload.h"
+#include "reactor.h"
+#include "shard.h"
+#include "snapshot.h"
+#include "store.h"
+
+#define BACKLOG 1024                  // how many pending connections queue will hold, a benchmark connects thousands at once
+#define MAXCLIENTS 16384              // max number of clients accepted, the descriptor limit is raised to allow it
+#define CONN_TIMEOUT 1                // seconds a client has to send CONN after connecting
+#define DISC_TIMEOUT 1                // seconds clients have to send DISC_ACK when the server shuts down
+#define EPOCH_SPARE_THREADS 16        // epoch slots kept for the threads besides the shards and the snapshot pool, main, metrics, store and cluster
+#define KEEPALIVE 60                  // default seconds a framed client may be silent before it is pinged, and then before it is closed, 0 for never
+#define USAGE "./server <port> [threads] [-m max_payload] [-q queue_budget] [-p drop-oldest|drop-newest|disconnect] [-d flush_delay_usec] [-r retain_dir] [-l debug|info|warn|error] [-s stats_port] [-i inflight_window] [-e session_expiry_sec] [-o offline_dir] [-b offline_budget] [-k keepalive_sec] [-u epoll|io_uring] [-c host:port,...]"
 
-#define BACKLOG 16	                  // how many pending connections queue will hold
-#define MAXCLIENTS 128                // max number of clients accepted
+extern volatile sig_atomic_t cleanup;     // set by the signal handler, every shard checks it to know when to shut down
+extern volatile sig_atomic_t report_memory; // set by SIGUSR1, the first shard prints the topic tree's memory footprint and clears it
 
 int main(int argc, char* argv[]);
 
 class Connection;
+class Shard;
+
+// subscriber struct, a topic's record of one subscribed connection
+// the shard, fd and id are copied in so a publisher never has to dereference a connection owned by another shard
+typedef struct subscriber {
+    Connection* connection;
+    Shard* shard;
+    int fd;
+    int qos;                                        // 1 to be sent QoS 1 publishes at QoS 1, under packet ids the client acks
+    int peer;                                       // 1 for another node's cluster link, which is only sent what was published on this node
+    uint64_t id;
+} subscriber_t;
+
+typedef std::vector<subscriber_t> subscriber_list_t;
+
+// where a client's session lives, the shard and the id of the connection holding it
+typedef struct session_owner {
+    Shard* shard;
+    uint64_t id;
+} session_owner_t;
+
+struct topic;
+
+// inbox items a batch holds back for one shard, linked newest first so the whole chain goes onto the inbox with one push
+typedef struct held_items {
+    inbox_item_t* newest = NULL;
+    inbox_item_t* oldest = NULL;
+} held_items_t;
+
+// a publish on its way through the tree, the message is a view into whatever request or link it arrived on
+typedef struct publish {
+    uint8_t op;                                     // OP_PUB or OP_PUBRET, what subscribers are sent
+    std::string_view msg;
+    int qos;
+    int retain;
+    int forward;                                    // other nodes' links are sent it too, set for publishes from this node's own clients
+    Shard* origin;                                  // the shard it arrived on, which counts and times it, NULL for the server's own and forwarded ones
+    std::vector<held_items_t>* held = NULL;         // per shard, where a batch holds its inbox items, NULL to post each straight away
+} publish_t;
+
+// subscription struct, one connection's subscription to one topic or filter, linked into both the topic's and the connection's lists
+// publishers walk the topic's list without a lock while it changes, so a handle is unlinked under the topic's lock with its own
+// next left intact for anyone still standing on it, and retired through the epoch; the connection's links are only touched by its shard
+// with both links and the connection's index, subscribing, unsubscribing and tearing a connection down are O(1) per subscription
+typedef struct subscription {
+    std::atomic<struct subscription*> next;         // the topic's list, read by publishers
+    struct subscription* prev;                      // the topic's list, only used under the topic's lock
+    struct subscription* conn_next;                 // the connection's list, in the order it subscribed
+    struct subscription* conn_prev;
+    struct topic* topic;
+    subscriber_t subscriber;
+} subscription_t;
+
+// a child in a topic's children table, the hash of the child's level is kept so most probes never touch the child
+typedef struct topic_slot {
+    uint32_t hash;
+    struct topic* topic;                            // NULL for an empty slot
+} topic_slot_t;
+
+// a topic's children, an open-addressing hash table keyed by level with linear probing
+// a leaf, which most topics are, has no table at all, and a child's level is a view into its own interned name rather than a copy
+typedef struct topic_children {
+    topic_slot_t* slots;                            // NULL until the first child is added
+    uint32_t capacity;                              // a power of two
+    uint32_t count;
+} topic_children_t;
 
-// topic struct used to store topic name, retained message, list of connections subscribed to it, and a map of sub-topics
+// topic struct used to store topic name, retained message, list of connections subscribed to it, and a table of sub-topics
+// a subscription with + or # levels is stored as a node of its own, named with the wildcards, and matched at publish time
+// nodes and their names are allocated from the server's arena, and the name is interned: connections keep pointers to it, not copies
+// the retained message is kept already encoded as the PUBRET that published it, so a new subscriber is sent a reference to it
+// publishers read the retained message and the matched set without locking: writers swap the pointer and retire the old one
+// through the epoch, so a publisher always sees one complete version, any publisher may build the matched set, a SUB or UNSUB
+// on the topic drops it and one on a filter makes the sets below the filter's wildcard-free prefix stale; the subscription list is
+// linked and unlinked in place under the exclusive lock
 typedef struct topic {
-    char* name;
-    char* retain;
-    std::vector<Connection*>* connections;
-    std::map<std::string, struct topic*>* subtopics;
+    const char* name;                               // the full name, interned in the arena
+    struct topic* parent;                           // NULL for the root
+    uint32_t name_len;
+    uint32_t level_off;                             // where the last level starts in name, the child table is keyed by it
+    std::atomic<Message*> retain;                   // NULL until a PUBRET or, with a store, until a subscriber first needs it loaded
+    std::atomic<uint64_t> stored;                   // location of the topic's latest retained record in the store, 0 for none
+    uint64_t stored_size;                           // bytes of that record, header included, changed along with stored under the exclusive lock
+    std::atomic<subscription_t*> subscribers;       // the head of the topic's list of subscriptions, NULL while nobody is subscribed
+    std::atomic<subscriber_list_t*> matched;        // cached union of the subscribers of this topic and every filter matching it, NULL until a publish builds it
+    std::atomic<uint32_t> match_generation;         // bumped whenever matched is invalidated, so a set built from stale lists is not cached
+    std::atomic<uint32_t> filter_generation;        // bumped by every SUB or UNSUB on a filter whose levels before its first wildcard name this topic
+    std::atomic<uint32_t> matched_filters;          // the sum of the filter generations of the topic and its ancestors matched was built at, stale once it moves
+    int wildcard;                                   // set for filter nodes, which have subscribers but are never published to or retained on
+    std::shared_mutex lock;                         // shared to look up children, exclusive to add a child or swap in a new subscriber list or stored record
+    topic_children_t subtopics;
 } topic_t;
 
 // Server class
+// the server owns the shards and the topic tree they all share
 class Server {
     private:
-        int server_fd;
-        std::map<int, Connection*>* connections = new std::map<int, Connection*>();
-        std::map<std::string, topic_t*>* topics = new std::map<std::string, topic_t*>();
-        std::thread* accept_thread;
-        int analyze_topic(std::string topic, std::vector<std::string>* levels);
-        int poll_topics(std::vector<std::string>* levels, std::vector<topic_t*>* topic_structs, std::map<std::string, topic_t*>* cur_topics, std::string cur_name, int create);
-        int create_topic(std::map<std::string, topic_t*>* cur_topics, std::string topic, std::string name);
-        int free_topics(std::map<std::string, topic_t*>* topics);
-        static void accept_loop(Server* server);
+        std::vector<Shard*>* shards = new std::vector<Shard*>();
+        topic_t* root;                              // the root of the topic tree, it has no name and nobody subscribes to it
+        Arena* arena = new Arena();                 // holds every topic node and name until the server is deleted
+        std::atomic<size_t> ntopics;
+        std::atomic<size_t> table_bytes;            // bytes in children tables, which live outside the arena as they are resized
+        std::atomic<int> nclients;
+        std::atomic<uint64_t> connection_ids;
+        int check_topic(std::string_view topic, int* wildcard);
+        int match_topic(topic_t* parent, std::string_view topic, std::vector<subscription_t*>* lists);
+        int expand_topic(topic_t* parent, std::string_view filter, std::vector<topic_t*>* topic_structs);
+        topic_t* find_topic(topic_t* parent, std::string_view level, std::string_view name, int create);
+        topic_t* create_topic(std::string_view name);
+        int add_child(topic_t* parent, topic_t* child, uint32_t hash);
+        int free_topic(topic_t* topic);
+        int route_message(Message* message, subscriber_list_t* subscribers, publish_t* publish);
+        uint32_t filter_generations(topic_t* topic);
+        subscriber_list_t* match_subscribers(topic_t* topic);
+        int invalidate_matches(topic_t* topic_struct);
+        int publish_to_topic(topic_t* topic, publish_t* publish);
+        int publish_named(std::string_view name, publish_t* publish);
+        RetainStore* store = NULL;                  // NULL unless the server was given a directory to keep retained messages in
+        std::shared_mutex persist_lock;             // shared to append a retained message and record its location, exclusive to move one or take the high-water mark
+        std::thread* store_thread = NULL;           // syncs, indexes and compacts the store in the background
+        std::atomic<int> store_stop;
+        SnapshotPool* snapshot_pool;                // walks the retained messages for big filter subscriptions
+        Metrics* metrics = new Metrics(this);       // samples the shards' counters into $SYS and the stats endpoint
+        int persist_retained(topic_t* topic, Message* message);
+        int restore_retained(std::string_view topic, uint64_t location, uint64_t size, uint64_t* live);
+        int for_each_topic(topic_t* parent, int (*fn)(Server* server, topic_t* topic, void* ctx), void* ctx);
+        int write_retained_index();
+        int compact_retained();
+        static void store_loop(Server* server);
+        size_t max_payload;
+        size_t queue_budget;
+        int queue_policy;
+        uint64_t flush_delay;
+        uint32_t inflight_window;
+        int keepalive;
+        int backend;                                // how the shards' reactors wait for I/O
+        std::mutex session_lock;                    // guards the session registry, taken once per CONN that names a session and once when one ends
+        std::unordered_map<std::string, session_owner_t>* sessions = new std::unordered_map<std::string, session_owner_t>(); // every session by client id
+        int session_expiry = SESSION_EXPIRY;
+        const char* offline_dir = NULL;             // where offline queues spill, NULL to keep them in memory
+        size_t offline_budget = OFFLINE_BUDGET;
+        Cluster* cluster = NULL;                    // NULL unless the server was given peers to link to
 
     public:
-        Server(int server_fd);
+        Server(size_t max_payload, size_t queue_budget, int queue_policy, uint64_t flush_delay, uint32_t inflight_window, int keepalive, int backend);
         ~Server();
-        int create_connection(int client_fd);
-        int subscribe_to_topic(int client_fd, char* topic);
-        int unsubscribe_from_topic(int client_fd, char* topic);
-        int publish_message(payload_t* payload, int retain);
-        int get_server_fd() { return server_fd; }
-        std::map<int, Connection*>* get_connections() { return connections; }
+        int open_store(const char* dir);
+        int configure_sessions(int expiry, const char* offline_dir, size_t offline_budget);
+        int join_cluster(const char* peers, const char* port);
+        int claim_session(const std::string& client_id, Shard* shard, uint64_t id, uint64_t stale, session_owner_t* owner);
+        int end_session(const std::string& client_id, Shard* shard, uint64_t id);
+        int listen_on(const char* port, int nshards);
+        int run();
+        int add_client();
+        void remove_client() { nclients--; }
+        uint64_t next_connection_id() { return connection_ids++; }
+        int subscribe_to_topic(Connection* connection, const char* topic, int qos);
+        int unsubscribe_from_topic(Connection* connection, const char* topic);
+        int remove_subscription(subscription_t* subscription);
+        int publish_message(frame_t* frame, int retain, Shard* origin);
+        int publish_batch(frame_t* frame, int retain, Shard* origin);
+        topic_t* resolve_topic(std::string_view topic, int create);
+        topic_t* child_of(topic_t* parent, std::string_view level);
+        Message* load_retained(topic_t* topic);
+        int publish_sys(std::string_view topic, std::string_view msg);
+        int publish_forwarded(std::string_view topic, std::string_view msg, int retain, int qos, int snapshot);
+        int memory_report();
+        int list_tree(std::string_view prefix, std::string_view after, size_t limit, std::string* out, std::string* next);
+        size_t get_max_payload() { return max_payload; }
+        size_t get_queue_budget() { return queue_budget; }
+        int get_queue_policy() { return queue_policy; }
+        uint64_t get_flush_delay() { return flush_delay; }
+        uint32_t get_inflight_window() { return inflight_window; }
+        int get_keepalive() { return keepalive; }
+        int get_backend() { return backend; }
+        int get_session_expiry() { return session_expiry; }
+        const char* get_offline_dir() { return offline_dir; }
+        size_t get_offline_budget() { return offline_budget; }
+        std::vector<Shard*>* get_shards() { return shards; }
+        Metrics* get_metrics() { return metrics; }
+        Cluster* get_cluster() { return cluster; }
+        int get_client_count() { return nclients.load(); }
+        size_t get_topic_count() { return ntopics.load(); }
+        topic_t* get_root() { return root; }
+        SnapshotPool* get_snapshot_pool() { return snapshot_pool; }
 };
 
 #endif
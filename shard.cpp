@@ -0,0 +1,572 @@
+#include "shard.h"
+#include "server.h"
+#include "connection.h"
+#include "snapshot.h"
+
+// function to push a delivery onto the inbox, this can be called from any thread
+// the stack is drained all at once by the owner, which reverses it back into push order
+int Inbox::push(inbox_item_t* item) {
+    return push(item, item);
+}
+
+// function to push a chain of deliveries onto the inbox with one exchange, linked through next from the newest to the oldest,
+// as pushing them one at a time would have left them, this can be called from any thread
+int Inbox::push(inbox_item_t* newest, inbox_item_t* oldest) {
+    inbox_item_t* old_head = head.load(std::memory_order_relaxed);
+    do {
+        oldest->next = old_head;
+    } while (!head.compare_exchange_weak(old_head, newest, std::memory_order_release, std::memory_order_relaxed));
+
+    return wake();
+}
+
+// function which wakes the shard's reactor, this can be called from any thread
+// only the first wakeup since the last drain writes to the eventfd, so a burst of pushes costs one write
+int Inbox::wake() {
+    if (notified.exchange(1, std::memory_order_acq_rel) == 0) {
+        uint64_t one = 1;
+        if (write(event_fd, &one, sizeof(one)) != sizeof(one)) return 1;
+    }
+    return 0;
+}
+
+// function which takes every pending item off the inbox, oldest first
+// only the owning shard calls this, so taking the whole stack with one exchange is safe from ABA
+inbox_item_t* Inbox::pop_all() {
+    notified.store(0, std::memory_order_release);                       // clear before taking the stack so a racing push always re-arms the eventfd
+    inbox_item_t* item = head.exchange(NULL, std::memory_order_acquire);
+    inbox_item_t* reversed = NULL;
+    while (item) {
+        inbox_item_t* next = item->next;
+        item->next = reversed;
+        reversed = item;
+        item = next;
+    }
+    return reversed;
+}
+
+// function called by the reactor when another shard has posted deliveries to this one
+int Inbox::handle_readable() {
+    uint64_t count;
+    read(event_fd, &count, sizeof(count));                              // reset the eventfd counter, the value itself does not matter
+
+    inbox_item_t* item = pop_all();
+    while (item) {
+        inbox_item_t* next = item->next;
+        if (item->handoff) shard->take_session(item->handoff);         // a client resuming a session this shard holds
+        else {
+            shard->deliver(item->message, item->targets);
+            item->message->unref();
+            delete item->targets;
+        }
+        delete item;
+        item = next;
+    }
+    return 0;
+}
+
+// the eventfd is only ever watched for reading
+int Inbox::handle_writable() {
+    return 0;
+}
+
+// an eventfd cannot hang up
+int Inbox::handle_hangup() {
+    return 0;
+}
+
+Inbox::Inbox(Shard* shard) {
+    this->shard = shard;
+    this->head.store(NULL);
+    this->notified.store(0);
+    this->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd == -1) log_error("Failed to create inbox eventfd: %s", strerror(errno));
+}
+
+Inbox::~Inbox() {
+    inbox_item_t* item = pop_all();                                     // free anything posted after the shard stopped draining
+    while (item) {
+        inbox_item_t* next = item->next;
+        if (item->handoff) {
+            close(item->handoff->fd);
+            delete item->handoff;
+        }
+        else {
+            item->message->unref();
+            delete item->targets;
+        }
+        delete item;
+        item = next;
+    }
+    if (event_fd != -1) close(event_fd);
+}
+
+// function which handles the connecting client
+// registers the client's socket with this shard's reactor, the CONN handshake is then handled by the connection itself
+int Shard::create_connection(int client_fd) {
+    if (server->add_client()) {                                         // if we have reached the max number of clients
+        log_warn("Reached maximum connections, dropping client %d", client_fd);
+        return 1;
+    }
+
+    Connection* connection = new Connection(client_fd, server->next_connection_id(), this);
+    if (reactor->receive_on(client_fd, connection, 0)) {                // start watching the client's socket, one recv at a time until it has sent CONN
+        delete connection;
+        server->remove_client();
+        return 1;
+    }
+    connections->insert(std::pair<int, Connection*>(client_fd, connection)); // add new client to connections map
+
+    log_info("Number of connections on shard %d: %ld", id, connections->size());
+
+    return 0;
+}
+
+// function which takes a connection out of the flush list, so the list is not left with a dangling pointer
+int Shard::unschedule_flush(Connection* connection) {
+    if (!connection->get_flush_scheduled()) return 0;
+    for (unsigned long i = 0; i < to_flush->size(); i++) {
+        if (to_flush->at(i) == connection) {
+            to_flush->erase(to_flush->begin() + i);
+            break;
+        }
+    }
+    connection->set_flush_scheduled(0);
+    return 0;
+}
+
+// function which stops streaming retained messages to a connection
+int Shard::cancel_snapshots(Connection* connection) {
+    for (unsigned long i = 0; i < snapshots->size() && connection->get_snapshots() > 0;) {
+        Snapshot* snapshot = snapshots->at(i);
+        if (snapshot->get_connection() != connection) {
+            i++;
+            continue;
+        }
+        snapshot->cancel();
+        snapshot->unref();
+        snapshots->erase(snapshots->begin() + i);
+        connection->set_snapshots(connection->get_snapshots() - 1);
+    }
+    return 0;
+}
+
+// function which removes a connection from the reactor and from every topic it is subscribed to, then deletes it
+// a session goes with it, this is how a session ends, whether or not it still has a socket
+int Shard::remove_connection(Connection* connection) {
+    int fd = connection->get_client_fd();
+    if (fd != -1) {
+        connection->flush();                                            // best effort, so a final DISC_ACK still reaches the client
+        unschedule_flush(connection);
+        reactor->remove_fd(fd);
+    }
+    cancel_snapshots(connection);
+
+    while (connection->get_subscriptions()) {                           // unsubscribe from every topic, so no topic is left holding a pointer to this connection
+        server->remove_subscription(connection->get_subscriptions());
+    }
+
+    if (fd != -1) {
+        connections->erase(fd);
+        server->remove_client();
+    }
+    if (connection->get_session()) {
+        sessions->erase(connection->get_id());
+        server->end_session(connection->get_client_id(), this, connection->get_id());
+    }
+    delete connection;
+    return 0;
+}
+
+// function which takes the socket away from a session whose client went away, the session keeps its subscriptions and queues
+// what is published to them until the client resumes it or it expires
+int Shard::detach_connection(Connection* connection) {
+    int fd = connection->get_client_fd();
+    connection->flush();                                                // best effort, so a final DISC_ACK still reaches the client
+    unschedule_flush(connection);
+    reactor->remove_fd(fd);
+    cancel_snapshots(connection);                                       // the client asks for retained messages again when it resubscribes
+    connections->erase(fd);
+    connection->detach();
+    server->remove_client();
+    log_info("Client %d went away, keeping session %s for %d seconds", fd, connection->get_client_id().c_str(), server->get_session_expiry());
+    return 0;
+}
+
+// function which ends a session whose client has been away for the session expiry, called from the session's timer
+int Shard::expire_session(Connection* connection) {
+    log_info("Session %s expired", connection->get_client_id().c_str());
+    return remove_connection(connection);
+}
+
+// function which finds or starts the session a client named in its CONN, the client has already been marked connected
+// a new session stays on this shard and is acked straight away, an existing one keeps its shard, so the client's socket and
+// whatever it sent after its CONN are handed to the shard holding it, through that shard's inbox
+// returns 0 if the connection holds the session here, 1 if it gave its socket away and must stop reading
+int Shard::open_session(Connection* connection, const std::string& client_id, int clean) {
+    session_owner_t owner;
+    if (server->claim_session(client_id, this, connection->get_id(), connection->get_id(), &owner) == 0) { // nothing is registered under this connection yet, so nothing is stale
+        connection->start_session(client_id);
+        sessions->insert(std::pair<uint64_t, Connection*>(connection->get_id(), connection));
+        connection->send_conn_ack(0);
+        return 0;
+    }
+
+    session_handoff_t* handoff = new session_handoff_t;
+    handoff->version = connection->get_version();
+    handoff->clean = clean;
+    handoff->session = owner.id;
+    handoff->client_id = client_id;
+    handoff->input = connection->take_input();
+    int fd = connection->get_client_fd();
+    unschedule_flush(connection);
+    reactor->remove_fd(fd);
+    connections->erase(fd);
+    handoff->fd = connection->release_socket();                         // the socket keeps its place in the client count
+    released->push_back(connection);
+    log_info("Client %d resuming session %s on shard %d", fd, client_id.c_str(), owner.shard->get_id());
+
+    inbox_item_t* item = new inbox_item_t;
+    item->message = NULL;
+    item->targets = NULL;
+    item->handoff = handoff;
+    owner.shard->post(item);
+    return 1;
+}
+
+// function which gives a session this shard holds the socket of a client resuming it
+// if the session still has a socket, the new one takes over from it, and if the session ended while the socket was on its way,
+// a new one is started here, unless the client has started one somewhere else since, in which case the socket is passed on again
+int Shard::take_session(session_handoff_t* handoff) {
+    auto it = sessions->find(handoff->session);
+    Connection* connection = it == sessions->end() ? NULL : it->second;
+    int present = 1;
+    if (!connection) {
+        uint64_t id = server->next_connection_id();
+        session_owner_t owner;
+        if (server->claim_session(handoff->client_id, this, id, handoff->session, &owner)) {
+            handoff->session = owner.id;
+            inbox_item_t* item = new inbox_item_t;
+            item->message = NULL;
+            item->targets = NULL;
+            item->handoff = handoff;
+            owner.shard->post(item);
+            return 0;
+        }
+        connection = new Connection(handoff->fd, id, this);
+        connection->start_session(handoff->client_id);
+        sessions->insert(std::pair<uint64_t, Connection*>(id, connection));
+        present = 0;
+    }
+    else {
+        if (connection->get_client_fd() != -1) {                        // the session's client connected again without the old socket noticing
+            log_info("Client %d takes session %s over from client %d", handoff->fd, handoff->client_id.c_str(), connection->get_client_fd());
+            detach_connection(connection);
+        }
+        if (handoff->clean) {
+            connection->reset_session();
+            present = 0;
+        }
+    }
+
+    connections->insert(std::pair<int, Connection*>(handoff->fd, connection));
+    if (reactor->receive_on(handoff->fd, connection, 1)) connection->handle_hangup(); // reaped, and detached again, after this iteration
+    connection->attach(handoff->fd, handoff->version, handoff->input, present);
+    delete handoff;
+    return 0;
+}
+
+// function which deletes every connection that has finished, including those whose timer gave up on them
+// this runs after every reactor iteration, so no handler is ever deleted while the reactor is still dispatching to it,
+// and as it goes through every connection anyway it also totals up what they have queued for the metrics
+int Shard::reap_connections() {
+    size_t queued_bytes = 0;
+    size_t queued_messages = 0;
+    for (auto it = connections->begin(); it != connections->end();) {
+        int fd = it->first;
+        Connection* conn = it->second;
+        it++;                                                           // advance first, remove_connection erases the current entry
+        queued_bytes += conn->get_outq()->get_bytes();
+        queued_messages += conn->get_outq()->get_depth();
+        if (conn->get_cleanup() && conn->get_session() && !cleanup) { // the session outlives its socket
+            detach_connection(conn);
+        }
+        else if (conn->get_cleanup()) {
+            log_info("Client %d disconnected", fd);
+            remove_connection(conn);
+            log_info("New number of connections on shard %d: %ld", id, connections->size());
+        }
+    }
+    for (auto it : *released) delete it;                               // their sockets live on in other sessions, the reactor is done with them now
+    released->clear();
+    metrics->queued_bytes.set(queued_bytes);
+    metrics->queued_messages.set(queued_messages);
+    return 0;
+}
+
+// function which looks up a topic this shard has published to before, returns NULL if it is not cached
+struct topic* Shard::find_cached_topic(std::string_view name) {
+    auto it = topic_cache->find(name);
+    if (it == topic_cache->end()) return NULL;
+    return it->second;
+}
+
+// function which remembers the node of a topic published to on this shard, so the next publish to it skips the tree walk
+// the key is the node's own interned name, so the cache holds no copies of topic names
+int Shard::cache_topic(struct topic* topic) {
+    if (topic_cache->size() >= TOPIC_CACHE_SIZE) topic_cache->clear();    // the hot topics will be back after one more walk each
+    (*topic_cache)[std::string_view(topic->name, topic->name_len)] = topic;
+    return 0;
+}
+
+// function which returns the time on the monotonic clock in microseconds
+static uint64_t now_usec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// function which adds a connection to the list flushed at the end of this reactor iteration
+// publishes only ever queue, so however many land on a connection in one iteration, it is written to once
+int Shard::schedule_flush(Connection* connection) {
+    if (connection->get_flush_scheduled()) return 0;
+    connection->set_flush_scheduled(1);
+    if (flush_delay) connection->set_flush_since(now_usec());
+    to_flush->push_back(connection);
+    return 0;
+}
+
+// function which flushes the connections that queued output, with one writev() each
+// with a flush delay, like Nagle's algorithm a connection is held back until its oldest unflushed frame has waited out the delay
+// or it has FLUSH_BYTES queued, so frames published across several iterations still go out together, force flushes everything
+// returns the milliseconds the reactor may wait before a held back connection is due, or POLL_TIMEOUT if nothing is held back
+int Shard::flush_connections(int force) {
+    if (!flush_delay || force) {
+        for (auto it : *to_flush) {
+            it->set_flush_scheduled(0);
+            it->flush();
+        }
+        to_flush->clear();
+        return POLL_TIMEOUT;
+    }
+
+    uint64_t now = now_usec();
+    uint64_t next_due = 0;
+    unsigned long kept = 0;
+    for (auto it : *to_flush) {
+        uint64_t due = it->get_flush_since() + flush_delay;
+        if (due > now && it->get_outq()->get_bytes() < FLUSH_BYTES && !it->get_cleanup()) {
+            to_flush->at(kept++) = it;                                  // not due yet, keep it in the list
+            if (!next_due || due < next_due) next_due = due;
+            continue;
+        }
+        it->set_flush_scheduled(0);
+        it->flush();
+    }
+    to_flush->resize(kept);
+    if (!next_due) return POLL_TIMEOUT;
+    return (next_due - now + 999) / 1000;                               // round up, waking early would only find nothing due
+}
+
+// function which starts streaming a snapshot to one of this shard's connections, it is pumped every iteration until it is done
+int Shard::add_snapshot(Snapshot* snapshot) {
+    snapshots->push_back(snapshot);
+    Connection* connection = snapshot->get_connection();
+    connection->set_snapshots(connection->get_snapshots() + 1);
+    return 0;
+}
+
+// function which queues what it can from every snapshot in progress, and lets go of the ones that have finished
+int Shard::pump_snapshots() {
+    unsigned long kept = 0;
+    for (auto it : *snapshots) {
+        if (it->pump() == 0) {
+            snapshots->at(kept++) = it;
+            continue;
+        }
+        Connection* connection = it->get_connection();
+        connection->set_snapshots(connection->get_snapshots() - 1);
+        it->unref();
+    }
+    snapshots->resize(kept);
+    return 0;
+}
+
+// function which checks if any snapshot has messages ready for a connection with room for them, so the reactor should not wait
+int Shard::snapshots_pending() {
+    for (auto it : *snapshots) {
+        if (it->has_pending()) return 1;
+    }
+    return 0;
+}
+
+// function which tells the snapshots streaming to a connection that it was just sent a live message
+int Shard::mark_live(Connection* connection, Message* message) {
+    for (auto it : *snapshots) {
+        if (it->get_connection() == connection) it->mark_live(message);
+    }
+    return 0;
+}
+
+// function which sends a message to connections owned by this shard
+// targets are looked up by fd and checked by id, so a connection closed since the message was routed is skipped,
+// a session whose socket changed since it subscribed is found by id instead, and one without a socket queues the message
+int Shard::deliver(Message* message, std::vector<delivery_target_t>* targets) {
+    for (auto& it : *targets) {
+        Connection* connection = NULL;
+        auto conn = connections->find(it.fd);
+        if (conn != connections->end() && conn->second->get_id() == it.id) connection = conn->second;
+        else if (sessions->size() > 0) {
+            auto session = sessions->find(it.id);
+            if (session != sessions->end()) connection = session->second;
+        }
+        if (!connection) continue;
+        connection->publish_to_client(message, message->get_published(), it.qos); // a connection being cleaned up drops it, unless it is a session
+    }
+    return 0;
+}
+
+// function which takes on a client the listening socket just gave us
+int Shard::accept_client(int client_fd, struct sockaddr_in* client_addr) {
+    log_info("Connection from %s:%d on shard %d", inet_ntoa(client_addr->sin_addr), ntohs(client_addr->sin_port), id);
+
+    if (create_connection(client_fd)) {                                 // if the connection object could not be created, close the socket
+        char buf[PACKET_SIZE] = {};
+        snprintf(buf, PACKET_SIZE, "Cannot join server, please try again later\n");
+        write(client_fd, buf, PACKET_SIZE);
+        close(client_fd);
+        return 1;
+    }
+    return 0;
+}
+
+// function called by an epoll reactor when this shard's listening socket has pending connections
+// accepts until the socket would block, so a burst of clients is handled in one wakeup
+int Shard::handle_readable() {
+    struct sockaddr_in client_addr;
+    int client_fd;
+    while (1) {
+        socklen_t clientsize = sizeof client_addr;
+        client_fd = accept4(server_fd, (struct sockaddr*) &client_addr, &clientsize, SOCK_NONBLOCK); // accept the client with its socket set to nonblocking
+        if (client_fd == -1) {
+            if (errno == EINTR) continue;
+            return 0;                                                   // EAGAIN means there is nobody left to accept
+        }
+        accept_client(client_fd, &client_addr);
+    }
+}
+
+// function called by an io_uring reactor for each client its multishot accept on the listening socket took
+int Shard::handle_accepted(int client_fd) {
+    struct sockaddr_in client_addr = {};
+    socklen_t clientsize = sizeof client_addr;
+    getpeername(client_fd, (struct sockaddr*) &client_addr, &clientsize); // a multishot accept has nowhere to put each client's address
+    return accept_client(client_fd, &client_addr);
+}
+
+// the listening socket is never written to
+int Shard::handle_writable() {
+    return 0;
+}
+
+// the listening socket should never hang up, but if it errors there is nothing to accept anymore
+int Shard::handle_hangup() {
+    log_error("Listening socket on shard %d errored, shutting down", id);
+    cleanup = 1;
+    return 1;
+}
+
+// the shard's loop, which dispatches reactor events until a signal sets the cleanup flag
+// on shutdown it asks every client to disconnect and keeps the reactor running until they ack or time out
+int Shard::run() {
+    int timeout = POLL_TIMEOUT;
+    while (!cleanup) {
+        if (reactor->poll_events(timeout) == -1) break;                 // the timeout lets us notice the cleanup flag, timers shorten it as they need
+        pump_snapshots();                                               // queue retained messages for subscribers with room, between everything else
+        timeout = flush_connections(0);                                 // and wakes us up in time to flush output held back by the flush delay
+        if (snapshots_pending()) timeout = 0;                           // the flush made room for more, come straight back for it
+        reap_connections();
+        if (report_memory && id == 0) {                                 // SIGUSR1 asked for the topic tree's footprint
+            report_memory = 0;
+            server->memory_report();
+        }
+        Epoch::reclaim();                                               // free any subscriber lists or retained messages this shard replaced that no reader can still see
+    }
+
+    log_info("Shard %d shutting down, disconnecting %ld clients", id, connections->size());
+    reactor->remove_fd(server_fd);                                      // stop accepting new clients
+    for (auto it : *connections) {                                      // if the connection is not already being cleaned up, disconnect the client
+        if (!it.second->get_cleanup()) it.second->disconnect_client();
+    }
+
+    flush_connections(1);
+    while (connections->size() > 0) {                                   // wait for the DISC_ACKs to come back, each connection's timer gives up on it after DISC_TIMEOUT
+        if (reactor->poll_events(POLL_TIMEOUT) == -1) break;
+        flush_connections(1);
+        reap_connections();
+    }
+
+    while (connections->size() > 0) remove_connection(connections->begin()->second); // only if the reactor failed
+    while (sessions->size() > 0) remove_connection(sessions->begin()->second); // sessions do not outlive the server
+    for (auto it : *released) delete it;
+    released->clear();
+
+    return 0;
+}
+
+// the body of the shard's thread, pins itself to a core and runs the shard's loop
+void Shard::thread_loop(Shard* shard) {
+    Log::set_thread_name("shard %d", shard->get_id());
+    int ncpus = std::thread::hardware_concurrency();
+    if (ncpus > 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(shard->get_id() % ncpus, &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus)) log_warn("Could not pin shard %d to a core", shard->get_id());
+    }
+    shard->run();
+}
+
+// function which starts the shard's thread
+int Shard::start() {
+    this->thread = new std::thread(thread_loop, this);
+    return 0;
+}
+
+// function which waits for the shard's thread to finish
+int Shard::join() {
+    if (thread) {
+        thread->join();
+        delete thread;
+        thread = NULL;
+    }
+    return 0;
+}
+
+Shard::Shard(int id, int server_fd, Server* server) {
+    this->id = id;
+    this->server_fd = server_fd;
+    this->server = server;
+    this->flush_delay = server->get_flush_delay();
+    this->reactor = new Reactor(server->get_backend());
+    this->inbox = new Inbox(this);
+    reactor->accept_on(server_fd, this);                                // the reactor tells us when there are clients to accept, or accepts them
+    reactor->add_fd(inbox->get_event_fd(), EPOLLIN, inbox);             // and when other shards have posted deliveries for us
+}
+
+Shard::~Shard() {
+    join();
+    while (connections->size() > 0) remove_connection(connections->begin()->second);
+    while (sessions->size() > 0) remove_connection(sessions->begin()->second);
+    for (auto it : *released) delete it;
+    delete connections;
+    delete sessions;
+    delete released;
+    delete to_flush;
+    delete snapshots;
+    delete topic_cache;
+    delete inbox;
+    delete reactor;
+    delete metrics;                                                     // the connections gave back their queued counts as they went
+    close(server_fd);
+}
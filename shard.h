@@ -0,0 +1,149 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <time.h>
+#include <atomic>
+#include <map>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "frame.h"
+#include "log.h"
+#include "message.h"
+#include "metrics.h"
+#include "reactor.h"
+
+#define POLL_TIMEOUT 100              // milliseconds the reactor waits for events, so the shard notices the cleanup flag
+#define FLUSH_BYTES (64 * 1024)       // with a flush delay, a connection with this much queued is flushed without waiting out the delay
+#define TOPIC_CACHE_SIZE 65536        // max topics a shard remembers the nodes of, the cache starts over once it is full
+
+class Server;
+class Shard;
+class Connection;
+class Snapshot;
+struct topic;
+
+// a connection on the target shard a delivery is for, named by fd and id rather than pointer, as the target shard may have closed it by the time it looks
+typedef struct delivery_target {
+    int fd;
+    int qos;                          // the QoS the connection subscribed at
+    uint64_t id;
+} delivery_target_t;
+
+// a client's socket on its way to the shard holding the session it named in its CONN
+typedef struct session_handoff {
+    int fd;
+    int version;
+    int clean;                        // the client asked for its session to be started over
+    uint64_t session;                 // the id of the connection holding the session
+    std::string client_id;
+    std::string input;                // whatever the client sent after its CONN that was read before the socket was handed over
+} session_handoff_t;
+
+// a delivery handed from one shard to another, carrying a reference to the message and the connections on the target shard it is for,
+// or a socket handed to the shard holding its session, in which case message and targets are NULL
+typedef struct inbox_item {
+    struct inbox_item* next;
+    Message* message;
+    std::vector<delivery_target_t>* targets;
+    session_handoff_t* handoff = NULL;
+} inbox_item_t;
+
+// Inbox class, a lock-free multi-producer single-consumer queue of deliveries for one shard
+// producers push onto an atomic stack and poke an eventfd, the owning shard's reactor wakes up and drains it in order
+class Inbox : public EventHandler {
+    private:
+        int event_fd;
+        Shard* shard;
+        std::atomic<inbox_item_t*> head;
+        std::atomic<int> notified;      // set while a wakeup is pending, so a burst of pushes costs one eventfd write
+        inbox_item_t* pop_all();
+
+    public:
+        Inbox(Shard* shard);
+        ~Inbox();
+        int push(inbox_item_t* item);
+        int push(inbox_item_t* newest, inbox_item_t* oldest);
+        int wake();
+        int handle_readable();
+        int handle_writable();
+        int handle_hangup();
+        int get_event_fd() { return event_fd; }
+};
+
+// Shard class, one reactor thread pinned to a core with its own SO_REUSEPORT listening socket and the connections it accepted
+// everything a shard owns is only touched from its own thread, other shards reach it through its inbox
+class Shard : public EventHandler {
+    private:
+        int id;
+        int server_fd;
+        Server* server;
+        Reactor* reactor;
+        Inbox* inbox;
+        std::thread* thread = NULL;
+        std::map<int, Connection*>* connections = new std::map<int, Connection*>();
+        std::unordered_map<uint64_t, Connection*>* sessions = new std::unordered_map<uint64_t, Connection*>(); // connections holding a session, by id, with or without a socket
+        std::vector<Connection*>* released = new std::vector<Connection*>(); // connections whose socket was handed to another session, deleted once the reactor is done with them
+        std::vector<Connection*>* to_flush = new std::vector<Connection*>();  // connections that queued output and have not been flushed yet
+        std::vector<Snapshot*>* snapshots = new std::vector<Snapshot*>();     // retained snapshots being streamed to this shard's connections
+        std::unordered_map<std::string_view, struct topic*>* topic_cache = new std::unordered_map<std::string_view, struct topic*>(); // topics published to on this shard, keyed by their interned names
+        shard_metrics_t* metrics = new shard_metrics_t();  // only written by this shard's thread, read by the metrics thread
+        uint64_t flush_delay;           // microseconds a connection's output may wait for more frames to coalesce with, 0 to flush every iteration
+        static void thread_loop(Shard* shard);
+        int flush_connections(int force);
+        int reap_connections();
+        int detach_connection(Connection* connection);
+        int cancel_snapshots(Connection* connection);
+        int unschedule_flush(Connection* connection);
+        int pump_snapshots();
+        int snapshots_pending();
+        int accept_client(int client_fd, struct sockaddr_in* client_addr);
+
+    public:
+        Shard(int id, int server_fd, Server* server);
+        ~Shard();
+        int start();
+        int run();
+        int join();
+        int create_connection(int client_fd);
+        int remove_connection(Connection* connection);
+        int open_session(Connection* connection, const std::string& client_id, int clean);
+        int take_session(session_handoff_t* handoff);
+        int expire_session(Connection* connection);
+        int schedule_flush(Connection* connection);
+        int deliver(Message* message, std::vector<delivery_target_t>* targets);
+        int post(inbox_item_t* item) { return inbox->push(item); }
+        int post(inbox_item_t* newest, inbox_item_t* oldest) { return inbox->push(newest, oldest); }
+        int wake() { return inbox->wake(); }
+        int add_snapshot(Snapshot* snapshot);
+        int mark_live(Connection* connection, Message* message);
+        struct topic* find_cached_topic(std::string_view name);
+        int cache_topic(struct topic* topic);
+        int handle_readable();
+        int handle_writable();
+        int handle_hangup();
+        int handle_accepted(int client_fd);
+        int get_id() { return id; }
+        Server* get_server() { return server; }
+        Reactor* get_reactor() { return reactor; }
+        shard_metrics_t* get_metrics() { return metrics; }
+        std::map<int, Connection*>* get_connections() { return connections; }
+};
+
+#endif
@@ -0,0 +1,293 @@
+#include "snapshot.h"
+#include "server.h"
+#include "connection.h"
+#include "shard.h"
+
+// the body of each worker thread, which runs tasks until the pool is deleted
+void SnapshotPool::worker_loop(SnapshotPool* pool, int id) {
+    Log::set_thread_name("snapshot %d", id);
+    while (1) {
+        std::unique_lock<std::mutex> guard(pool->lock);
+        pool->wakeup.wait(guard, [pool]() { return pool->stop || pool->tasks->size() > 0; });
+        if (pool->stop) return;
+        snapshot_task_t* task = pool->tasks->front();
+        pool->tasks->pop_front();
+        guard.unlock();
+        task->snapshot->walk(task, SIZE_MAX);
+    }
+}
+
+// function which queues a task for the next free worker, this can be called from any thread
+int SnapshotPool::push(snapshot_task_t* task) {
+    std::lock_guard<std::mutex> guard(lock);
+    tasks->push_back(task);
+    wakeup.notify_one();
+    return 0;
+}
+
+// function which returns how many workers the server's pool is started with, one for every two cores
+int SnapshotPool::default_threads() {
+    return std::max(1u, std::thread::hardware_concurrency() / 2);
+}
+
+SnapshotPool::SnapshotPool(int nthreads) {
+    for (int i = 0; i < nthreads; i++) threads->push_back(new std::thread(worker_loop, this, i));
+}
+
+SnapshotPool::~SnapshotPool() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stop = 1;
+    }
+    wakeup.notify_all();
+    for (auto it : *threads) {
+        it->join();
+        delete it;
+    }
+    delete threads;
+    for (auto it : *tasks) it->snapshot->drop_task(it);                 // tasks nobody got to before shutdown
+    delete tasks;
+}
+
+// function which creates a task for this snapshot, each task holds a reference to it
+snapshot_task_t* Snapshot::new_task() {
+    snapshot_task_t* task = new snapshot_task_t;
+    task->snapshot = this;
+    ntasks++;
+    ref();
+    return task;
+}
+
+// function which starts the walk from the root on the calling shard
+// a filter matching only a few topics is walked completely here, anything bigger is handed to the pool after SNAPSHOT_INLINE nodes
+int Snapshot::start() {
+    snapshot_task_t* task = new_task();
+    task->stack.push_back({server->get_root(), 0});
+    if (walk(task, SNAPSHOT_INLINE)) pool->push(task);
+    return 0;
+}
+
+// function which walks a task's nodes depth first, collecting retained messages into chunks for the shard
+// a task with too many nodes left gives the oldest half, the biggest subtrees, to another worker, and a task that gets too far ahead
+// of the subscriber parks itself until the shard has taken a chunk
+// returns 1 if the budget ran out before the task was done, in which case the caller still owns the task
+int Snapshot::walk(snapshot_task_t* task, size_t budget) {
+    std::vector<Message*>* chunk = new std::vector<Message*>();
+    size_t visited = 0;
+    while (task->stack.size() > 0 && !cancelled.load()) {
+        if (visited++ >= budget) {                                      // the caller queues the rest, if the shard is behind it parks on its next chunk
+            if (chunk->size() > 0) offer(chunk);
+            else delete chunk;
+            return 1;
+        }
+        if (task->stack.size() > SNAPSHOT_SPLIT) {
+            snapshot_task_t* half = new_task();
+            size_t n = task->stack.size() / 2;
+            half->stack.assign(task->stack.begin(), task->stack.begin() + n);
+            task->stack.erase(task->stack.begin(), task->stack.begin() + n);
+            pool->push(half);
+        }
+
+        snapshot_frame_t frame = task->stack.back();
+        task->stack.pop_back();
+        expand(task, frame, chunk);
+        if (chunk->size() >= SNAPSHOT_CHUNK) {
+            int full = offer(chunk);
+            chunk = new std::vector<Message*>();
+            if (full) {
+                delete chunk;
+                park(task);
+                return 0;
+            }
+        }
+    }
+
+    if (chunk->size() > 0 && !cancelled.load()) offer(chunk);
+    else {
+        for (auto it : *chunk) it->unref();
+        delete chunk;
+    }
+    drop_task(task);
+    return 0;
+}
+
+// function which expands one node like Server::expand_topic does, adding the retained messages of matching children to the chunk
+// and pushing the children whose subtrees may hold more matches
+int Snapshot::expand(snapshot_task_t* task, snapshot_frame_t frame, std::vector<Message*>* chunk) {
+    std::string_view rest = std::string_view(filter).substr(frame.pos);
+    size_t slash = rest.find('/');
+    std::string_view level = rest.substr(0, slash);
+    task->children.clear();
+    {
+        std::shared_lock<std::shared_mutex> read_lock(frame.topic->lock);
+        if (level == "+" || level == "#") {
+            for (uint32_t i = 0; i < frame.topic->subtopics.capacity; i++) {
+                topic_t* child = frame.topic->subtopics.slots[i].topic;
+                if (child && !child->wildcard && !(frame.topic == server->get_root() && child->name[0] == '$')) task->children.push_back(child); // $ topics are only sent to filters naming them
+            }
+        }
+        else {
+            topic_t* child = server->child_of(frame.topic, level);
+            if (child) task->children.push_back(child);
+        }
+    }
+
+    EpochGuard guard;                                                   // keeps each retained message alive until it has been given a reference
+    for (auto it : task->children) {
+        int matches = level == "#" || slash == std::string_view::npos;
+        if (matches) {
+            Message* retain = server->load_retained(it);
+            if (retain) {
+                retain->ref();
+                chunk->push_back(retain);
+            }
+        }
+        if (level == "#") task->stack.push_back({it, frame.pos});       // # matches the rest of the levels
+        else if (slash != std::string_view::npos) task->stack.push_back({it, (uint32_t) (frame.pos + slash + 1)});
+    }
+    return 0;
+}
+
+// function which hands a chunk to the shard, waking it if it had nothing waiting
+// returns 1 if the shard is now SNAPSHOT_AHEAD chunks behind and the walk should park
+int Snapshot::offer(std::vector<Message*>* chunk) {
+    std::lock_guard<std::mutex> guard(lock);
+    ready->push_back(chunk);
+    if (nready.fetch_add(1) == 0) shard->wake();
+    return ready->size() >= SNAPSHOT_AHEAD;
+}
+
+// function which parks a task until the shard takes a chunk, or requeues it straight away if the shard already has
+int Snapshot::park(snapshot_task_t* task) {
+    std::unique_lock<std::mutex> guard(lock);
+    if (ready->size() < SNAPSHOT_AHEAD) {
+        guard.unlock();
+        pool->push(task);
+        return 0;
+    }
+    parked->push_back(task);
+    return 0;
+}
+
+// function which requeues every parked task, called by the shard once it has made room
+int Snapshot::unpark() {
+    std::vector<snapshot_task_t*> tasks;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        tasks.swap(*parked);
+    }
+    for (auto it : tasks) pool->push(it);
+    return 0;
+}
+
+// function which deletes a finished, cancelled or abandoned task, dropping its reference
+int Snapshot::drop_task(snapshot_task_t* task) {
+    delete task;
+    if (ntasks.fetch_sub(1) == 1 && !cancelled.load()) shard->wake();  // the last walk may not have had a chunk to hand over, the shard still has to notice it is done
+    unref();
+    return 0;
+}
+
+// function which queues retained messages from ready chunks, run by the shard every iteration
+// at most a chunk's worth is queued per iteration, and only while the subscriber's queue is under half its budget
+// returns 1 once the snapshot is finished or cancelled and the shard should let go of it
+int Snapshot::pump() {
+    if (cancelled.load()) return 1;
+    if (connection->get_cleanup()) return 0;                            // the shard is about to remove the connection and cancel us
+    if (!connection->find_subscription(filter_node)) {                  // the client unsubscribed, nobody wants the rest
+        cancel();
+        return 1;
+    }
+
+    size_t watermark = server->get_queue_budget() / 2;
+    for (int queued = 0; queued < SNAPSHOT_CHUNK && connection->get_outq()->get_bytes() < watermark; queued++) {
+        if (!current || current_pos == current->size()) {
+            delete current;
+            current = NULL;
+            current_pos = 0;
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                if (ready->size() > 0) {
+                    current = ready->front();
+                    ready->pop_front();
+                    nready--;
+                }
+            }
+            if (!current) break;
+            unpark();
+        }
+
+        Message* message = current->at(current_pos);
+        current->at(current_pos++) = NULL;
+        if (live->size() > 0 && live->count(std::string(message->get_topic(), message->get_topic_len()))) skipped++;
+        else {
+            Message* marked = connection->get_peer() ? message->as_snapshot() : NULL; // a link's node tells it apart from a live PUBRET
+            if (connection->queue_publish(marked ? marked : message, 0, qos) == 0) sent++;
+            if (marked) marked->unref();
+        }
+        message->unref();
+    }
+    if (current && current_pos == current->size()) {                   // let go of a finished chunk now, it may have been the last
+        delete current;
+        current = NULL;
+        current_pos = 0;
+    }
+
+    if (ntasks.load() > 0 || nready.load() > 0 || current) return 0;
+    log_info("Sent %lu retained messages for %s to client %d, skipped %lu superseded by live publishes", sent, filter.c_str(), connection->get_client_fd(), skipped);
+    return 1;
+}
+
+// function which checks if the shard has messages it could queue right now, so it polls again without waiting
+int Snapshot::has_pending() {
+    if (cancelled.load() || connection->get_cleanup()) return 0;
+    if (nready.load() == 0 && (!current || current_pos == current->size())) return 0;
+    return connection->get_outq()->get_bytes() < server->get_queue_budget() / 2;
+}
+
+// function which records that the subscriber was sent a live message, so the snapshot does not follow it with an older retained one
+int Snapshot::mark_live(Message* message) {
+    if (cancelled.load()) return 0;
+    live->insert(std::string(message->get_topic(), message->get_topic_len()));
+    return 0;
+}
+
+// function which stops the snapshot, the workers drop their tasks when they next look and parked tasks are dropped here
+int Snapshot::cancel() {
+    cancelled.store(1);
+    std::vector<snapshot_task_t*> tasks;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        tasks.swap(*parked);
+    }
+    for (auto it : tasks) drop_task(it);
+    return 0;
+}
+
+Snapshot::Snapshot(Server* server, Connection* connection, struct topic* filter_node, const char* filter, int qos) {
+    this->server = server;
+    this->pool = server->get_snapshot_pool();
+    this->shard = connection->get_shard();
+    this->connection = connection;
+    this->filter_node = filter_node;
+    this->filter = filter;
+    this->qos = qos;
+    this->refs.store(1);
+    this->nready.store(0);
+    this->ntasks.store(0);
+    this->cancelled.store(0);
+}
+
+Snapshot::~Snapshot() {
+    for (auto chunk : *ready) {
+        for (auto it : *chunk) it->unref();
+        delete chunk;
+    }
+    delete ready;
+    if (current) {
+        for (size_t i = current_pos; i < current->size(); i++) current->at(i)->unref();
+        delete current;
+    }
+    delete parked;
+    delete live;
+}
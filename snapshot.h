@@ -0,0 +1,112 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "log.h"
+#include "message.h"
+
+#define SNAPSHOT_CHUNK 256            // retained messages a walk collects before handing them to the subscriber's shard
+#define SNAPSHOT_AHEAD 8              // chunks a snapshot may have waiting on its shard before its walks park until the subscriber catches up
+#define SNAPSHOT_SPLIT 64             // nodes a walk may have left to visit before it hands half of them to another worker
+#define SNAPSHOT_INLINE 4096          // nodes the subscribing shard walks itself, a filter matching fewer topics than this never leaves the shard
+
+class Server;
+class Shard;
+class Connection;
+class Snapshot;
+class SnapshotPool;
+struct topic;
+
+// a node a walk still has to expand, and where the level its children must match starts in the filter
+typedef struct snapshot_frame {
+    struct topic* topic;
+    uint32_t pos;
+} snapshot_frame_t;
+
+// a piece of a snapshot's walk, the nodes left to expand depth first, which a worker can run, park or split in two
+typedef struct snapshot_task {
+    Snapshot* snapshot;
+    std::vector<snapshot_frame_t> stack;
+    std::vector<struct topic*> children;            // scratch space for copying a node's children out from under its lock
+} snapshot_task_t;
+
+// SnapshotPool class, the worker threads that walk large snapshots off the shards' threads
+class SnapshotPool {
+    private:
+        std::vector<std::thread*>* threads = new std::vector<std::thread*>();
+        std::deque<snapshot_task_t*>* tasks = new std::deque<snapshot_task_t*>();
+        std::mutex lock;
+        std::condition_variable wakeup;
+        int stop = 0;
+        static void worker_loop(SnapshotPool* pool, int id);
+
+    public:
+        SnapshotPool(int nthreads);
+        ~SnapshotPool();
+        static int default_threads();
+        int push(snapshot_task_t* task);
+};
+
+// Snapshot class, the retained messages of every topic matching a new filter subscription, streamed to the subscriber
+// the walk starts on the subscribing shard and, if the filter matches more than a handful of topics, carries on in the pool,
+// split across workers, which hand chunks of retained messages back to the shard; the shard queues them only while the subscriber's
+// queue is below half its budget, between its other work, and the walks park while too many chunks are waiting, so neither the
+// shard nor the server's memory is held hostage by one big subscribe
+// a topic that gets a live publish to the subscriber before its retained message is reached is skipped, so a subscriber never sees
+// a retained message older than a publish it already has
+class Snapshot {
+    private:
+        std::atomic<int> refs;                      // the shard's, plus one for every task
+        Server* server;
+        SnapshotPool* pool;
+        Shard* shard;
+        Connection* connection;                     // only dereferenced on the shard, which cancels the snapshot before deleting it
+        struct topic* filter_node;                  // the subscription's node, the snapshot is dropped once the client unsubscribes
+        std::string filter;
+        int qos;                                    // the QoS the filter was subscribed at
+        std::mutex lock;                            // guards ready and parked, the only state shared by the workers and the shard
+        std::deque<std::vector<Message*>*>* ready = new std::deque<std::vector<Message*>*>(); // chunks waiting for the shard, each message holds a reference
+        std::vector<snapshot_task_t*>* parked = new std::vector<snapshot_task_t*>();         // walks waiting for the shard to take a chunk
+        std::atomic<int> nready;
+        std::atomic<int> ntasks;                    // tasks queued, running or parked, the walk is done once this reaches 0
+        std::atomic<int> cancelled;
+        std::vector<Message*>* current = NULL;      // the chunk the shard is queuing from, and how far it has got
+        size_t current_pos = 0;
+        std::unordered_set<std::string>* live = new std::unordered_set<std::string>(); // topics published to the subscriber since the snapshot started
+        unsigned long sent = 0;
+        unsigned long skipped = 0;
+        snapshot_task_t* new_task();
+        int expand(snapshot_task_t* task, snapshot_frame_t frame, std::vector<Message*>* chunk);
+        int offer(std::vector<Message*>* chunk);
+        int park(snapshot_task_t* task);
+        int unpark();
+        ~Snapshot();
+
+    public:
+        Snapshot(Server* server, Connection* connection, struct topic* filter_node, const char* filter, int qos);
+        int start();
+        int walk(snapshot_task_t* task, size_t budget);
+        int drop_task(snapshot_task_t* task);
+        int pump();
+        int has_pending();
+        int mark_live(Message* message);
+        int cancel();
+        void ref() { refs.fetch_add(1); }
+        void unref() { if (refs.fetch_sub(1) == 1) delete this; }
+        Connection* get_connection() { return connection; }
+};
+
+#endif
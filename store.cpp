@@ -0,0 +1,324 @@
+#include "store.h"
+
+static const char index_magic[8] = {'R', 'E', 'T', 'I', 'D', 'X', '0', '2'}; // the last two are the format's version
+
+// function which extends a CRC-32 checksum over len more bytes, start with 0 and pass the result back in to continue it
+static uint32_t crc32_update(uint32_t crc, const void* data, size_t len) {
+    static uint32_t table[256];
+    static std::once_flag table_once;
+    std::call_once(table_once, []() {                                   // the reflected 0xEDB88320 table, built on first use
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+    });
+
+    const uint8_t* p = (const uint8_t*) data;
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+// function which checksums a record, the lengths first so a record cut short cannot pass as a shorter one
+static uint32_t record_crc(const record_header_t* header, const char* topic, const char* msg) {
+    uint32_t crc = crc32_update(0, &header->topic_len, sizeof(uint32_t) * 2);
+    crc = crc32_update(crc, topic, header->topic_len);
+    return crc32_update(crc, msg, header->msg_len);
+}
+
+// function which reads exactly len bytes at offset, returns 0 on success and 1 on a short read or error
+static int pread_all(int fd, void* buf, size_t len, off_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(fd, (char*) buf + done, len - done, offset + done);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return 1;
+        done += n;
+    }
+    return 0;
+}
+
+std::string RetainStore::segment_path(uint32_t id) {
+    char name[32];
+    snprintf(name, sizeof(name), "/segment-%010u.log", id);
+    return dir + name;
+}
+
+// function which opens a segment and adds it to the segment map, the caller must hold the lock exclusively or be the only thread
+// returns 0 on success and 1 on failure
+int RetainStore::open_segment(uint32_t id, int create) {
+    int fd = open(segment_path(id).c_str(), O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0), 0644);
+    if (fd == -1) {
+        log_error("Could not open retained store segment %s: %s", segment_path(id).c_str(), strerror(errno));
+        return 1;
+    }
+    (*segments)[id] = fd;
+    return 0;
+}
+
+// function which replays a segment's records from an offset, calling fn for each one, and cuts the segment off at the first bad record
+// a bad record can only be a write torn by a crash, so anything after it in the same segment was never acknowledged
+// returns the number of bytes of good records replayed
+int RetainStore::recover_segment(uint32_t id, uint64_t from, int (*fn)(void*, const char*, size_t, uint64_t, uint64_t), void* ctx) {
+    int fd = segments->at(id);
+    struct stat st;
+    if (fstat(fd, &st) == -1) return 0;
+
+    std::string buf;
+    uint64_t offset = from;
+    while (offset + sizeof(record_header_t) <= (uint64_t) st.st_size) {
+        record_header_t header;
+        if (pread_all(fd, &header, sizeof(header), offset)) break;
+        uint64_t body = (uint64_t) header.topic_len + header.msg_len;
+        if (offset + sizeof(header) + body > (uint64_t) st.st_size) break;
+        buf.resize(body);
+        if (pread_all(fd, &buf[0], body, offset + sizeof(header))) break;
+        if (record_crc(&header, buf.data(), buf.data() + header.topic_len) != header.crc) break;
+        fn(ctx, buf.data(), header.topic_len, LOCATION(id, offset), record_size(header.topic_len, header.msg_len));
+        offset += sizeof(header) + body;
+    }
+
+    if (offset < (uint64_t) st.st_size) {                               // drop the torn tail so appends continue from a clean end
+        log_warn("Retained store segment %u has a bad record at offset %lu, truncating %lu bytes", id, offset, st.st_size - offset);
+        if (ftruncate(fd, offset) == -1) log_error("Could not truncate segment %u: %s", id, strerror(errno));
+        else total -= st.st_size - offset;
+    }
+    return offset - from;
+}
+
+// function which opens the store, creating its directory if needed, and reports every retained topic in it to fn
+// the index is mapped and walked first, then only the records written after it are replayed from the log, in order,
+// so fn may be called more than once for a topic and the last call wins, it is also told each record's size
+// returns 0 on success and 1 if the store could not be opened
+int RetainStore::open_store(int (*fn)(void* ctx, const char* topic, size_t topic_len, uint64_t location, uint64_t size), void* ctx) {
+    if (mkdir(dir.c_str(), 0755) == -1 && errno != EEXIST) {
+        log_error("Could not create retained store %s: %s", dir.c_str(), strerror(errno));
+        return 1;
+    }
+
+    DIR* d = opendir(dir.c_str());
+    if (!d) {
+        log_error("Could not open retained store %s: %s", dir.c_str(), strerror(errno));
+        return 1;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(d))) {                                      // find every segment, the ids order them
+        uint32_t id;
+        char tail;
+        if (sscanf(entry->d_name, "segment-%u.lo%c", &id, &tail) != 2 || tail != 'g' || id == 0) continue;
+        if (open_segment(id, 0)) {
+            closedir(d);
+            return 1;
+        }
+        struct stat st;
+        if (fstat(segments->at(id), &st) == 0) total += st.st_size;
+    }
+    closedir(d);
+
+    uint64_t hwm = 0;
+    int index_fd = open((dir + "/index").c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (index_fd != -1 && fstat(index_fd, &st) == 0 && (size_t) st.st_size >= sizeof(index_header_t)) {
+        char* map = (char*) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, index_fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            index_header_t* header = (index_header_t*) map;
+            char* end = map + st.st_size;
+            if (memcmp(header->magic, index_magic, sizeof(index_magic) - 2) == 0 && memcmp(header->magic, index_magic, sizeof(index_magic)) != 0) {
+                log_info("Retained store index is from another version, replaying the whole log");
+            }
+            else if (memcmp(header->magic, index_magic, sizeof(index_magic)) == 0
+                && crc32_update(0, map + sizeof(index_header_t), st.st_size - sizeof(index_header_t)) == header->crc) {
+                char* p = map + sizeof(index_header_t);
+                for (uint64_t i = 0; i < header->count && p + sizeof(index_entry_t) <= end; i++) {
+                    index_entry_t* it = (index_entry_t*) p;
+                    const char* topic = p + sizeof(index_entry_t);
+                    if (topic + it->topic_len > end) break;
+                    if (segments->count(LOCATION_SEGMENT(it->location))) fn(ctx, topic, it->topic_len, it->location, it->size);
+                    p += sizeof(index_entry_t) + it->topic_len;
+                }
+                hwm = header->hwm;
+            }
+            else log_warn("Retained store index is corrupt, replaying the whole log");
+            munmap(map, st.st_size);
+        }
+    }
+    if (index_fd != -1) close(index_fd);
+
+    uint64_t replayed = 0;
+    for (auto it : *segments) {                                         // replay everything the index does not cover
+        if (it.first < LOCATION_SEGMENT(hwm)) continue;
+        replayed += recover_segment(it.first, it.first == LOCATION_SEGMENT(hwm) ? LOCATION_OFFSET(hwm) : 0, fn, ctx);
+    }
+    appended = replayed;                                                // a long replay gets a fresh index soon
+
+    if (segments->size() == 0 && open_segment(1, 1)) return 1;         // an empty store starts at segment 1, location 0 means none
+    active = segments->rbegin()->first;
+    if (fstat(segments->at(active), &st) == -1) return 1;
+    active_size = st.st_size;
+    lseek(segments->at(active), 0, SEEK_END);
+    return 0;
+}
+
+// function which appends a retained message to the log
+// returns its location, or 0 if it could not be written
+uint64_t RetainStore::append(const char* topic, size_t topic_len, const char* msg, size_t msg_len) {
+    record_header_t header = {0, (uint32_t) topic_len, (uint32_t) msg_len};
+    header.crc = record_crc(&header, topic, msg);                       // computed before taking the lock
+    size_t size = record_size(topic_len, msg_len);
+
+    std::unique_lock<std::shared_mutex> write_lock(lock);
+    if (active_size > 0 && active_size + size > SEGMENT_SIZE) start_segment(); // a record bigger than a segment gets one to itself
+
+    struct iovec iov[3] = {{&header, sizeof(header)}, {(void*) topic, topic_len}, {(void*) msg, msg_len}};
+    int fd = segments->at(active);
+    ssize_t nwritten;
+    while ((nwritten = writev(fd, iov, 3)) == -1 && errno == EINTR);
+    if (nwritten != (ssize_t) size) {                                   // leave the segment ending at the last whole record
+        log_error("Could not append to retained store: %s", nwritten == -1 ? strerror(errno) : "short write");
+        if (ftruncate(fd, active_size) == -1 || lseek(fd, active_size, SEEK_SET) == -1) log_error("Could not trim segment %u", active);
+        return 0;
+    }
+
+    uint64_t location = LOCATION(active, active_size);
+    active_size += size;
+    total += size;
+    appended += size;
+    return location;
+}
+
+// function which reads a retained message back from the log as a PUBRET ready to queue
+// returns NULL if the location is not in the store anymore, which happens once compaction has moved the record
+Message* RetainStore::read(uint64_t location) {
+    std::shared_lock<std::shared_mutex> read_lock(lock);              // holding the lock keeps the segment from being dropped under us
+    auto it = segments->find(LOCATION_SEGMENT(location));
+    if (it == segments->end()) return NULL;
+
+    record_header_t header;
+    if (pread_all(it->second, &header, sizeof(header), LOCATION_OFFSET(location))) return NULL;
+    std::string buf(header.topic_len + (size_t) header.msg_len, '\0');
+    if (pread_all(it->second, &buf[0], buf.size(), LOCATION_OFFSET(location) + sizeof(header))) return NULL;
+    if (record_crc(&header, buf.data(), buf.data() + header.topic_len) != header.crc) {
+        log_error("Retained store record at %u:%u is corrupt", LOCATION_SEGMENT(location), LOCATION_OFFSET(location));
+        return NULL;
+    }
+    return Message::encode(OP_PUBRET, buf.data(), header.topic_len, buf.data() + header.topic_len, header.msg_len, PROTOCOL_FRAMED);
+}
+
+// function which flushes the active segment to disk
+int RetainStore::sync() {
+    std::shared_lock<std::shared_mutex> read_lock(lock);
+    return fdatasync(segments->at(active));
+}
+
+// function which seals the active segment and starts the next one
+// returns the id of the new segment, every segment before it is sealed and will not be appended to again
+uint32_t RetainStore::roll() {
+    std::unique_lock<std::shared_mutex> write_lock(lock);
+    start_segment();
+    return active;
+}
+
+// function which syncs the active segment and makes the next one active, the caller must hold the lock exclusively
+// if the next segment cannot be created appends carry on in the current one
+int RetainStore::start_segment() {
+    fdatasync(segments->at(active));
+    if (open_segment(active + 1, 1)) return 1;
+    active++;
+    active_size = 0;
+    return 0;
+}
+
+// function which deletes every segment before id, once compaction has moved everything live out of them
+int RetainStore::drop_segments_before(uint32_t id) {
+    std::unique_lock<std::shared_mutex> write_lock(lock);
+    uint64_t dropped = 0;
+    while (segments->size() > 0 && segments->begin()->first < id) {
+        struct stat st;
+        if (fstat(segments->begin()->second, &st) == 0) dropped += st.st_size;
+        close(segments->begin()->second);
+        unlink(segment_path(segments->begin()->first).c_str());
+        segments->erase(segments->begin());
+    }
+    total -= dropped;
+    garbage -= std::min(garbage.load(), dropped);                      // every record in them was superseded, the live ones by their compacted copies
+    return 0;
+}
+
+// function which returns the location the next append will get
+uint64_t RetainStore::get_hwm() {
+    std::shared_lock<std::shared_mutex> read_lock(lock);
+    return LOCATION(active, active_size);
+}
+
+// function which starts writing a new index covering everything before hwm, entries are then added one at a time
+// the index is written to a temporary file and only replaces the old one in finish_index, so a crash leaves the old one intact
+int RetainStore::begin_index(uint64_t hwm) {
+    index_file = fopen((dir + "/index.tmp").c_str(), "w");
+    if (!index_file) {
+        log_error("Could not write retained store index: %s", strerror(errno));
+        return 1;
+    }
+    index_header_t header = {};
+    fwrite(&header, sizeof(header), 1, index_file);                    // filled in by finish_index
+    index_crc = 0;
+    index_count = 0;
+    index_hwm = hwm;
+    appended = 0;
+    return 0;
+}
+
+// function which adds a topic and the location and size of its latest record to the index being written
+int RetainStore::add_index_entry(const char* topic, size_t topic_len, uint64_t location, uint64_t size) {
+    if (!index_file) return 1;
+    index_entry_t entry = {location, size, (uint32_t) topic_len};
+    fwrite(&entry, sizeof(entry), 1, index_file);
+    fwrite(topic, 1, topic_len, index_file);
+    index_crc = crc32_update(index_crc, &entry, sizeof(entry));
+    index_crc = crc32_update(index_crc, topic, topic_len);
+    index_count++;
+    return 0;
+}
+
+// function which finishes the index and atomically replaces the old one with it
+int RetainStore::finish_index() {
+    if (!index_file) return 1;
+    index_header_t header = {};
+    memcpy(header.magic, index_magic, sizeof(index_magic));
+    header.count = index_count;
+    header.hwm = index_hwm;
+    header.crc = index_crc;
+    fseek(index_file, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, index_file);
+    int failed = fflush(index_file) != 0 || fsync(fileno(index_file)) != 0;
+    fclose(index_file);
+    index_file = NULL;
+    if (failed || rename((dir + "/index.tmp").c_str(), (dir + "/index").c_str()) == -1) {
+        log_error("Could not write retained store index: %s", strerror(errno));
+        return 1;
+    }
+
+    int dir_fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);   // make the rename itself durable
+    if (dir_fd != -1) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+    return 0;
+}
+
+RetainStore::RetainStore(const char* dir) {
+    this->dir = dir;
+    this->appended.store(0);
+    this->garbage.store(0);
+    this->total.store(0);
+}
+
+RetainStore::~RetainStore() {
+    if (index_file) fclose(index_file);
+    for (auto it : *segments) {
+        fdatasync(it.second);
+        close(it.second);
+    }
+    delete segments;
+}
@@ -0,0 +1,103 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+
+#include "log.h"
+#include "message.h"
+
+#define SEGMENT_SIZE (64 * 1024 * 1024)   // bytes a log segment may grow to before the store starts the next one
+#define STORE_SYNC_MS 1000                // milliseconds between fdatasyncs of the active segment, a crash loses at most this much
+#define INDEX_INTERVAL (64 * 1024 * 1024) // bytes appended since the last index before a new index is written, bounds replay at startup
+#define COMPACT_MIN (64 * 1024 * 1024)    // superseded bytes the log must hold before it is worth compacting
+
+// the location of a record in the log, the segment id in the high 32 bits and the byte offset in the low 32, 0 for none
+#define LOCATION(segment, offset) (((uint64_t) (segment) << 32) | (uint32_t) (offset))
+#define LOCATION_SEGMENT(location) ((uint32_t) ((location) >> 32))
+#define LOCATION_OFFSET(location) ((uint32_t) (location))
+
+// a log record, followed by the topic and then the message
+// the checksum covers the lengths, the topic and the message, so a torn write at the end of the log is found and cut off
+typedef struct record_header {
+    uint32_t crc;
+    uint32_t topic_len;
+    uint32_t msg_len;
+} record_header_t;
+
+// the index starts with this header, followed by count entries, each an index_entry_t and then its topic
+// every record at or after the high-water mark is newer than the index and is replayed from the log at startup
+typedef struct index_header {
+    char magic[8];
+    uint64_t count;
+    uint64_t hwm;                         // location of the first record the index does not cover
+    uint32_t crc;                         // checksum of everything after the header
+    uint32_t reserved;
+} index_header_t;
+
+typedef struct index_entry {
+    uint64_t location;
+    uint64_t size;                        // bytes of the record, header included, so the store knows how much of the log is live
+    uint32_t topic_len;
+} __attribute__((packed)) index_entry_t;
+
+// RetainStore class, keeps retained messages on disk so they survive a restart
+// every PUBRET is appended to a segmented, checksummed log, a compacted index of topic to the location of its latest record
+// is written now and then, and at startup the index is mapped and walked instead of replaying the whole log,
+// the store only deals in files and locations, which topic owns which location lives in the topic tree
+class RetainStore {
+    private:
+        std::string dir;
+        std::shared_mutex lock;                         // shared to read a record, exclusive to append, roll or drop segments
+        std::map<uint32_t, int>* segments = new std::map<uint32_t, int>(); // every segment on disk, by id, with an open fd
+        uint32_t active = 0;                            // the segment appends go to
+        uint32_t active_size = 0;
+        std::atomic<uint64_t> appended;                 // bytes appended since the last index was written
+        std::atomic<uint64_t> garbage;                  // bytes of records that have since been superseded
+        std::atomic<uint64_t> total;                    // bytes in every segment
+        FILE* index_file = NULL;                        // the index being written, between begin_index and finish_index
+        uint32_t index_crc;
+        uint64_t index_count;
+        uint64_t index_hwm;
+        std::string segment_path(uint32_t id);
+        int open_segment(uint32_t id, int create);
+        int start_segment();
+        int recover_segment(uint32_t id, uint64_t from, int (*fn)(void*, const char*, size_t, uint64_t, uint64_t), void* ctx);
+
+    public:
+        RetainStore(const char* dir);
+        ~RetainStore();
+        int open_store(int (*fn)(void* ctx, const char* topic, size_t topic_len, uint64_t location, uint64_t size), void* ctx);
+        uint64_t append(const char* topic, size_t topic_len, const char* msg, size_t msg_len);
+        Message* read(uint64_t location);
+        int sync();
+        uint32_t roll();
+        int drop_segments_before(uint32_t id);
+        uint64_t get_hwm();
+        int begin_index(uint64_t hwm);
+        int add_index_entry(const char* topic, size_t topic_len, uint64_t location, uint64_t size);
+        int finish_index();
+        void supersede(uint64_t bytes) { garbage += bytes; }
+        void set_garbage(uint64_t bytes) { garbage = bytes; }
+        uint64_t get_appended() { return appended; }
+        uint64_t get_garbage() { return garbage; }
+        uint64_t get_total() { return total; }
+        static uint64_t record_size(size_t topic_len, size_t msg_len) { return sizeof(record_header_t) + topic_len + msg_len; }
+};
+
+#endif
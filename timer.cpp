@@ -0,0 +1,121 @@
+#include "timer.h"
+
+// function which returns the time on the monotonic clock in milliseconds
+uint64_t TimerWheel::now_msec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// function which links a timer into the slot its deadline falls in, at the lowest level whose span reaches it
+int TimerWheel::place(wheel_timer_t* timer) {
+    uint64_t delta = timer->expires - tick;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= (uint64_t) 1 << (WHEEL_BITS * (level + 1))) level++;
+    int slot = (timer->expires >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+
+    wheel_timer_t** head = &slots[level][slot];
+    timer->next = *head;
+    if (*head) (*head)->pprev = &timer->next;
+    *head = timer;
+    timer->pprev = head;
+    timer->level = level;
+    timer->slot = slot;
+    occupied[level] |= (uint64_t) 1 << slot;
+    count++;
+    return 0;
+}
+
+// function which takes a timer out of its slot
+int TimerWheel::unlink(wheel_timer_t* timer) {
+    *timer->pprev = timer->next;
+    if (timer->next) timer->next->pprev = timer->pprev;
+    if (!slots[timer->level][timer->slot]) occupied[timer->level] &= ~((uint64_t) 1 << timer->slot);
+    timer->next = NULL;
+    timer->pprev = NULL;
+    count--;
+    return 0;
+}
+
+// function which moves every timer in the level's current slot down to where it now belongs, once the level below has come round to it
+int TimerWheel::cascade(int level) {
+    int slot = (tick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+    wheel_timer_t* timer = slots[level][slot];
+    slots[level][slot] = NULL;
+    occupied[level] &= ~((uint64_t) 1 << slot);
+    while (timer) {
+        wheel_timer_t* next = timer->next;
+        count--;
+        place(timer);
+        timer = next;
+    }
+    return 0;
+}
+
+// function which arms a timer to fire delay_ms from now, re-arming it if it is already armed
+int TimerWheel::arm(wheel_timer_t* timer, uint64_t delay_ms) {
+    if (timer->pprev) unlink(timer);
+    uint64_t due = (now_msec() - start + delay_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS; // round up, a timer never fires early
+    uint64_t max = tick + ((uint64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    timer->expires = due <= tick ? tick + 1 : due > max ? max : due;
+    return place(timer);
+}
+
+// function which disarms a timer, returns 1 if it was not armed
+int TimerWheel::cancel(wheel_timer_t* timer) {
+    if (!timer->pprev) return 1;
+    return unlink(timer);
+}
+
+// function which runs every timer that is due, the reactor calls this after dispatching each batch of events
+// returns the number of timers fired
+int TimerWheel::advance() {
+    uint64_t target = (now_msec() - start) / TIMER_TICK_MS;
+    int fired = 0;
+    while (tick < target) {
+        if (count == 0) {                                                   // nothing armed, nothing to cascade either
+            tick = target;
+            break;
+        }
+        if (occupied[0] == 0) {                                             // nothing fires before level 0 comes round, skip to the end of its turn
+            uint64_t end = tick | (WHEEL_SLOTS - 1);
+            if (end > tick) {
+                tick = end < target ? end : target;
+                continue;
+            }
+        }
+        tick++;
+        for (int level = 1; level < WHEEL_LEVELS && ((tick >> (WHEEL_BITS * (level - 1))) & (WHEEL_SLOTS - 1)) == 0; level++) cascade(level);
+        wheel_timer_t** head = &slots[0][tick & (WHEEL_SLOTS - 1)];
+        while (*head) {                                                     // everything in the slot is due now, and fn cannot arm a timer for this tick
+            wheel_timer_t* timer = *head;
+            unlink(timer);
+            timer->fn(timer->ctx);
+            fired++;
+        }
+    }
+    return fired;
+}
+
+// function which shortens a reactor timeout in milliseconds, -1 for none, so the reactor wakes up in time for the next tick with work
+// a tick where only a higher level cascades counts as work, it may bring a timer down that is due within the next turn of level 0
+int TimerWheel::next_timeout(int timeout) {
+    if (count == 0) return timeout;
+    int cur = tick & (WHEEL_SLOTS - 1);
+    int shift = (cur + 1) & (WHEEL_SLOTS - 1);
+    uint64_t rotated = shift ? (occupied[0] >> shift) | (occupied[0] << (WHEEL_SLOTS - shift)) : occupied[0];
+    uint64_t ticks = rotated ? __builtin_ctzll(rotated) + 1 : WHEEL_SLOTS; // the next occupied slot of level 0, in ticks from now
+    uint64_t upper = 0;
+    for (int level = 1; level < WHEEL_LEVELS; level++) upper |= occupied[level];
+    if (upper && (uint64_t) (WHEEL_SLOTS - cur) < ticks) ticks = WHEEL_SLOTS - cur;
+
+    uint64_t due = (tick + ticks) * TIMER_TICK_MS;
+    uint64_t now = now_msec() - start;
+    uint64_t wait = due > now ? due - now : 0;
+    if (timeout >= 0 && (uint64_t) timeout < wait) return timeout;
+    return (int) wait;
+}
+
+TimerWheel::TimerWheel() {
+    this->start = now_msec();
+}
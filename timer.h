@@ -0,0 +1,52 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#define TIMER_TICK_MS 10              // resolution of the timer wheel, a timer fires on the first tick at or after its deadline
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS) // slots per level, one bit each in the level's occupancy word
+#define WHEEL_LEVELS 4                // the top level spans 64^4 ticks, about 46 hours, longer delays are clamped to that
+
+// a timer, embedded in whatever it times out, so arming one never allocates and a wheel can hold as many as there are owners
+// fn is called with ctx from the reactor's thread once the timer expires, by then it is no longer armed and fn may arm it again
+typedef struct wheel_timer {
+    struct wheel_timer* next = NULL;
+    struct wheel_timer** pprev = NULL;  // the pointer pointing at this timer, NULL while it is not armed
+    uint64_t expires = 0;               // the tick it is due on
+    uint8_t level = 0;
+    uint8_t slot = 0;
+    int (*fn)(void* ctx) = NULL;
+    void* ctx = NULL;
+} wheel_timer_t;
+
+// TimerWheel class, a hierarchical timing wheel of intrusive timers, driven by the reactor that owns it
+// level 0 has a slot per tick and each level above has a slot per full turn of the one below, a timer goes in the lowest level
+// whose span covers its delay and moves down a level each time the wheel below comes round to it, so arming and cancelling are
+// O(1) list operations and each timer is moved at most WHEEL_LEVELS - 1 times whatever its delay
+// a wheel is only ever used from its reactor's thread
+class TimerWheel {
+    private:
+        wheel_timer_t* slots[WHEEL_LEVELS][WHEEL_SLOTS] = {};
+        uint64_t occupied[WHEEL_LEVELS] = {};   // bit n set while slot n of the level has timers
+        uint64_t start;                 // the monotonic clock in milliseconds when the wheel was made, tick 0
+        uint64_t tick = 0;              // the last tick run, every timer due on or before it has fired
+        size_t count = 0;
+        int place(wheel_timer_t* timer);
+        int unlink(wheel_timer_t* timer);
+        int cascade(int level);
+
+    public:
+        TimerWheel();
+        int arm(wheel_timer_t* timer, uint64_t delay_ms);
+        int cancel(wheel_timer_t* timer);
+        int advance();
+        int next_timeout(int timeout);
+        static uint64_t now_msec();
+        size_t get_count() { return count; }
+};
+
+#endif
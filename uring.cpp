@@ -0,0 +1,172 @@
+#include "uring.h"
+
+// function which calls io_uring_enter, returns what it returned, or -1 with errno set
+int IoUring::enter(uint32_t to_submit, uint32_t min_complete, uint32_t flags, void* arg, size_t argsz) {
+    return (int) syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+// function which maps the submission and completion rings and the SQE array the kernel set up for the ring
+int IoUring::map_rings() {
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {                    // both rings live in one mapping
+        if (cq_ring_size > sq_ring_size) sq_ring_size = cq_ring_size;
+        cq_ring_size = 0;
+    }
+    sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) return 1;
+    if (cq_ring_size) {
+        cq_ring = mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED) return 1;
+    }
+    sqes = (struct io_uring_sqe*) mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) return 1;
+
+    char* sq = (char*) sq_ring;
+    char* cq = cq_ring_size ? (char*) cq_ring : sq;
+    sq_head = (uint32_t*) (sq + params.sq_off.head);
+    sq_tail = (uint32_t*) (sq + params.sq_off.tail);
+    sq_mask = *(uint32_t*) (sq + params.sq_off.ring_mask);
+    uint32_t* array = (uint32_t*) (sq + params.sq_off.array);
+    for (uint32_t i = 0; i < params.sq_entries; i++) array[i] = i;    // SQEs are used in ring order, so the indirection array never changes
+    sq_local_tail = *sq_tail;
+    cq_head = (uint32_t*) (cq + params.cq_off.head);
+    cq_tail = (uint32_t*) (cq + params.cq_off.tail);
+    cq_mask = *(uint32_t*) (cq + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+    return 0;
+}
+
+// function which registers the ring of provided buffers under URING_BUFFER_GROUP and fills it
+int IoUring::register_buffers() {
+    buf_ring = (struct io_uring_buf_ring*) mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);                            // the kernel wants it page aligned
+    if (buf_ring == MAP_FAILED) return 1;
+    buffers = (char*) malloc((size_t) URING_BUFFERS * URING_BUFFER_SIZE);
+    if (!buffers) return 1;
+
+    struct io_uring_buf_reg reg = {};
+    reg.ring_addr = (uint64_t) buf_ring;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) return 1;
+    for (int i = 0; i < URING_BUFFERS; i++) recycle_buffer(i);
+    return 0;
+}
+
+// function which hands the kernel a free submission queue entry, zeroed, submitting what is queued first if the ring is full
+// returns NULL if there is still no room
+struct io_uring_sqe* IoUring::get_sqe() {
+    if (sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= params.sq_entries) {
+        submit();
+        if (sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= params.sq_entries) return NULL;
+    }
+    struct io_uring_sqe* sqe = &sqes[sq_local_tail & sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_local_tail++;
+    return sqe;
+}
+
+// function which submits every queued entry without waiting for anything to complete
+// returns the number submitted, or -1 with errno set
+int IoUring::submit() {
+    __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+    uint32_t to_submit = sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    if (to_submit == 0) return 0;
+    int ret;
+    do {
+        ret = enter(to_submit, 0, 0, NULL, 0);
+    } while (ret == -1 && errno == EINTR);
+    if (ret == -1) log_error("io_uring_enter failed to submit: %s", strerror(errno));
+    return ret;
+}
+
+// function which submits every queued entry and waits up to timeout milliseconds, -1 for ever, for a completion
+// does not wait if a completion is already there, so whatever queued is submitted with the same syscall that waits
+// returns 0, also on a timeout or a signal, or -1 with errno set if the ring failed
+int IoUring::wait(int timeout) {
+    __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+    uint32_t to_submit = sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    if (peek()) return to_submit ? (submit() == -1 ? -1 : 0) : 0;
+
+    struct __kernel_timespec ts = {};
+    struct io_uring_getevents_arg arg = {};
+    if (timeout >= 0) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (long long) (timeout % 1000) * 1000000;
+        arg.ts = (uint64_t) &ts;
+    }
+    if (enter(to_submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) == -1) {
+        if (errno == ETIME || errno == EINTR) return 0;                 // the caller checks its timers and cleanup flag either way
+        log_error("io_uring_enter failed: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// function which returns the oldest completion the caller has not consumed, or NULL if there is none
+struct io_uring_cqe* IoUring::peek() {
+    uint32_t head = *cq_head;
+    if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+    return &cqes[head & cq_mask];
+}
+
+// function which consumes the completion peek returned, so the kernel can reuse its slot
+void IoUring::advance() {
+    __atomic_store_n(cq_head, *cq_head + 1, __ATOMIC_RELEASE);
+}
+
+// function which hands a provided buffer back to the kernel once the data a completion put in it has been copied out
+int IoUring::recycle_buffer(uint16_t bid) {
+    // the entries start at the start of the ring, buf_ring->bufs is 8 bytes past it in C++, where the uapi header's flex array
+    // macro puts an empty struct of size 1 before it
+    struct io_uring_buf* buf = (struct io_uring_buf*) buf_ring + (buf_tail & (URING_BUFFERS - 1));
+    buf->addr = (uint64_t) get_buffer(bid);
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = bid;
+    buf_tail++;
+    __atomic_store_n(&buf_ring->tail, buf_tail, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// function which checks whether this kernel lets us set up a ring with everything the reactor needs, returns 1 if it does
+int IoUring::supported() {
+    IoUring ring(8);
+    return ring.get_ring_fd() != -1;
+}
+
+IoUring::IoUring(unsigned entries) {
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    params.cq_entries = entries * 4;
+    this->ring_fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+    if (ring_fd == -1 && errno == EINVAL) {                             // an older kernel without the optional flags
+        params = {};
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = entries * 4;
+        this->ring_fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+    }
+    if (ring_fd == -1) {
+        log_error("Failed to create io_uring instance: %s", strerror(errno));
+        return;
+    }
+
+    const char* failed = NULL;
+    if (!(params.features & IORING_FEAT_EXT_ARG)) failed = "the kernel cannot wait with a timeout";
+    else if (map_rings()) failed = strerror(errno);
+    else if (register_buffers()) failed = strerror(errno);
+    if (failed) {
+        log_error("Failed to set up io_uring instance: %s", failed);
+        close(ring_fd);
+        ring_fd = -1;
+    }
+}
+
+IoUring::~IoUring() {
+    if (ring_fd != -1) close(ring_fd);                                  // also unregisters the buffer ring
+    if (sqes != MAP_FAILED) munmap(sqes, params.sq_entries * sizeof(struct io_uring_sqe));
+    if (cq_ring != MAP_FAILED) munmap(cq_ring, cq_ring_size);
+    if (sq_ring != MAP_FAILED) munmap(sq_ring, sq_ring_size);
+    if (buf_ring != MAP_FAILED) munmap(buf_ring, URING_BUFFERS * sizeof(struct io_uring_buf));
+    free(buffers);
+}
@@ -0,0 +1,64 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "log.h"
+
+#define URING_ENTRIES 1024            // submission queue slots, the completion queue has four times as many for multishot completions
+#define URING_BUFFERS 512             // buffers the kernel picks from for multishot recvs, a power of two
+#define URING_BUFFER_SIZE 4096        // bytes in each, a recv completion never carries more than one buffer
+#define URING_BUFFER_GROUP 0
+
+// IoUring class, the io_uring syscalls and the rings they share with the kernel, without liburing
+// besides the submission and completion rings it registers one ring of provided buffers, a recv that selects a buffer takes one off it
+// and the caller hands it back with recycle_buffer once it has copied the data out
+// a ring is only ever used from its reactor's thread
+class IoUring {
+    private:
+        int ring_fd = -1;
+        struct io_uring_params params = {};
+        void* sq_ring = MAP_FAILED;
+        void* cq_ring = MAP_FAILED;
+        size_t sq_ring_size = 0;
+        size_t cq_ring_size = 0;
+        struct io_uring_sqe* sqes = (struct io_uring_sqe*) MAP_FAILED;
+        uint32_t* sq_head;
+        uint32_t* sq_tail;
+        uint32_t sq_mask;
+        uint32_t sq_local_tail = 0;     // SQEs handed out, the kernel only sees them once the tail is published
+        uint32_t* cq_head;
+        uint32_t* cq_tail;
+        uint32_t cq_mask;
+        struct io_uring_cqe* cqes;
+        struct io_uring_buf_ring* buf_ring = (struct io_uring_buf_ring*) MAP_FAILED;
+        char* buffers = NULL;
+        uint16_t buf_tail = 0;
+        int map_rings();
+        int register_buffers();
+        int enter(uint32_t to_submit, uint32_t min_complete, uint32_t flags, void* arg, size_t argsz);
+
+    public:
+        IoUring(unsigned entries);
+        ~IoUring();
+        struct io_uring_sqe* get_sqe();
+        int submit();
+        int wait(int timeout);
+        struct io_uring_cqe* peek();
+        void advance();
+        char* get_buffer(uint16_t bid) { return buffers + (size_t) bid * URING_BUFFER_SIZE; }
+        int recycle_buffer(uint16_t bid);
+        int get_ring_fd() { return ring_fd; }
+        static int supported();
+};
+
+#endif